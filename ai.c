@@ -0,0 +1,723 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* posix_memalign */
+
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ai.h"
+#include "pool.h"
+
+#define MAX_PLACEMENTS MOVEGEN_MAX_PLACEMENTS
+#define TABLE_WAYS 3
+
+/* score of a board on which the next block cannot even enter */
+#define GAME_OVER_PENALTY (-1e9)
+
+const struct ai_weights ai_default_weights = {
+    .height = -0.510066,
+    .lines = 0.760666,
+    .holes = -0.35663,
+    .bumpiness = -0.184483,
+    .wells = -0.1,
+};
+
+struct placement {
+    int8_t x, y, orientation;
+    int8_t rotations, shift; /* inputs of a drop-only placement */
+    int16_t index;           /* placement of the move generator */
+};
+
+/* Enumerate the placements reachable from (x, y) by turning the block in
+ * place, sliding it sideways and dropping it, which is the order in which
+ * ai_apply_move() replays them.
+ */
+static int enumerate(const row_t *board,
+                     int type,
+                     int orientation,
+                     int x,
+                     int y,
+                     struct placement *out)
+{
+    int count = 0, o = orientation;
+
+    if (!block_fits(board, type, o, x, y))
+        return 0;
+
+    for (int r = 0; r < TOTAL_DEGREES; r++) {
+        if (r) {
+            o = (o + TOTAL_DEGREES - 1) % TOTAL_DEGREES;
+            if (!block_fits(board, type, o, x, y))
+                break; /* the engine would refuse the turn */
+        }
+
+        /* orientations with the same cells give the same placements */
+        bool duplicate = false;
+        for (int i = 0, p = orientation; i < r && !duplicate;
+             i++, p = (p + TOTAL_DEGREES - 1) % TOTAL_DEGREES)
+            duplicate = !memcmp(&positions[type][p], &positions[type][o],
+                                sizeof(struct position));
+        if (duplicate)
+            continue;
+
+        for (int dir = -1; dir <= 1; dir += 2) {
+            for (int nx = dir < 0 ? x : x + 1; block_fits(board, type, o, nx, y);
+                 nx += dir) {
+                int ny = y;
+                while (block_fits(board, type, o, nx, ny + 1))
+                    ny++;
+                out[count++] = (struct placement){
+                    .x = nx,
+                    .y = ny,
+                    .orientation = o,
+                    .rotations = r,
+                    .shift = nx - x,
+                    .index = -1,
+                };
+            }
+        }
+    }
+
+    return count;
+}
+
+/* lock the block into the board, updating its key, and remove the
+ * completed rows
+ */
+static int place(row_t *board,
+                 uint64_t *hash,
+                 int type,
+                 const struct placement *p)
+{
+    uint64_t mask = block_mask(type, p->orientation, p->x);
+    store_rows(&board[p->y + 1], load_rows(&board[p->y + 1]) | mask);
+    for (int i = p->y + 1; mask; i++, mask >>= 16)
+        if ((row_t) mask)
+            *hash ^= row_hash(i, (row_t) mask);
+
+    int lines = 0;
+    for (int i = p->y + 1; i <= p->y + 4 && i <= GAME_BOARD_HEIGHT; i++) {
+        if (board[i] != BOARD_FULL_ROW)
+            continue;
+        *hash ^= board_hash(board, 1, i);
+        memmove(&board[2], &board[1], (i - 1) * sizeof(*board));
+        board[1] = BOARD_EMPTY_ROW;
+        *hash ^= board_hash(board, 1, i);
+        lines++;
+    }
+    return lines;
+}
+
+struct ai_table {
+    struct bucket {
+        uint64_t check[TABLE_WAYS]; /* key ^ value, to catch torn entries */
+        uint64_t value[TABLE_WAYS]; /* bits of the score */
+        uint8_t depth[TABLE_WAYS];  /* blocks placed below the entry */
+        char pad[64 - TABLE_WAYS * 17]; /* one cache line per bucket */
+    } *buckets;
+    uint64_t mask;
+};
+
+struct ai_table *ai_table_create(int bits)
+{
+    struct ai_table *table = malloc(sizeof(*table));
+    if (!table)
+        return NULL;
+
+    void *p;
+    size_t size = sizeof(*table->buckets) << bits;
+    if (posix_memalign(&p, 64, size)) {
+        free(table);
+        return NULL;
+    }
+    table->buckets = p;
+    table->mask = (1ULL << bits) - 1;
+    ai_table_clear(table);
+    return table;
+}
+
+void ai_table_destroy(struct ai_table *table)
+{
+    if (!table)
+        return;
+    free(table->buckets);
+    free(table);
+}
+
+void ai_table_clear(struct ai_table *table)
+{
+    memset(table->buckets, 0, sizeof(*table->buckets) * (table->mask + 1));
+}
+
+static bool table_probe(const struct ai_table *table,
+                        uint64_t key,
+                        double *score)
+{
+    const struct bucket *b = &table->buckets[key & table->mask];
+
+    for (int i = 0; i < TABLE_WAYS; i++) {
+        uint64_t check = __atomic_load_n(&b->check[i], __ATOMIC_RELAXED);
+        uint64_t value = __atomic_load_n(&b->value[i], __ATOMIC_RELAXED);
+        if ((check ^ value) == key && (check || value)) {
+            memcpy(score, &value, sizeof(*score));
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Replace the entry of the same key if any, else the one with the fewest
+ * blocks searched below it: those are the cheapest to recompute.
+ */
+static void table_store(struct ai_table *table,
+                        uint64_t key,
+                        int depth,
+                        double score)
+{
+    struct bucket *b = &table->buckets[key & table->mask];
+    int victim = 0, min_depth = 256;
+
+    for (int i = 0; i < TABLE_WAYS; i++) {
+        uint64_t check = __atomic_load_n(&b->check[i], __ATOMIC_RELAXED);
+        uint64_t value = __atomic_load_n(&b->value[i], __ATOMIC_RELAXED);
+        if ((check ^ value) == key) {
+            victim = i;
+            break;
+        }
+        int d = __atomic_load_n(&b->depth[i], __ATOMIC_RELAXED);
+        if (d < min_depth) {
+            min_depth = d;
+            victim = i;
+        }
+    }
+
+    uint64_t value;
+    memcpy(&value, &score, sizeof(value));
+    __atomic_store_n(&b->check[victim], key ^ value, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->value[victim], value, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->depth[victim], (uint8_t) depth, __ATOMIC_RELAXED);
+}
+
+struct search {
+    const struct ai_options *options;
+    const struct ai_weights *weights;
+    struct ai_scratch *scratch;
+    int depth;                               /* last ply to place */
+    struct piece pieces[AI_MAX_LOOKAHEAD + 1]; /* block placed at each ply */
+    uint64_t keys[AI_MAX_LOOKAHEAD + 2]; /* of the blocks from each ply on */
+    unsigned long long evaluations, probes, hits;
+};
+
+/* placements of a block for the given ply of the search */
+static int generate(struct search *s,
+                    int ply,
+                    const row_t *board,
+                    int x,
+                    int y,
+                    struct placement *out)
+{
+    int type = s->pieces[ply].type, orientation = s->pieces[ply].orientation;
+
+    if (!s->options->reachability)
+        return enumerate(board, type, orientation, x, y, out);
+
+    struct movegen_placement *found = s->scratch->placements[ply];
+    int count = movegen_run(&s->scratch->gen[ply], board, type, orientation,
+                            x, y, ply == 0, found);
+    for (int i = 0; i < count; i++)
+        out[i] = (struct placement){
+            .x = found[i].x,
+            .y = found[i].y,
+            .orientation = found[i].orientation,
+            .index = i,
+        };
+    return count;
+}
+
+static double search(struct search *s,
+                     const row_t *board,
+                     uint64_t hash,
+                     int ply);
+
+/* Score the placements of the block of 'ply': the lines they clear plus the
+ * best that follows them, or at the last ply the evaluator's score, taken
+ * a batch of boards at a time.
+ */
+static void score_placements(struct search *s,
+                             const row_t *board,
+                             uint64_t hash,
+                             int ply,
+                             const struct placement *list,
+                             int n,
+                             double *scores)
+{
+    struct ai_batch batch;
+    int lines[AI_BATCH], pending = 0;
+
+    for (int i = 0; i < n; i++) {
+        row_t after[BOARD_ROWS];
+        uint64_t h = hash;
+        memcpy(after, board, sizeof(after));
+        int cleared = place(after, &h, s->pieces[ply].type, &list[i]);
+        if (ply < s->depth) {
+            scores[i] = s->weights->lines * cleared +
+                        search(s, after, h, ply + 1);
+            continue;
+        }
+
+        ai_batch_set(&batch, pending, after);
+        lines[pending++] = cleared;
+        if (pending == AI_BATCH || i == n - 1) {
+            double *out = &scores[i + 1 - pending];
+            ai_evaluate_batch(&batch, pending, s->weights, out);
+            for (int j = 0; j < pending; j++)
+                out[j] += s->weights->lines * lines[j];
+            s->evaluations += pending;
+            pending = 0;
+        }
+    }
+}
+
+/* Best score over the placements of the blocks from 'ply' on, entering at
+ * the starting position, not counting the lines cleared before 'ply'.
+ */
+static double search(struct search *s,
+                     const row_t *board,
+                     uint64_t hash,
+                     int ply)
+{
+    struct ai_table *table = s->options->table;
+    uint64_t key = hash ^ s->keys[ply];
+    double best;
+    if (table) {
+        s->probes++;
+        if (table_probe(table, key, &best)) {
+            s->hits++;
+            return best;
+        }
+    }
+
+    struct placement list[MAX_PLACEMENTS];
+    double scores[MAX_PLACEMENTS];
+    int n = generate(s, ply, board, starting_position.x, starting_position.y,
+                     list);
+    score_placements(s, board, hash, ply, list, n, scores);
+    if (!n) {
+        s->evaluations++;
+        best = ai_evaluate(board, 0, s->weights) + GAME_OVER_PENALTY;
+    } else {
+        best = -DBL_MAX;
+    }
+    for (int i = 0; i < n; i++)
+        if (scores[i] > best)
+            best = scores[i];
+
+    if (table)
+        table_store(table, key, s->depth - ply + 1, best);
+    return best;
+}
+
+/* Fill in a move from a placement of the current block, with the inputs of
+ * the generator's path if it came from one, or those of a drop otherwise.
+ */
+static bool make_move(const struct placement *p,
+                      double score,
+                      const struct movegen_scratch *gen,
+                      const struct movegen_placement *found,
+                      struct ai_move *move)
+{
+    move->x = p->x;
+    move->y = p->y;
+    move->orientation = p->orientation;
+    move->score = score;
+
+    if (gen) {
+        move->path_length = movegen_path(gen, found, move->path, AI_MAX_PATH);
+        return move->path_length >= 0;
+    }
+
+    int length = 0;
+    for (int i = 0; i < p->rotations; i++)
+        move->path[length++] = ACTION_ROTATE_LEFT;
+    for (int i = 0; i < p->shift; i++)
+        move->path[length++] = ACTION_MOVE_RIGHT;
+    for (int i = 0; i > p->shift; i--)
+        move->path[length++] = ACTION_MOVE_LEFT;
+    move->path[length++] = ACTION_DROP;
+    move->path_length = length;
+    return true;
+}
+
+bool ai_best_move(const struct tetris_game *game,
+                  const struct ai_options *options,
+                  struct ai_move *move)
+{
+    struct placement first[MAX_PLACEMENTS];
+    double scores[MAX_PLACEMENTS];
+    const struct block *current = &game->current;
+    struct ai_scratch local, *scratch = options->scratch;
+    struct search s = {
+        .options = options,
+        .weights = options->weights ? options->weights : &ai_default_weights,
+        .scratch = scratch,
+        .depth = options->lookahead,
+    };
+    double best = -DBL_MAX;
+    int best_index = -1;
+
+    if (game->game_over || !game->has_block)
+        return false;
+    if (options->reachability && !scratch)
+        s.scratch = scratch = &local;
+
+    /* the blocks to place, and the keys of the ones left at each ply */
+    if (s.depth > AI_MAX_LOOKAHEAD)
+        s.depth = AI_MAX_LOOKAHEAD;
+    if (s.depth > game->preview_length)
+        s.depth = game->preview_length;
+    if (s.depth < 0)
+        s.depth = 0;
+    s.pieces[0] = (struct piece){current->type, current->orientation};
+    for (int i = 1; i <= s.depth; i++)
+        s.pieces[i] = tetris_preview(game, i - 1);
+    s.keys[s.depth + 1] = 0;
+    for (int i = s.depth; i > 0; i--)
+        for (int j = i; j <= s.depth; j++)
+            s.keys[i] ^= zobrist_pieces[j - i][s.pieces[j].type]
+                                       [s.pieces[j].orientation];
+
+    int n = generate(&s, 0, game->board, current->origin.x, current->origin.y,
+                     first);
+    score_placements(&s, game->board, game->hash, 0, first, n, scores);
+    for (int i = 0; i < n; i++) {
+        if (scores[i] > best) {
+            best = scores[i];
+            best_index = i;
+        }
+    }
+
+    if (options->scratch) {
+        options->scratch->evaluations += s.evaluations;
+        options->scratch->probes += s.probes;
+        options->scratch->hits += s.hits;
+    }
+
+    if (best_index < 0)
+        return false;
+
+    const struct placement *p = &first[best_index];
+    return make_move(p, best, p->index >= 0 ? &scratch->gen[0] : NULL,
+                     p->index >= 0 ? &scratch->placements[0][p->index] : NULL,
+                     move);
+}
+
+struct beam_node {
+    row_t board[BOARD_ROWS];
+    uint64_t hash;
+    int lines; /* cleared since the root */
+    int root;  /* placement of the current block the node descends from */
+};
+
+/* a placement found while expanding a node, only made a node if selected */
+struct beam_child {
+    double score;
+    uint64_t hash;
+    int16_t parent, index;
+    int8_t x, y, orientation, lines;
+};
+
+/* working memory of one pool worker, on its own cache lines */
+struct beam_worker {
+    struct movegen_scratch gen;
+    struct movegen_placement found[MOVEGEN_MAX_PLACEMENTS];
+    struct placement list[MAX_PLACEMENTS];
+    char pad[64];
+};
+
+struct ai_beam {
+    struct pool *pool;
+    struct ai_beam_options options;
+    struct beam_worker *workers;
+
+    struct beam_node *nodes, *next; /* this level and the next, 'width' each */
+    struct beam_child *children;    /* MAX_PLACEMENTS per node */
+    struct beam_child **order;      /* children sorted by score */
+    int *counts;                    /* children of each node */
+    uint64_t *seen;                 /* hash set of the selected boards */
+    int seen_mask;
+
+    /* the level being expanded */
+    const struct ai_weights *weights;
+    struct piece piece;
+    int nnodes;
+
+    /* the placements of the current block, kept for the final path */
+    struct placement roots[MAX_PLACEMENTS];
+    struct movegen_scratch root_gen;
+    struct movegen_placement root_found[MOVEGEN_MAX_PLACEMENTS];
+};
+
+struct ai_beam *ai_beam_create(struct pool *pool,
+                               const struct ai_beam_options *options)
+{
+    struct ai_beam *beam = calloc(1, sizeof(*beam));
+    if (!beam)
+        return NULL;
+
+    beam->pool = pool;
+    beam->options = *options;
+    if (beam->options.width < 1)
+        beam->options.width = 1;
+    if (beam->options.depth > AI_BEAM_MAX_DEPTH)
+        beam->options.depth = AI_BEAM_MAX_DEPTH;
+    beam->weights = options->weights ? options->weights : &ai_default_weights;
+
+    int width = beam->options.width;
+    for (beam->seen_mask = 1; beam->seen_mask < 2 * width;)
+        beam->seen_mask <<= 1;
+    beam->workers = calloc(pool_size(pool), sizeof(*beam->workers));
+    beam->nodes = malloc(width * sizeof(*beam->nodes));
+    beam->next = malloc(width * sizeof(*beam->next));
+    beam->children = malloc(width * MAX_PLACEMENTS * sizeof(*beam->children));
+    beam->order = malloc(width * MAX_PLACEMENTS * sizeof(*beam->order));
+    beam->counts = malloc(width * sizeof(*beam->counts));
+    beam->seen = malloc(beam->seen_mask * sizeof(*beam->seen));
+    beam->seen_mask--;
+    if (!beam->workers || !beam->nodes || !beam->next || !beam->children ||
+        !beam->order || !beam->counts || !beam->seen) {
+        ai_beam_destroy(beam);
+        return NULL;
+    }
+    return beam;
+}
+
+void ai_beam_destroy(struct ai_beam *beam)
+{
+    if (!beam)
+        return;
+    free(beam->seen);
+    free(beam->counts);
+    free(beam->order);
+    free(beam->children);
+    free(beam->next);
+    free(beam->nodes);
+    free(beam->workers);
+    free(beam);
+}
+
+void ai_beam_set_budget(struct ai_beam *beam, int budget)
+{
+    beam->options.budget = budget;
+}
+
+/* Score the placements of the level's block on a node. The score of a
+ * board is the evaluator's, with every line cleared since the root.
+ */
+static int expand(struct ai_beam *beam,
+                  int parent,
+                  struct movegen_scratch *gen,
+                  struct movegen_placement *found,
+                  struct placement *list,
+                  int x,
+                  int y,
+                  bool paths)
+{
+    const struct beam_node *node = &beam->nodes[parent];
+    struct beam_child *out = &beam->children[parent * MAX_PLACEMENTS];
+    int type = beam->piece.type, orientation = beam->piece.orientation, n;
+
+    if (beam->options.reachability) {
+        n = movegen_run(gen, node->board, type, orientation, x, y, paths,
+                        found);
+        for (int i = 0; i < n; i++)
+            list[i] = (struct placement){
+                .x = found[i].x,
+                .y = found[i].y,
+                .orientation = found[i].orientation,
+                .index = i,
+            };
+    } else {
+        n = enumerate(node->board, type, orientation, x, y, list);
+    }
+
+    struct ai_batch batch;
+    double scores[AI_BATCH];
+    for (int i = 0; i < n; i++) {
+        row_t board[BOARD_ROWS];
+        uint64_t hash = node->hash;
+        memcpy(board, node->board, sizeof(board));
+        int lines = place(board, &hash, type, &list[i]);
+        out[i] = (struct beam_child){
+            .hash = hash,
+            .parent = parent,
+            .index = i,
+            .x = list[i].x,
+            .y = list[i].y,
+            .orientation = list[i].orientation,
+            .lines = lines,
+        };
+
+        int pending = i % AI_BATCH + 1;
+        ai_batch_set(&batch, pending - 1, board);
+        if (pending == AI_BATCH || i == n - 1) {
+            struct beam_child *c = &out[i + 1 - pending];
+            ai_evaluate_batch(&batch, pending, beam->weights, scores);
+            for (int j = 0; j < pending; j++)
+                c[j].score = beam->weights->lines * (node->lines + c[j].lines) +
+                             scores[j];
+        }
+    }
+    return n;
+}
+
+static void expand_job(void *arg, int job, int worker)
+{
+    struct ai_beam *beam = arg;
+    struct beam_worker *w = &beam->workers[worker];
+
+    beam->counts[job] =
+        expand(beam, job, &w->gen, w->found, w->list, starting_position.x,
+               starting_position.y, false);
+}
+
+/* best score first; equal scores keep the order in which they were found */
+static int compare_children(const void *a, const void *b)
+{
+    const struct beam_child *x = *(const struct beam_child *const *) a;
+    const struct beam_child *y = *(const struct beam_child *const *) b;
+
+    if (x->score != y->score)
+        return x->score < y->score ? 1 : -1;
+    return (x > y) - (x < y);
+}
+
+/* Pick the boards of the next level out of the children of this one, the
+ * same board reached through different placements only once. Returns the
+ * number of boards picked.
+ */
+static int select_level(struct ai_beam *beam, bool first)
+{
+    int total = 0;
+    for (int i = 0; i < beam->nnodes; i++)
+        for (int j = 0; j < beam->counts[i]; j++)
+            beam->order[total++] = &beam->children[i * MAX_PLACEMENTS + j];
+    qsort(beam->order, total, sizeof(*beam->order), compare_children);
+
+    memset(beam->seen, 0, (beam->seen_mask + 1) * sizeof(*beam->seen));
+    int count = 0;
+    for (int i = 0; i < total && count < beam->options.width; i++) {
+        const struct beam_child *c = beam->order[i];
+        uint64_t key = c->hash | 1; /* 0 marks an empty slot */
+        int h = key & beam->seen_mask;
+        while (beam->seen[h] && beam->seen[h] != key)
+            h = (h + 1) & beam->seen_mask;
+        if (beam->seen[h])
+            continue;
+        beam->seen[h] = key;
+
+        const struct beam_node *parent = &beam->nodes[c->parent];
+        struct beam_node *node = &beam->next[count++];
+        struct placement p = {
+            .x = c->x, .y = c->y, .orientation = c->orientation};
+        memcpy(node->board, parent->board, sizeof(node->board));
+        node->hash = parent->hash;
+        place(node->board, &node->hash, beam->piece.type, &p);
+        node->lines = parent->lines + c->lines;
+        node->root = first ? c->index : parent->root;
+    }
+    if (!count)
+        return 0; /* leave this level as it is */
+
+    struct beam_node *tmp = beam->nodes;
+    beam->nodes = beam->next;
+    beam->next = tmp;
+    beam->nnodes = count;
+    return count;
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 +
+           (now.tv_nsec - start->tv_nsec) * 1e-3;
+}
+
+bool ai_beam_move(struct ai_beam *beam,
+                  const struct tetris_game *game,
+                  struct ai_move *move)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (game->game_over || !game->has_block)
+        return false;
+
+    int depth = beam->options.depth;
+    if (depth > game->preview_length + 1)
+        depth = game->preview_length + 1;
+
+    /* the first level grows from the current block where it is now */
+    struct beam_node *root = &beam->nodes[0];
+    memcpy(root->board, game->board, sizeof(root->board));
+    root->hash = game->hash;
+    root->lines = 0;
+    root->root = -1;
+    beam->nnodes = 1;
+    beam->piece = (struct piece){game->current.type, game->current.orientation};
+    beam->counts[0] =
+        expand(beam, 0, &beam->root_gen, beam->root_found, beam->roots,
+               game->current.origin.x, game->current.origin.y, true);
+    if (!select_level(beam, true))
+        return false;
+
+    int best = beam->nodes[0].root, expanded = 1;
+    double score = beam->order[0]->score, last = 0;
+    for (int level = 1; level < depth; level++) {
+        /* stop if the next level is unlikely to fit in the budget, judging
+         * by how long each board of the last level took
+         */
+        double now = elapsed_us(&start);
+        double estimate = (now - last) / expanded * beam->nnodes;
+        if (beam->options.budget && now + estimate > beam->options.budget)
+            break;
+        last = now;
+        expanded = beam->nnodes;
+
+        beam->piece = tetris_preview(game, level - 1);
+        pool_run(beam->pool, beam->nnodes, expand_job, beam);
+        if (!select_level(beam, false))
+            break; /* every board tops out: keep the last best */
+        best = beam->nodes[0].root;
+        score = beam->order[0]->score;
+    }
+
+    const struct placement *p = &beam->roots[best];
+    return make_move(p, score,
+                     beam->options.reachability ? &beam->root_gen : NULL,
+                     beam->options.reachability ? &beam->root_found[best]
+                                                : NULL,
+                     move);
+}
+
+bool ai_apply_move(struct tetris_game *game, const struct ai_move *move)
+{
+    /* a step down is a tick of gravity, the block being free to fall */
+    for (int i = 0; i < move->path_length; i++) {
+        if (move->path[i] == ACTION_MOVE_DOWN)
+            tetris_tick(game);
+        else
+            tetris_step(game, move->path[i]);
+    }
+    tetris_step(game, ACTION_DROP); /* no-op if the path ends on the floor */
+
+    return game->current.origin.x == move->x &&
+           game->current.origin.y == move->y &&
+           game->current.orientation == move->orientation;
+}
@@ -0,0 +1,194 @@
+#ifndef __AI_H__
+#define __AI_H__
+
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#include "tetris.h"
+
+/* weights of the board features scored by the evaluator */
+struct ai_weights {
+    double height;    /* sum of the column heights */
+    double lines;     /* rows cleared by the placement */
+    double holes;     /* empty cells with a filled cell above */
+    double bumpiness; /* sum of height differences of adjacent columns */
+    double wells;     /* depth of columns lower than both neighbours */
+    double transitions; /* filled and empty cells side by side, walls too */
+};
+
+extern const struct ai_weights ai_default_weights;
+
+/* score of a board after clearing 'lines' rows */
+double ai_evaluate(const row_t *board, int lines, const struct ai_weights *w);
+
+/* Boards to evaluate together, stored row by row: rows[i][j] is row i + 1
+ * of the j-th board, so that one vector holds the same row of every board.
+ */
+#define AI_BATCH 16
+
+struct ai_batch {
+    row_t rows[GAME_BOARD_HEIGHT][AI_BATCH];
+};
+
+static inline void ai_batch_set(struct ai_batch *batch,
+                                int j,
+                                const row_t *board)
+{
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++)
+        batch->rows[i][j] = board[i + 1];
+}
+
+/* Score the first 'count' boards of a batch as ai_evaluate() would with no
+ * line cleared, using the widest vector unit of the CPU.
+ */
+void ai_evaluate_batch(const struct ai_batch *batch,
+                       int count,
+                       const struct ai_weights *w,
+                       double *scores);
+
+/* Move generator: a breadth-first search over every (x, y, orientation) a
+ * block can reach with ACTION_MOVE_LEFT, ACTION_MOVE_RIGHT,
+ * ACTION_ROTATE_LEFT and ACTION_MOVE_DOWN, finding tucks and spins under
+ * overhangs. Lock positions covering the same cells are reported once.
+ */
+#define MOVEGEN_STATES (BLOCK_X_SPAN * GAME_BOARD_HEIGHT * TOTAL_DEGREES)
+#define MOVEGEN_MAX_PLACEMENTS 512
+
+struct movegen_placement {
+    int8_t x, y, orientation;
+    uint16_t state; /* search state the placement was found in */
+};
+
+/* Working memory of one search. It is large, so allocate it once per thread
+ * and reuse it; the generator itself never allocates.
+ */
+struct movegen_scratch {
+    uint64_t visited[(MOVEGEN_STATES + 63) / 64];
+    uint16_t queue[MOVEGEN_STATES];
+    uint16_t parent[MOVEGEN_STATES];
+    uint8_t action[MOVEGEN_STATES]; /* input that first reached the state */
+    struct {
+        uint64_t cells;
+        uint32_t epoch;
+        int8_t y;
+    } locked[MOVEGEN_MAX_PLACEMENTS * 2]; /* hash set of lock footprints */
+    uint32_t epoch;
+};
+
+/* Collect the lock positions of a block starting at (x, y). With 'paths',
+ * hard drops count as a single input so that movegen_path() returns the
+ * shortest sequence; without, the search is cheaper but the paths longer.
+ */
+int movegen_run(struct movegen_scratch *scratch,
+                const row_t *board,
+                int type,
+                int orientation,
+                int x,
+                int y,
+                bool paths,
+                struct movegen_placement *out);
+
+/* Inputs leading from the start of the last search to a placement, or -1
+ * if there are more than 'max'.
+ */
+int movegen_path(const struct movegen_scratch *scratch,
+                 const struct movegen_placement *placement,
+                 action_t *path,
+                 int max);
+
+#define AI_MAX_PATH 64
+#define AI_MAX_LOOKAHEAD 3 /* upcoming blocks the search can place */
+
+/* Transposition table: the best score reachable from a board with a given
+ * list of blocks still to place, keyed by the Zobrist key of both. Different
+ * move orders often lead to the same board, which is then searched once.
+ * Scores depend on the weights and on the reachability setting, so a table
+ * must only be shared by searches using the same ones. It takes no lock and
+ * can be shared by any number of threads; an entry torn by a concurrent
+ * write fails its check and reads as a miss.
+ */
+struct ai_table;
+
+/* a table of 2^bits buckets of 64 bytes, or NULL if out of memory */
+struct ai_table *ai_table_create(int bits);
+void ai_table_destroy(struct ai_table *table);
+void ai_table_clear(struct ai_table *table);
+
+/* per-thread working memory of the bot, one move generator per ply */
+struct ai_scratch {
+    struct movegen_scratch gen[AI_MAX_LOOKAHEAD + 1];
+    struct movegen_placement placements[AI_MAX_LOOKAHEAD + 1]
+                                       [MOVEGEN_MAX_PLACEMENTS];
+    /* search counters, only ever incremented */
+    unsigned long long evaluations, probes, hits;
+};
+
+struct ai_options {
+    const struct ai_weights *weights; /* NULL for ai_default_weights */
+    int lookahead; /* blocks of the preview to place after the current one */
+    bool reachability; /* search with the move generator, not drops only */
+    struct ai_scratch *scratch; /* NULL to use the stack */
+    struct ai_table *table;     /* NULL to search without one */
+};
+
+/* A final placement of the current block and the inputs that lead there. */
+struct ai_move {
+    int x, y;
+    degree_t orientation;
+    double score;
+    int path_length;
+    action_t path[AI_MAX_PATH];
+};
+
+/* Pick the best placement of the current block. Without reachability only
+ * placements reached by turning the block in place, sliding it and dropping
+ * it are considered. With lookahead the next blocks from the preview, up to
+ * AI_MAX_LOOKAHEAD and as many as the game shows, are placed as well, and
+ * each placement is scored by the best board reachable after all of them.
+ * Returns false if there is no block to place.
+ */
+bool ai_best_move(const struct tetris_game *game,
+                  const struct ai_options *options,
+                  struct ai_move *move);
+
+/* Beam search: place the current block and the blocks of the preview one
+ * level at a time, keeping only the 'width' best boards of each level.
+ * Every board of a level is expanded as a job of the pool, and the boards
+ * of the next level are picked from the results in a fixed order, so the
+ * move does not depend on the number of threads. With a time budget the
+ * search stops before a level that is not expected to finish in time,
+ * which makes the move depend on the speed of the machine as well.
+ */
+#define AI_BEAM_MAX_DEPTH (TETRIS_PREVIEW_MAX + 1)
+
+struct ai_beam_options {
+    const struct ai_weights *weights; /* NULL for ai_default_weights */
+    int depth;  /* blocks to place, the current one included */
+    int width;  /* boards kept at each level */
+    int budget; /* microseconds per move, 0 for no limit */
+    bool reachability;
+};
+
+struct pool;
+struct ai_beam;
+
+/* search with the workers of 'pool', which must outlive the search */
+struct ai_beam *ai_beam_create(struct pool *pool,
+                               const struct ai_beam_options *options);
+void ai_beam_destroy(struct ai_beam *beam);
+void ai_beam_set_budget(struct ai_beam *beam, int budget);
+
+/* as ai_best_move(), looking as deep as the options and the preview allow */
+bool ai_beam_move(struct ai_beam *beam,
+                  const struct tetris_game *game,
+                  struct ai_move *move);
+
+/* Feed the inputs of a move to the game, ending with the drop. The steps
+ * down of its path are ticks, as gravity would take them.
+ */
+bool ai_apply_move(struct tetris_game *game, const struct ai_move *move);
+
+#endif /* __AI_H__ */
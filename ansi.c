@@ -0,0 +1,570 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* The terminal front end without curses, for 'make UI=ansi'. It speaks ANSI
+ * escape sequences to the terminal directly: every drawing function composes
+ * into one preallocated buffer, which goes out in a single write() when the
+ * frame is complete. The board is drawn with UTF-8 block glyphs, moving the
+ * cursor only across the cells that did not change.
+ */
+
+#define _DEFAULT_SOURCE /* SIGWINCH, TIOCGWINSZ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tetris.h"
+
+#define GAME_INPUT_TIMEOUT 1000 /* read_key() timeout */
+
+/* UTF-8 glyphs */
+#define GLYPH_BLOCK "\xe2\x96\x88" /* U+2588 full block */
+#define GLYPH_HLINE "\xe2\x94\x80"
+#define GLYPH_VLINE "\xe2\x94\x82"
+#define GLYPH_ULCORNER "\xe2\x94\x8c"
+#define GLYPH_URCORNER "\xe2\x94\x90"
+#define GLYPH_LLCORNER "\xe2\x94\x94"
+#define GLYPH_LRCORNER "\xe2\x94\x98"
+
+#define ATTR_NORMAL "\033[m"
+#define ATTR_REVERSE "\033[1;7m" /* bold and reverse */
+
+/* keys beyond the bytes of the input */
+enum {
+    KEY_NONE = -1, /* timeout */
+    KEY_UP = 0x100,
+    KEY_DOWN,
+    KEY_RIGHT,
+    KEY_LEFT,
+};
+
+static bool active; /* between init_ui() and deinit_ui() */
+static struct termios saved_termios;
+
+/* top left corner of the 80x24 layout, centered on the terminal */
+static int origin_y, origin_x;
+
+/* The frame being composed, and where the terminal cursor will be once it
+ * is written out, -1 when that is not known.
+ */
+static char frame[16384];
+static size_t frame_len;
+static int cursor_y = -1, cursor_x = -1;
+
+/* The game board as last drawn, as in ui.c. A full redraw repaints the whole
+ * screen, which is also how a resized terminal gets its layout back.
+ */
+static bool shown[GAME_BOARD_HEIGHT][GAME_BOARD_WIDTH];
+static bool redraw_all = true;
+
+/* the level banner over rows 7 to 9 of the board, 0 for none */
+#define BANNER_ROW 7
+static int banner_level;
+
+/* what the side panels show, for the full redraws */
+static struct piece next_shown = {.type = TOTAL_BLOCKS};
+static struct game_score score_shown;
+static char hud_shown[HUD_LINES][HUD_WIDTH + 1];
+
+static struct ui_stats stats;
+
+static unsigned char input[64]; /* read from the terminal, not yet handled */
+static size_t input_len, input_pos;
+
+static void flush_frame(void)
+{
+    size_t done = 0;
+
+    while (done < frame_len) {
+        ssize_t n = write(STDOUT_FILENO, frame + done, frame_len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        done += n;
+    }
+    stats.output_bytes += done;
+    frame_len = 0;
+}
+
+static void put(const char *s, size_t len)
+{
+    if (frame_len + len > sizeof(frame))
+        flush_frame();
+    memcpy(frame + frame_len, s, len);
+    frame_len += len;
+}
+
+/* escape sequences, leaving the cursor where it is */
+#define PUT(literal) put((literal), sizeof(literal) - 1)
+
+/* text at the cursor, which it moves along */
+static void put_text(const char *s)
+{
+    size_t len = strlen(s);
+    put(s, len);
+    for (size_t i = 0; i < len; i++)
+        cursor_x += ((unsigned char) s[i] & 0xc0) != 0x80;
+}
+
+static void move_to(int y, int x)
+{
+    char seq[24];
+    int len;
+
+    y += origin_y;
+    x += origin_x;
+    if (y == cursor_y && x == cursor_x)
+        return;
+    if (y == cursor_y && x > cursor_x)
+        len = snprintf(seq, sizeof(seq), "\033[%dC", x - cursor_x);
+    else
+        len = snprintf(seq, sizeof(seq), "\033[%d;%dH", y + 1, x + 1);
+    put(seq, len);
+    cursor_y = y;
+    cursor_x = x;
+}
+
+/* text at row y and column x of the layout */
+static void print_at(int y, int x, const char *fmt, ...)
+{
+    char text[128];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    move_to(y, x);
+    put_text(text);
+}
+
+static void draw_box(int y, int x, int height, int width)
+{
+    char line[(WINDOW_MAIN_SIZE_X + 2) * 3 + 1];
+
+    for (int i = 0; i < 2; i++) {
+        strcpy(line, i ? GLYPH_LLCORNER : GLYPH_ULCORNER);
+        for (int j = 0; j < width - 2; j++)
+            strcat(line, GLYPH_HLINE);
+        strcat(line, i ? GLYPH_LRCORNER : GLYPH_URCORNER);
+        print_at(i ? y + height - 1 : y, x, "%s", line);
+    }
+    for (int i = 1; i < height - 1; i++) {
+        print_at(y + i, x, GLYPH_VLINE);
+        print_at(y + i, x + width - 1, GLYPH_VLINE);
+    }
+}
+
+/* the cells of the windows, with the same placement as in ui.c */
+static void draw_cell(int window_y, int window_x, int y, int x, bool filled)
+{
+    move_to(window_y + y, window_x + (x << 1));
+    put_text(filled ? GLYPH_BLOCK GLYPH_BLOCK : "  ");
+}
+
+#define draw_board_cell(y, x, filled) draw_cell(2, 14, (y), (x), (filled))
+
+static void draw_next_panel(void)
+{
+    for (int i = 0; i < 4; i++)
+        print_at(5 + i, 48, "%8s", "");
+    if (next_shown.type < TOTAL_BLOCKS) {
+        const struct position *p =
+            &positions[next_shown.type][next_shown.orientation];
+        for (int i = 0; i < ARRAY_SIZE(p->pos); i++)
+            draw_cell(5, 48, p->pos[i].y, p->pos[i].x, true);
+    }
+}
+
+static void draw_score_panel(void)
+{
+    print_at(14, 63, "%-8d", score_shown.level);
+    print_at(16, 63, "%-8d", score_shown.rows_cleared);
+    print_at(17, 63, "%-8d", score_shown.total_rows);
+    print_at(18, 63, "%-8d", score_shown.score);
+}
+
+static void draw_hud_panel(void)
+{
+    for (int i = 0; i < HUD_LINES; i++)
+        print_at(21 + i, 46, "%-*s", HUD_WIDTH, hud_shown[i]);
+}
+
+/* the borders and labels around the windows */
+static void draw_screen(void)
+{
+    PUT(ATTR_NORMAL "\033[2J");
+    cursor_y = cursor_x = -1;
+
+    print_at(3, 47, "Next Block");
+    print_at(14, 47, "Level        :  ");
+    print_at(16, 47, "rows cleared :  ");
+    print_at(17, 47, "total rows   :  ");
+    print_at(18, 47, "Score        :  ");
+
+    draw_box(4, 46, 6, 12);  /* the next block */
+    draw_box(1, 13, 22, 26); /* the game */
+}
+
+/* Center the layout on the terminal. Returns false, with the size of the
+ * terminal in 'ws', if it does not fit.
+ */
+static bool place_layout(struct winsize *ws)
+{
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, ws) || !ws->ws_col || !ws->ws_row)
+        ws->ws_col = WINDOW_MAIN_SIZE_X, ws->ws_row = WINDOW_MAIN_SIZE_Y;
+
+    origin_x = ws->ws_col > WINDOW_MAIN_SIZE_X
+                   ? (ws->ws_col - WINDOW_MAIN_SIZE_X) / 2
+                   : 0;
+    origin_y = ws->ws_row > WINDOW_MAIN_SIZE_Y
+                   ? (ws->ws_row - WINDOW_MAIN_SIZE_Y) / 2
+                   : 0;
+    return ws->ws_col >= WINDOW_MAIN_SIZE_X && ws->ws_row >= WINDOW_MAIN_SIZE_Y;
+}
+
+static void restore_terminal(void)
+{
+    static const char seq[] = ATTR_NORMAL "\033[?25h\033[?1049l";
+
+    /* safe in a signal handler */
+    if (write(STDOUT_FILENO, seq, sizeof(seq) - 1) > 0)
+        stats.output_bytes += sizeof(seq) - 1;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_termios);
+}
+
+static void on_fatal_signal(int sig)
+{
+    restore_terminal();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void on_resize(int sig)
+{
+    (void) sig;
+    __atomic_store_n(&redraw_all, true, __ATOMIC_RELAXED);
+}
+
+int snooze(int ms)
+{
+    struct timespec ts = {.tv_sec = ms / 1000,
+                          .tv_nsec = (ms % 1000) * 1000000L};
+    if (ms <= 0)
+        return 0;
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+    return 0;
+}
+
+bool init_ui(void)
+{
+    if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Fail to initialize the terminal: not a tty\n");
+        return false;
+    }
+    struct winsize ws;
+    if (!place_layout(&ws)) {
+        fprintf(stderr,
+                "Terminal size [%2d x %2d] is not sufficient to render.\n"
+                "The minimum required size is [%2d x %2d]\n",
+                ws.ws_col, ws.ws_row, WINDOW_MAIN_SIZE_X, WINDOW_MAIN_SIZE_Y);
+        return false;
+    }
+
+    struct termios raw;
+    if (tcgetattr(STDIN_FILENO, &saved_termios)) {
+        perror("tcgetattr");
+        return false;
+    }
+    raw = saved_termios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw)) {
+        perror("tcsetattr");
+        return false;
+    }
+    active = true;
+
+    struct sigaction sa = {.sa_handler = on_fatal_signal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = on_resize;
+    sigaction(SIGWINCH, &sa, NULL);
+
+    /* the alternate screen, without a cursor */
+    PUT("\033[?1049h\033[?25l" ATTR_NORMAL "\033[2J");
+    flush_frame();
+    return true;
+}
+
+void deinit_ui(void)
+{
+    if (!active)
+        return;
+    flush_frame();
+    restore_terminal();
+    active = false;
+}
+
+void get_ui_stats(struct ui_stats *out)
+{
+    *out = stats;
+}
+
+void init_game_screen(void)
+{
+    draw_screen();
+    flush_frame();
+}
+
+/* Next key from the terminal, waiting at most 'timeout' ms, or forever if it
+ * is negative. Returns KEY_NONE if the wait ran out or was interrupted.
+ */
+static int read_key(int timeout)
+{
+    if (input_pos == input_len) {
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        if (poll(&pfd, 1, timeout) <= 0)
+            return KEY_NONE;
+        ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+        if (n <= 0)
+            return KEY_NONE;
+        input_len = n;
+        input_pos = 0;
+    }
+
+    /* arrows arrive whole as ESC [ A or ESC O A, in either cursor mode */
+    int key = input[input_pos++];
+    if (key == '\033' && input_len - input_pos >= 2 &&
+        (input[input_pos] == '[' || input[input_pos] == 'O') &&
+        input[input_pos + 1] >= 'A' && input[input_pos + 1] <= 'D') {
+        key = KEY_UP + (input[input_pos + 1] - 'A');
+        input_pos += 2;
+    }
+    return key;
+}
+
+input_t get_user_input(void)
+{
+    return wait_user_input(GAME_INPUT_TIMEOUT);
+}
+
+input_t wait_user_input(int timeout)
+{
+    input_t result;
+    switch (read_key(timeout)) {
+    case KEY_NONE: /* timeout */
+        result = INPUT_TIMEOUT;
+        break;
+    case KEY_LEFT:
+    case 'h':
+        result = INPUT_MOVE_LEFT;
+        break;
+    case KEY_RIGHT:
+    case 'l':
+        result = INPUT_MOVE_RIGHT;
+        break;
+    case KEY_DOWN:
+    case ' ': /* space bar */
+    case 'j':
+        result = INPUT_DROP;
+        break;
+    case KEY_UP:
+    case 'k':
+        result = INPUT_ROTATE_LEFT;
+        break;
+    case 'Q':
+    case 'q':
+        result = INPUT_PAUSE_QUIT;
+        break;
+    default:
+        result = INPUT_INVALID;
+        break;
+    }
+
+    return result;
+}
+
+bool show_quit_dialog(void)
+{
+    /* over the board, from its sixth row */
+    static const char *const lines[] = {
+        "                        ", "       P A U S E D      ",
+        "                        ", "                        ",
+        "                        ", "                        ",
+        "                        ",
+    };
+    enum { QUIT, RESUME };
+    int choice = RESUME;
+    bool need_refresh = true;
+
+    PUT(ATTR_REVERSE);
+    for (int i = 0; i < ARRAY_SIZE(lines); i++)
+        print_at(7 + i, 14, "%s", lines[i]);
+
+    /* the loop will accept only ENTER or SPACE */
+    for (int input = 0; input != '\n' && input != ' ';) {
+        if (need_refresh) {
+            for (int button = QUIT; button <= RESUME; button++) {
+                const char *attr =
+                    button == choice ? ATTR_NORMAL : ATTR_REVERSE;
+                int x = button == QUIT ? 15 : 27;
+                put(attr, strlen(attr));
+                draw_box(10, x, 3, 10);
+                print_at(11, x + 1, button == QUIT ? "  QUIT  " : " RESUME ");
+            }
+            PUT(ATTR_NORMAL);
+            flush_frame();
+        }
+
+        need_refresh = true;
+        input = read_key(-1);
+        switch (input) {
+        case KEY_LEFT:
+        case 'h':
+            choice = QUIT;
+            break;
+        case KEY_RIGHT:
+        case 'l':
+            choice = RESUME;
+            break;
+        default:
+            need_refresh = false;
+            break;
+        }
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(lines); i++)
+        print_at(7 + i, 14, "%24s", "");
+    flush_frame();
+    __atomic_store_n(&redraw_all, true, __ATOMIC_RELAXED);
+    return (choice == RESUME);
+}
+
+/* The side panels are only composed here, and go out with the next frame of
+ * the board, which the engine draws right after them.
+ */
+void draw_next_block(block_t type, degree_t orientation)
+{
+    next_shown = (struct piece){.type = type, .orientation = orientation};
+    draw_next_panel();
+}
+
+void draw_score_board(const struct game_score *score)
+{
+    score_shown = *score;
+    draw_score_panel();
+}
+
+static unsigned long long cpu_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void draw_game_board(const struct tetris_game *game)
+{
+    unsigned long long start = cpu_time_ns();
+    unsigned long long written = stats.output_bytes;
+    bool cells[GAME_BOARD_HEIGHT][GAME_BOARD_WIDTH];
+
+    for (int i = 1; i < GAME_BOARD_HEIGHT + 1; i++) {
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++)
+            cells[i - 1][j] = game->color[i][j];
+    }
+    if (game->has_block) {
+        const struct block *block = &game->current;
+        for (int i = 0; i < ARRAY_SIZE(block->position->pos); i++)
+            cells[block->origin.y + block->position->pos[i].y]
+                 [block->origin.x + block->position->pos[i].x] = true;
+    }
+
+    bool full = __atomic_exchange_n(&redraw_all, false, __ATOMIC_RELAXED);
+    if (full) {
+        struct winsize ws;
+        place_layout(&ws);
+        draw_screen();
+        draw_next_panel();
+        draw_score_panel();
+        draw_hud_panel();
+        stats.full_frames++;
+    }
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++) {
+        /* the rows under the banner are redrawn once it is down */
+        if (banner_level && i >= BANNER_ROW && i < BANNER_ROW + 3)
+            continue;
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++) {
+            if (full ? !cells[i][j] : cells[i][j] == shown[i][j])
+                continue;
+            draw_board_cell(i, j, cells[i][j]);
+            stats.cells++;
+        }
+    }
+    memcpy(shown, cells, sizeof(shown));
+    if (full && banner_level) {
+        PUT(ATTR_REVERSE);
+        print_at(2 + BANNER_ROW, 14, "%24s", "");
+        print_at(3 + BANNER_ROW, 14, "     L E V E L   %02d     ",
+                 banner_level);
+        print_at(4 + BANNER_ROW, 14, "%24s", "");
+        PUT(ATTR_NORMAL);
+    }
+    flush_frame();
+
+    stats.cpu_ns += cpu_time_ns() - start;
+    stats.bytes += stats.output_bytes - written;
+    stats.frames++;
+}
+
+void draw_debug_hud(const char text[HUD_LINES][HUD_WIDTH + 1])
+{
+    if (text)
+        memcpy(hud_shown, text, sizeof(hud_shown));
+    else
+        memset(hud_shown, 0, sizeof(hud_shown));
+    draw_hud_panel();
+    flush_frame();
+}
+
+void show_level_banner(int level)
+{
+    banner_level = level;
+    __atomic_store_n(&redraw_all, true, __ATOMIC_RELAXED);
+}
+
+void draw_cleared_rows(const int *rows, int count, int steps, bool from_ends)
+{
+#define width (GAME_BOARD_WIDTH << 1)
+    for (int step = 0; step < steps && step <= width / 2; step++) {
+        int i = from_ends ? step : width / 2 - step;
+        for (int j = 0; j < count; j++) {
+            print_at(2 + rows[j], 14 + i, " ");
+            print_at(2 + rows[j], 14 + width - i - 1, " ");
+        }
+    }
+    flush_frame();
+#undef width
+
+    /* the rows are blank on screen now */
+    if (steps >= CLEARED_ROWS_STEPS) {
+        for (int j = 0; j < count; j++)
+            memset(shown[rows[j]], 0, sizeof(shown[rows[j]]));
+    }
+}
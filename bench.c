@@ -0,0 +1,501 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-bench: time the hot paths of the engine and of the renderer, one
+ * operation at a time, on a corpus of boards from the empty one to stacks
+ * about to top out, deep wells, quad clears and overhangs that defeat the
+ * skyline. Each operation is warmed up, then timed over repetitions long
+ * enough for the clock not to matter. Work that only sets an operation up,
+ * such as putting the block back where it started, runs in a loop of its
+ * own which is timed too, and subtracted.
+ *
+ * The engine functions are static, so they are reached through the API,
+ * each benchmark named after what it does and the board, as in drop/well:
+ *   fits       block_fits(), what test_movement() does, over every pose
+ *   left, right, rotate, drop
+ *              tetris_step(), that is move_block() and test_movement()
+ *   tick       tetris_tick() moving the block down
+ *   lock       tetris_tick() locking it: freeze_block(), clear_even_rows()
+ *              and the score
+ *   draw       draw_game_board() of the ANSI front end, the block moving
+ *   redraw     the same, redrawing the whole screen
+ * Frames go to /dev/null, so they cost a write() but no terminal.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getopt, clock_gettime */
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tetris.h"
+
+/* a board of the corpus, and the blocks it is benchmarked with */
+struct board_case {
+    const char *name;
+    void (*build)(struct tetris_game *game);
+    struct piece piece; /* moved by the steps, from 'x' and 'y' */
+    int x, y;
+    struct piece lock; /* dropped at 'lock_x', and locked */
+    int lock_x;
+};
+
+struct pose {
+    uint8_t type, orientation;
+    int8_t x, y;
+};
+
+/* the state an operation works on */
+struct bench_state {
+    struct tetris_game game;
+    struct block start;           /* of the block moved by the steps */
+    struct tetris_game locking;   /* with a block resting on the stack */
+    struct tetris_game scratch;   /* copied to as the lock is, to time it */
+    struct tetris_game frames[2]; /* drawn in turn */
+    struct pose poses[TOTAL_BLOCKS * TOTAL_DEGREES * BLOCK_X_SPAN *
+                      GAME_BOARD_HEIGHT];
+    int npose, pose, frame;
+};
+
+struct bench_op {
+    const char *name;
+    void (*setup)(struct bench_state *s); /* timed apart, or NULL */
+    unsigned (*run)(struct bench_state *s);
+};
+
+struct result {
+    char name[64];
+    unsigned long long ops; /* per repetition */
+    double mean, stddev, min; /* ns per operation */
+};
+
+static volatile unsigned sink; /* keeps the results alive */
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fill the bottom 'height' rows, row r counting from the floor, leaving the
+ * cells for which 'hole' says so empty.
+ */
+static void fill_rows(struct tetris_game *game,
+                      int height,
+                      bool (*hole)(int r, int x))
+{
+    for (int r = 0; r < height; r++) {
+        int y = GAME_BOARD_HEIGHT - r;
+        for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+            if (hole(r, x))
+                continue;
+            game->board[y] |= BOARD_CELL(x);
+            game->color[y][x] = 1 + (r + x) % TOTAL_BLOCKS;
+        }
+    }
+    tetris_sync_board(game);
+}
+
+static void build_empty(struct tetris_game *game)
+{
+    (void) game;
+}
+
+/* the stack a random player leaves after a while */
+static void build_random(struct tetris_game *game)
+{
+    struct tetris_game play;
+    struct tetris_config config = {.seed = 1};
+    struct tetris_rng rng;
+
+    tetris_init(&play, &config);
+    tetris_rng_seed(&rng, 2);
+    while (play.top_row > GAME_BOARD_HEIGHT - 9 && !play.game_over) {
+        if (!(tetris_tick(&play) & TETRIS_EVENT_NEW_BLOCK))
+            continue;
+        int turns = tetris_rng_below(&rng, TOTAL_DEGREES);
+        int shift = (int) tetris_rng_below(&rng, GAME_BOARD_WIDTH) -
+                    GAME_BOARD_WIDTH / 2;
+        for (int i = 0; i < turns; i++)
+            tetris_step(&play, ACTION_ROTATE_LEFT);
+        for (; shift; shift += shift < 0 ? 1 : -1)
+            tetris_step(&play, shift < 0 ? ACTION_MOVE_LEFT
+                                         : ACTION_MOVE_RIGHT);
+        tetris_step(&play, ACTION_DROP);
+    }
+    memcpy(game->board, play.board, sizeof(game->board));
+    memcpy(game->color, play.color, sizeof(game->color));
+    tetris_sync_board(game);
+}
+
+static bool near_full_hole(int r, int x)
+{
+    return x == (r * 7) % GAME_BOARD_WIDTH;
+}
+
+/* 15 rows with a hole each: the spawn rows are all that is left */
+static void build_near_full(struct tetris_game *game)
+{
+    fill_rows(game, 15, near_full_hole);
+}
+
+static bool well_hole(int r, int x)
+{
+    return x == GAME_BOARD_WIDTH - 1 || x == (r * 5) % (GAME_BOARD_WIDTH - 1);
+}
+
+/* a well 16 rows deep on the right, no row to clear at its bottom */
+static void build_well(struct tetris_game *game)
+{
+    fill_rows(game, 16, well_hole);
+}
+
+static bool quad_hole(int r, int x)
+{
+    (void) r;
+    return x == GAME_BOARD_WIDTH - 1;
+}
+
+/* four rows waiting for a vertical line */
+static void build_quad(struct tetris_game *game)
+{
+    fill_rows(game, 4, quad_hole);
+}
+
+static bool overhang_hole(int r, int x)
+{
+    if (r < 2) /* the floor */
+        return x == GAME_BOARD_WIDTH - 1;
+    if (r < 6) /* the cave */
+        return x < 8;
+    return x >= 10; /* the roof */
+}
+
+/* a cave under a roof, where drops cannot trust the skyline */
+static void build_overhang(struct tetris_game *game)
+{
+    fill_rows(game, 8, overhang_hole);
+}
+
+static const struct board_case cases[] = {
+    {"empty", build_empty, {BLOCK_TEE, DEG_0}, 4, 0, {BLOCK_LINE, DEG_0}, 4},
+    {"random", build_random, {BLOCK_TEE, DEG_0}, 4, 0, {BLOCK_SQUARE}, 4},
+    {"near-full", build_near_full, {BLOCK_TEE, DEG_0}, 4, 0,
+     {BLOCK_SQUARE}, 0},
+    {"well", build_well, {BLOCK_LINE, DEG_90}, 9, 0, {BLOCK_LINE, DEG_90}, 9},
+    {"quad", build_quad, {BLOCK_LINE, DEG_90}, 9, 0, {BLOCK_LINE, DEG_90}, 9},
+    /* the square inside the cave, dropping two rows */
+    {"overhang", build_overhang, {BLOCK_SQUARE}, 2, 13, {BLOCK_SQUARE}, 2},
+};
+
+static struct block make_block(struct piece piece, int x, int y)
+{
+    return (struct block){
+        .type = piece.type,
+        .origin = {x, y},
+        .orientation = piece.orientation,
+        .position = &positions[piece.type][piece.orientation],
+    };
+}
+
+static bool setup_case(struct bench_state *s, const struct board_case *c)
+{
+    struct tetris_config config = {.seed = 1};
+
+    tetris_init(&s->game, &config);
+    c->build(&s->game);
+    s->start = make_block(c->piece, c->x, c->y);
+    if (!block_fits(s->game.board, c->piece.type, c->piece.orientation, c->x,
+                    c->y))
+        return false;
+    s->game.current = s->start;
+    s->game.has_block = true;
+
+    s->locking = s->game;
+    s->locking.current = make_block(c->lock, c->lock_x, c->y);
+    if (!block_fits(s->locking.board, c->lock.type, c->lock.orientation,
+                    c->lock_x, c->y))
+        return false;
+    tetris_step(&s->locking, ACTION_DROP);
+    if (!tetris_block_resting(&s->locking))
+        return false;
+
+    s->frames[0] = s->frames[1] = s->game;
+    tetris_step(&s->frames[1], ACTION_MOVE_RIGHT);
+    tetris_step(&s->frames[1], ACTION_ROTATE_LEFT);
+
+    s->npose = 0;
+    for (int t = 0; t < TOTAL_BLOCKS; t++)
+        for (int o = 0; o < TOTAL_DEGREES; o++)
+            for (int x = BLOCK_X_MIN; x <= BLOCK_X_MAX; x++)
+                for (int y = 0; y < GAME_BOARD_HEIGHT; y++)
+                    s->poses[s->npose++] = (struct pose){t, o, x, y};
+    s->pose = s->frame = 0;
+    return true;
+}
+
+static unsigned run_fits(struct bench_state *s)
+{
+    if (++s->pose == s->npose)
+        s->pose = 0;
+    return block_fits(s->game.board, s->poses[s->pose].type,
+                      s->poses[s->pose].orientation, s->poses[s->pose].x,
+                      s->poses[s->pose].y);
+}
+
+static void reset_block(struct bench_state *s)
+{
+    s->game.current = s->start;
+}
+
+#define STEP(name, action)                              \
+    static unsigned run_##name(struct bench_state *s)  \
+    {                                                   \
+        return tetris_step(&s->game, action);           \
+    }
+STEP(left, ACTION_MOVE_LEFT)
+STEP(right, ACTION_MOVE_RIGHT)
+STEP(rotate, ACTION_ROTATE_LEFT)
+STEP(drop, ACTION_DROP)
+#undef STEP
+
+static unsigned run_tick(struct bench_state *s)
+{
+    return tetris_tick(&s->game);
+}
+
+static void reset_locking(struct bench_state *s)
+{
+    s->scratch = s->locking; /* a copy as costly as the one in run_lock */
+}
+
+static unsigned run_lock(struct bench_state *s)
+{
+    s->game = s->locking;
+    return tetris_tick(&s->game);
+}
+
+static unsigned run_draw(struct bench_state *s)
+{
+    s->frame ^= 1;
+    draw_game_board(&s->frames[s->frame]);
+    return s->frame;
+}
+
+static void force_redraw(struct bench_state *s)
+{
+    (void) s;
+    show_level_banner(0); /* takes down no banner, but redraws all */
+}
+
+static const struct bench_op ops[] = {
+    {"fits", NULL, run_fits},
+    {"left", reset_block, run_left},
+    {"right", reset_block, run_right},
+    {"rotate", reset_block, run_rotate},
+    {"drop", reset_block, run_drop},
+    {"tick", reset_block, run_tick},
+    {"lock", reset_locking, run_lock},
+    {"draw", NULL, run_draw},
+    {"redraw", force_redraw, run_draw},
+};
+
+/* ns taken by 'n' operations, with their setup, or by the setup alone */
+static double time_ops(const struct bench_op *op,
+                       struct bench_state *s,
+                       unsigned long long n,
+                       bool with_op)
+{
+    unsigned acc = 0;
+    double start = now_ns();
+
+    for (unsigned long long i = 0; i < n; i++) {
+        if (op->setup)
+            op->setup(s);
+        if (with_op)
+            acc += op->run(s);
+    }
+    double elapsed = now_ns() - start;
+    sink += acc;
+    return elapsed;
+}
+
+static double time_net(const struct bench_op *op,
+                       struct bench_state *s,
+                       unsigned long long n)
+{
+    double total = time_ops(op, s, n, true);
+    if (op->setup)
+        total -= time_ops(op, s, n, false);
+    return total > 0 ? total : 0;
+}
+
+static void run_bench(const struct bench_op *op,
+                      struct bench_state *s,
+                      int reps,
+                      double rep_ns,
+                      double warmup_ns,
+                      struct result *r)
+{
+    /* warm up, and size the repetitions after it */
+    unsigned long long n = 1;
+    double elapsed = 0, spent = 0;
+    while (spent < warmup_ns || elapsed < 1e6) {
+        elapsed = time_ops(op, s, n, true);
+        spent += elapsed;
+        if (elapsed < 1e6)
+            n *= 2;
+    }
+    n = n * (rep_ns / elapsed);
+    if (n < 1)
+        n = 1;
+
+    double sum = 0, sum2 = 0;
+    r->ops = n;
+    r->min = INFINITY;
+    for (int i = 0; i < reps; i++) {
+        double ns = time_net(op, s, n) / n;
+        sum += ns;
+        sum2 += ns * ns;
+        if (ns < r->min)
+            r->min = ns;
+    }
+    r->mean = sum / reps;
+    double var = reps > 1 ? (sum2 - sum * sum / reps) / (reps - 1) : 0;
+    r->stddev = var > 0 ? sqrt(var) : 0;
+}
+
+static void write_json(FILE *fp,
+                       const char *label,
+                       int reps,
+                       const struct result *results,
+                       int n)
+{
+    fprintf(fp, "{\n  \"label\": \"");
+    for (const char *p = label; *p; p++)
+        if (*p != '"' && *p != '\\' && (unsigned char) *p >= ' ')
+            fputc(*p, fp);
+    fprintf(fp, "\",\n  \"repetitions\": %d,\n  \"results\": [\n", reps);
+    for (int i = 0; i < n; i++) {
+        const struct result *r = &results[i];
+        fprintf(fp,
+                "    {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f, "
+                "\"stddev_ns\": %.3f, \"min_ns\": %.3f, "
+                "\"ops_per_sec\": %.0f}%s\n",
+                r->name, r->ops, r->mean, r->stddev, r->min,
+                r->mean > 0 ? 1e9 / r->mean : 0, i + 1 < n ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-f filter] [-r repetitions] [-t ms] [-w ms]\n"
+            "          [-o json-file] [-l label]\n"
+            "  -f  only the benchmarks whose name contains this\n"
+            "  -r  timed repetitions of each (default 10)\n"
+            "  -t  ms of each repetition (default 20)\n"
+            "  -w  ms of warmup (default 50)\n"
+            "  -o  also write the results as JSON, '-' for stdout\n"
+            "  -l  label of the run in the JSON, such as a commit\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filter = "", *json = NULL, *label = "";
+    int reps = 10, rep_ms = 20, warmup_ms = 50, opt;
+
+    while ((opt = getopt(argc, argv, "f:r:t:w:o:l:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 'r':
+            reps = atoi(optarg);
+            break;
+        case 't':
+            rep_ms = atoi(optarg);
+            break;
+        case 'w':
+            warmup_ms = atoi(optarg);
+            break;
+        case 'o':
+            json = optarg;
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (reps < 1 || rep_ms < 1 || warmup_ms < 0) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    /* the frames go to /dev/null, the report where stdout was */
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    int null = open("/dev/null", O_WRONLY);
+    if (!out || null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        fprintf(stderr, "Fail to open /dev/null\n");
+        return -1;
+    }
+    close(null);
+
+    struct bench_state *s = malloc(sizeof(*s));
+    int max = ARRAY_SIZE(cases) * ARRAY_SIZE(ops), n = 0;
+    struct result *results = calloc(max, sizeof(*results));
+    if (!s || !results) {
+        fprintf(stderr, "Fail to allocate memory\n");
+        return -1;
+    }
+
+    fprintf(out, "%-20s %12s %8s %10s %14s\n", "benchmark", "ns/op", "+-%",
+            "min", "ops/sec");
+    for (int i = 0; i < ARRAY_SIZE(cases); i++) {
+        for (int j = 0; j < ARRAY_SIZE(ops); j++) {
+            struct result *r = &results[n];
+            snprintf(r->name, sizeof(r->name), "%s/%s", ops[j].name,
+                     cases[i].name);
+            if (!strstr(r->name, filter))
+                continue;
+            if (!setup_case(s, &cases[i])) {
+                fprintf(stderr, "%s: the blocks do not fit\n", cases[i].name);
+                return -1;
+            }
+            run_bench(&ops[j], s, reps, rep_ms * 1e6, warmup_ms * 1e6, r);
+            fprintf(out, "%-20s %12.2f %7.1f%% %10.2f %14.0f\n", r->name,
+                    r->mean, r->mean > 0 ? 100 * r->stddev / r->mean : 0,
+                    r->min, r->mean > 0 ? 1e9 / r->mean : 0);
+            fflush(out);
+            n++;
+        }
+    }
+
+    if (json) {
+        FILE *fp = strcmp(json, "-") ? fopen(json, "w") : out;
+        if (!fp) {
+            fprintf(stderr, "Fail to write %s\n", json);
+            return -1;
+        }
+        write_json(fp, label, reps, results, n);
+        if (fp != out)
+            fclose(fp);
+    }
+    fclose(out);
+    free(results);
+    free(s);
+    return 0;
+}
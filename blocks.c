@@ -0,0 +1,60 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#include "tetris.h"
+
+const struct position positions[TOTAL_BLOCKS][TOTAL_DEGREES] =
+    {
+        [BLOCK_SQUARE] =
+            {
+                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_0 */
+                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_90 */
+                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_180 */
+                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_270 */
+            },
+        [BLOCK_LINE] =
+            {
+                {{{0, 1}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_0 */
+                {{{2, 0}, {2, 1}, {2, 2}, {2, 3}}}, /* DEG_90 */
+                {{{0, 1}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_180 */
+                {{{2, 0}, {2, 1}, {2, 2}, {2, 3}}}, /* DEG_270 */
+            },
+        [BLOCK_TEE] =
+            {
+                {{{2, 0}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_0 */
+                {{{2, 0}, {2, 1}, {2, 2}, {3, 1}}}, /* DEG_90 */
+                {{{2, 2}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_180 */
+                {{{2, 0}, {2, 1}, {2, 2}, {1, 1}}}, /* DEG_270 */
+            },
+        [BLOCK_ZEE_1] =
+            {
+                {{{2, 0}, {1, 1}, {2, 1}, {1, 2}}}, /* DEG_0 */
+                {{{1, 1}, {2, 1}, {2, 2}, {3, 2}}}, /* DEG_90 */
+                {{{2, 0}, {1, 1}, {2, 1}, {1, 2}}}, /* DEG_180 */
+                {{{1, 1}, {2, 1}, {2, 2}, {3, 2}}}, /* DEG_270 */
+            },
+        [BLOCK_ZEE_2] =
+            {
+                {{{1, 0}, {1, 1}, {2, 1}, {2, 2}}}, /* DEG_0 */
+                {{{1, 1}, {2, 1}, {0, 2}, {1, 2}}}, /* DEG_90 */
+                {{{1, 0}, {1, 1}, {2, 1}, {2, 2}}}, /* DEG_180 */
+                {{{1, 1}, {2, 1}, {0, 2}, {1, 2}}}, /* DEG_270 */
+            },
+        [BLOCK_ELL_1] =
+            {
+                {{{1, 0}, {1, 1}, {1, 2}, {2, 2}}}, /* DEG_0 */
+                {{{1, 1}, {2, 1}, {3, 1}, {1, 2}}}, /* DEG_90 */
+                {{{1, 0}, {2, 0}, {2, 1}, {2, 2}}}, /* DEG_180 */
+                {{{2, 0}, {0, 1}, {1, 1}, {2, 1}}}, /* DEG_270 */
+            },
+        [BLOCK_ELL_2] =
+            {
+                {{{2, 0}, {2, 1}, {2, 2}, {1, 2}}}, /* DEG_0 */
+                {{{1, 0}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_90 */
+                {{{1, 0}, {2, 0}, {1, 1}, {1, 2}}}, /* DEG_180 */
+                {{{0, 1}, {1, 1}, {2, 1}, {2, 2}}}, /* DEG_270 */
+            },
+};
@@ -0,0 +1,719 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE /* accept4, epoll, eventfd */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broadcast.h"
+
+#define FRAME_QUEUE_SIZE 256 /* from the game to the writer, a power of 2 */
+#define KEYFRAME_INTERVAL 32 /* frames from one keyframe to the next */
+/* frames a subscriber may fall behind, enough to hold a partly written
+ * frame, the keyframe and the deltas after it
+ */
+#define SUBSCRIBER_QUEUE 64
+#define LINGER_MS 1000 /* for the last frames, once the game is over */
+
+/* An encoded message, shared by every queue holding it. Only the writer
+ * thread counts the references, once the game thread has queued it.
+ */
+struct frame {
+    unsigned refs;
+    bool key;
+    uint16_t len;
+    uint8_t data[VIEW_MESSAGE_MAX];
+};
+
+struct subscriber {
+    int fd;       /* -1 once dropped */
+    int index;    /* in the array of the broadcast */
+    struct subscriber *next_dropped;
+    bool writing; /* waiting for the socket to take more */
+    struct frame *queue[SUBSCRIBER_QUEUE];
+    unsigned head, count;
+    size_t offset; /* written of the frame at the head */
+};
+
+struct broadcast {
+    /* the thread playing: the view as last sent */
+    struct view last;
+    bool need_key;
+    int since_key; /* deltas since the last keyframe */
+    bool behind;   /* the latest view, 'unsent', found the queue full */
+    struct view unsent;
+
+    /* frames from the game thread, its only producer, to the writer */
+    struct frame *ring[FRAME_QUEUE_SIZE];
+    unsigned head, tail;
+    int wakeup, quit;
+
+    /* the writer thread */
+    int listener, epoll;
+    struct frame *key; /* the latest keyframe, and the deltas after it */
+    struct frame *history[KEYFRAME_INTERVAL];
+    int history_len;
+    struct subscriber **subs;
+    int nsubs, max_subs;
+    struct subscriber *dropped; /* to free once their events are handled */
+    char *path;
+    pthread_t thread_id;
+};
+
+static struct broadcast_stats stats;
+
+/* the tags of the fds other than subscribers in the epoll data */
+static char tag_listener, tag_wakeup, tag_quit;
+
+static void put16(uint8_t *p, unsigned v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+void view_of_game(struct view *view, const struct tetris_game *game)
+{
+    memset(view, 0, sizeof(*view));
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++)
+        view->rows[i] = (game->board[i + 1] >> BOARD_WALL_BITS) &
+                        ((1U << GAME_BOARD_WIDTH) - 1);
+    view->has_block = game->has_block;
+    if (game->has_block) {
+        view->block = (struct piece){.type = game->current.type,
+                                     .orientation = game->current.orientation};
+        view->x = game->current.origin.x;
+        view->y = game->current.origin.y;
+    }
+    view->next = tetris_preview(game, 0);
+    view->score = game->score;
+    view->game_over = game->game_over;
+}
+
+size_t view_encode(const struct view *old,
+                   const struct view *view,
+                   uint8_t *out)
+{
+    uint8_t *p = out + 4;
+    unsigned flags = 0;
+
+    uint32_t changed = 0;
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++)
+        if (!old || old->rows[i] != view->rows[i])
+            changed |= 1U << i;
+    if (changed) {
+        flags |= VIEW_ROWS;
+        put16(p, changed);
+        p[2] = changed >> 16;
+        p += 3;
+        for (int i = 0; i < GAME_BOARD_HEIGHT; i++) {
+            if (changed >> i & 1) {
+                put16(p, view->rows[i]);
+                p += 2;
+            }
+        }
+    }
+
+    if (!old || old->has_block != view->has_block ||
+        old->block.type != view->block.type ||
+        old->block.orientation != view->block.orientation ||
+        old->x != view->x || old->y != view->y) {
+        flags |= VIEW_BLOCK;
+        *p++ = view->has_block;
+        *p++ = view->block.type;
+        *p++ = view->block.orientation;
+        *p++ = (uint8_t) view->x;
+        *p++ = (uint8_t) view->y;
+    }
+
+    if (!old || old->next.type != view->next.type ||
+        old->next.orientation != view->next.orientation) {
+        flags |= VIEW_NEXT;
+        *p++ = view->next.type;
+        *p++ = view->next.orientation;
+    }
+
+    if (!old || memcmp(&old->score, &view->score, sizeof(view->score))) {
+        flags |= VIEW_SCORE;
+        put32(p, view->score.level);
+        put32(p + 4, view->score.rows_cleared);
+        put32(p + 8, view->score.total_rows);
+        put32(p + 12, view->score.score);
+        p += 16;
+    }
+
+    if (view->game_over && (!old || !old->game_over))
+        flags |= VIEW_OVER;
+    if (!flags)
+        return 0;
+
+    size_t len = p - out;
+    out[0] = old ? 'D' : 'K';
+    put16(out + 1, len - 3);
+    out[3] = flags;
+    return len;
+}
+
+/* whether a block of a message lies on the board, where the renderers draw
+ * it without checking
+ */
+static bool valid_block(const struct view *view)
+{
+    if (view->block.type >= TOTAL_BLOCKS ||
+        view->block.orientation >= TOTAL_DEGREES)
+        return false;
+    const struct position *p =
+        &positions[view->block.type][view->block.orientation];
+    for (int i = 0; i < ARRAY_SIZE(p->pos); i++) {
+        int x = view->x + p->pos[i].x, y = view->y + p->pos[i].y;
+        if (x < 0 || x >= GAME_BOARD_WIDTH || y < 0 || y >= GAME_BOARD_HEIGHT)
+            return false;
+    }
+    return true;
+}
+
+int view_decode(struct view *view, const uint8_t *data, size_t size)
+{
+    if (size < 3)
+        return 0;
+    if (data[0] != 'K' && data[0] != 'D')
+        return -1;
+    size_t len = 3 + (data[1] | data[2] << 8);
+    if (size < len)
+        return 0;
+
+    const uint8_t *p = data + 4, *end = data + len;
+    if (p > end)
+        return -1;
+    unsigned flags = data[3];
+    unsigned all = VIEW_ROWS | VIEW_BLOCK | VIEW_NEXT | VIEW_SCORE;
+    if (data[0] == 'K' && (flags & ~VIEW_OVER) != all)
+        return -1;
+
+    if (flags & VIEW_ROWS) {
+        if (end - p < 3)
+            return -1;
+        uint32_t changed = p[0] | p[1] << 8 | (uint32_t) p[2] << 16;
+        p += 3;
+        if (changed >> GAME_BOARD_HEIGHT)
+            return -1;
+        for (int i = 0; i < GAME_BOARD_HEIGHT; i++) {
+            if (!(changed >> i & 1))
+                continue;
+            if (end - p < 2)
+                return -1;
+            uint16_t row = p[0] | p[1] << 8;
+            if (row >> GAME_BOARD_WIDTH)
+                return -1;
+            view->rows[i] = row;
+            p += 2;
+        }
+    }
+
+    if (flags & VIEW_BLOCK) {
+        if (end - p < 5)
+            return -1;
+        struct view block = *view;
+        block.has_block = p[0];
+        block.block = (struct piece){.type = p[1], .orientation = p[2]};
+        block.x = (int8_t) p[3];
+        block.y = (int8_t) p[4];
+        if (block.has_block && !valid_block(&block))
+            return -1;
+        *view = block;
+        p += 5;
+    }
+
+    if (flags & VIEW_NEXT) {
+        if (end - p < 2 || p[0] >= TOTAL_BLOCKS || p[1] >= TOTAL_DEGREES)
+            return -1;
+        view->next = (struct piece){.type = p[0], .orientation = p[1]};
+        p += 2;
+    }
+
+    if (flags & VIEW_SCORE) {
+        if (end - p < 16)
+            return -1;
+        view->score = (struct game_score){.level = get32(p),
+                                          .rows_cleared = get32(p + 4),
+                                          .total_rows = get32(p + 8),
+                                          .score = get32(p + 12)};
+        p += 16;
+    }
+
+    if (data[0] == 'K' || (flags & VIEW_OVER))
+        view->game_over = flags & VIEW_OVER;
+    return p == end ? (int) len : -1;
+}
+
+void view_to_game(const struct view *view, struct tetris_game *game)
+{
+    memset(game, 0, sizeof(*game));
+    for (int i = 0; i < BOARD_ROWS; i++)
+        game->board[i] = BOARD_FULL_ROW;
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++) {
+        game->board[i + 1] =
+            BOARD_EMPTY_ROW | (row_t) (view->rows[i] << BOARD_WALL_BITS);
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++)
+            game->color[i + 1][j] = view->rows[i] >> j & 1;
+    }
+    game->has_block = view->has_block;
+    if (view->has_block) {
+        game->current = (struct block){
+            .type = view->block.type,
+            .origin = {view->x, view->y},
+            .orientation = view->block.orientation,
+            .position = &positions[view->block.type][view->block.orientation],
+        };
+    }
+    game->preview[0] = view->next;
+    game->preview_length = 1;
+    game->score = view->score;
+    game->game_over = view->game_over;
+    tetris_sync_board(game);
+}
+
+static void frame_unref(struct frame *frame)
+{
+    if (!--frame->refs)
+        free(frame);
+}
+
+static void drop_subscriber(struct broadcast *b, struct subscriber *sub)
+{
+    close(sub->fd);
+    sub->fd = -1;
+    for (unsigned i = 0; i < sub->count; i++)
+        frame_unref(sub->queue[(sub->head + i) % SUBSCRIBER_QUEUE]);
+    sub->count = 0;
+    b->subs[sub->index] = b->subs[--b->nsubs];
+    b->subs[sub->index]->index = sub->index;
+    sub->next_dropped = b->dropped;
+    b->dropped = sub;
+}
+
+static void free_dropped(struct broadcast *b)
+{
+    while (b->dropped) {
+        struct subscriber *sub = b->dropped;
+        b->dropped = sub->next_dropped;
+        free(sub);
+    }
+}
+
+static void enqueue(struct subscriber *sub, struct frame *frame)
+{
+    frame->refs++;
+    sub->queue[(sub->head + sub->count++) % SUBSCRIBER_QUEUE] = frame;
+}
+
+/* Queue a frame for a subscriber. One too far behind drops what it has not
+ * started to write, and starts over from the latest keyframe, which along
+ * with the deltas after it includes the frame.
+ */
+static void push_frame(struct broadcast *b,
+                       struct subscriber *sub,
+                       struct frame *frame)
+{
+    if (sub->count < SUBSCRIBER_QUEUE) {
+        enqueue(sub, frame);
+        return;
+    }
+
+    unsigned keep = sub->offset > 0;
+    for (unsigned i = keep; i < sub->count; i++)
+        frame_unref(sub->queue[(sub->head + i) % SUBSCRIBER_QUEUE]);
+    sub->count = keep;
+    enqueue(sub, b->key);
+    for (int i = 0; i < b->history_len; i++)
+        enqueue(sub, b->history[i]);
+    stats.skipped++;
+}
+
+/* Write what the socket takes. Returns false if the subscriber is gone. */
+static bool flush_subscriber(struct broadcast *b, struct subscriber *sub)
+{
+    while (sub->count) {
+        struct iovec iov[SUBSCRIBER_QUEUE];
+        for (unsigned i = 0; i < sub->count; i++) {
+            struct frame *frame =
+                sub->queue[(sub->head + i) % SUBSCRIBER_QUEUE];
+            iov[i] = (struct iovec){.iov_base = frame->data,
+                                    .iov_len = frame->len};
+        }
+        iov[0].iov_base = (uint8_t *) iov[0].iov_base + sub->offset;
+        iov[0].iov_len -= sub->offset;
+
+        ssize_t n = writev(sub->fd, iov, sub->count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n < 0) {
+            drop_subscriber(b, sub);
+            return false;
+        }
+        stats.written += n;
+
+        /* retire the frames written whole */
+        size_t left = sub->offset + n;
+        while (sub->count && left >= sub->queue[sub->head]->len) {
+            left -= sub->queue[sub->head]->len;
+            frame_unref(sub->queue[sub->head]);
+            sub->head = (sub->head + 1) % SUBSCRIBER_QUEUE;
+            sub->count--;
+        }
+        sub->offset = left;
+    }
+
+    bool waiting = sub->count > 0;
+    if (waiting != sub->writing) {
+        struct epoll_event ev = {.events = EPOLLIN | (waiting ? EPOLLOUT : 0),
+                                 .data.ptr = sub};
+        epoll_ctl(b->epoll, EPOLL_CTL_MOD, sub->fd, &ev);
+        sub->writing = waiting;
+    }
+    return true;
+}
+
+static void accept_subscribers(struct broadcast *b)
+{
+    for (;;) {
+        int fd = accept4(b->listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+
+        struct subscriber *sub = calloc(1, sizeof(*sub));
+        if (b->nsubs == b->max_subs) {
+            int max = b->max_subs ? b->max_subs * 2 : 64;
+            struct subscriber **subs = realloc(b->subs, max * sizeof(*subs));
+            if (subs) {
+                b->subs = subs;
+                b->max_subs = max;
+            }
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = sub};
+        if (!sub || b->nsubs == b->max_subs ||
+            epoll_ctl(b->epoll, EPOLL_CTL_ADD, fd, &ev)) {
+            free(sub);
+            close(fd);
+            continue;
+        }
+        sub->fd = fd;
+        sub->index = b->nsubs;
+        b->subs[b->nsubs++] = sub;
+        stats.subscribers++;
+
+        /* from the latest keyframe on */
+        if (b->key) {
+            enqueue(sub, b->key);
+            for (int i = 0; i < b->history_len; i++)
+                enqueue(sub, b->history[i]);
+        }
+        flush_subscriber(b, sub);
+    }
+}
+
+/* Take the frames the game queued, keep the latest keyframe and the deltas
+ * after it for those joining or falling behind, and write them out.
+ */
+static void take_frames(struct broadcast *b)
+{
+    uint64_t count;
+    if (read(b->wakeup, &count, sizeof(count)) < 0)
+        count = 0;
+
+    unsigned head = b->head;
+    unsigned tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct frame *frame = b->ring[head & (FRAME_QUEUE_SIZE - 1)];
+        bool kept = true;
+        if (frame->key) {
+            if (b->key)
+                frame_unref(b->key);
+            for (int i = 0; i < b->history_len; i++)
+                frame_unref(b->history[i]);
+            b->key = frame;
+            b->history_len = 0;
+        } else if (b->history_len < KEYFRAME_INTERVAL) {
+            b->history[b->history_len++] = frame;
+        } else {
+            kept = false; /* never: the game sends keyframes often enough */
+        }
+        for (int i = 0; i < b->nsubs; i++)
+            push_frame(b, b->subs[i], frame);
+        if (!kept)
+            frame_unref(frame);
+    }
+    __atomic_store_n(&b->head, head, __ATOMIC_RELEASE);
+
+    for (int i = 0; i < b->nsubs;) {
+        struct subscriber *sub = b->subs[i];
+        /* a dropped one is replaced by the last one */
+        if (sub->writing || flush_subscriber(b, sub))
+            i++;
+    }
+}
+
+/* subscribers say nothing: read what they do, and notice them leave */
+static void read_subscriber(struct broadcast *b, struct subscriber *sub)
+{
+    char discard[256];
+
+    for (;;) {
+        ssize_t n = read(sub->fd, discard, sizeof(discard));
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return;
+        drop_subscriber(b, sub);
+        return;
+    }
+}
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct broadcast *b = arg;
+    struct epoll_event events[64];
+    bool running = true;
+    long long linger = 0;
+
+    for (;;) {
+        int timeout = -1;
+        if (!running) {
+            /* the last frames are out, or their time is up */
+            long long ms = linger - now_ms();
+            int pending = 0;
+            for (int i = 0; i < b->nsubs; i++)
+                pending += b->subs[i]->count > 0;
+            if (!pending || ms <= 0)
+                break;
+            timeout = ms;
+        }
+
+        int n = epoll_wait(b->epoll, events, ARRAY_SIZE(events), timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &tag_wakeup) {
+                take_frames(b);
+            } else if (ptr == &tag_listener) {
+                accept_subscribers(b);
+            } else if (ptr == &tag_quit) {
+                if (running) {
+                    take_frames(b);
+                    epoll_ctl(b->epoll, EPOLL_CTL_DEL, b->quit, NULL);
+                    linger = now_ms() + LINGER_MS;
+                    running = false;
+                }
+            } else {
+                /* events for one dropped earlier in the round are stale */
+                struct subscriber *sub = ptr;
+                if (sub->fd < 0)
+                    continue;
+                if ((events[i].events & EPOLLOUT) &&
+                    !flush_subscriber(b, sub))
+                    continue;
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    read_subscriber(b, sub);
+            }
+        }
+        free_dropped(b);
+    }
+
+    while (b->nsubs)
+        drop_subscriber(b, b->subs[0]);
+    free_dropped(b);
+    return NULL;
+}
+
+struct broadcast *broadcast_start(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    strcpy(addr.sun_path, path);
+
+    struct broadcast *b = calloc(1, sizeof(*b));
+    if (!b)
+        return NULL;
+    b->need_key = true;
+    b->path = strdup(path);
+    b->listener =
+        socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    b->epoll = epoll_create1(EPOLL_CLOEXEC);
+    b->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    b->quit = eventfd(0, EFD_CLOEXEC);
+
+    /* a descriptor per spectator */
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    bool ok = b->path && b->listener >= 0 && b->epoll >= 0 && b->wakeup >= 0 &&
+              b->quit >= 0;
+    if (ok) {
+        unlink(path);
+        ok = !bind(b->listener, (struct sockaddr *) &addr, sizeof(addr)) &&
+             !listen(b->listener, SOMAXCONN);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &tag_listener};
+    ok = ok && !epoll_ctl(b->epoll, EPOLL_CTL_ADD, b->listener, &ev);
+    ev.data.ptr = &tag_wakeup;
+    ok = ok && !epoll_ctl(b->epoll, EPOLL_CTL_ADD, b->wakeup, &ev);
+    ev.data.ptr = &tag_quit;
+    ok = ok && !epoll_ctl(b->epoll, EPOLL_CTL_ADD, b->quit, &ev);
+    ok = ok && !pthread_create(&b->thread_id, NULL, writer_thread, b);
+    if (!ok) {
+        if (b->listener >= 0) {
+            close(b->listener);
+            unlink(path);
+        }
+        if (b->epoll >= 0)
+            close(b->epoll);
+        if (b->wakeup >= 0)
+            close(b->wakeup);
+        if (b->quit >= 0)
+            close(b->quit);
+        free(b->path);
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static bool queue_full(struct broadcast *b)
+{
+    return b->tail - __atomic_load_n(&b->head, __ATOMIC_ACQUIRE) ==
+           FRAME_QUEUE_SIZE;
+}
+
+/* Queue the frame bringing the spectators to 'view', unless the writer has
+ * no room for it: never wait for the writer, it gets a keyframe next time.
+ */
+static void queue_view(struct broadcast *b, const struct view *view)
+{
+    uint8_t delta[VIEW_MESSAGE_MAX];
+    size_t len = view_encode(&b->last, view, delta);
+    if (!len && !b->need_key)
+        return;
+
+    struct frame *frame = queue_full(b) ? NULL : malloc(sizeof(*frame));
+    if (!frame) {
+        b->need_key = b->behind = true;
+        b->unsent = *view;
+        stats.dropped++;
+        return;
+    }
+    frame->refs = 1;
+    frame->key = b->need_key || b->since_key >= KEYFRAME_INTERVAL - 1;
+    if (frame->key)
+        len = view_encode(NULL, view, frame->data);
+    else
+        memcpy(frame->data, delta, len);
+    frame->len = len;
+
+    b->ring[b->tail & (FRAME_QUEUE_SIZE - 1)] = frame;
+    __atomic_store_n(&b->tail, b->tail + 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    while (write(b->wakeup, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+
+    b->last = *view;
+    b->since_key = frame->key ? 0 : b->since_key + 1;
+    b->need_key = b->behind = false;
+    stats.frames++;
+    stats.keyframes += frame->key;
+    stats.bytes += len;
+}
+
+void broadcast_frame(struct broadcast *b, const struct tetris_game *game)
+{
+    if (!b)
+        return;
+
+    struct view view;
+    view_of_game(&view, game);
+    queue_view(b, &view);
+}
+
+void broadcast_stop(struct broadcast *b)
+{
+    if (!b)
+        return;
+
+    /* the game is over: the last view can wait for room */
+    while (b->behind) {
+        if (queue_full(b)) {
+            struct timespec ms = {0, 1000000};
+            nanosleep(&ms, NULL);
+            continue;
+        }
+        struct view view = b->unsent;
+        queue_view(b, &view);
+    }
+
+    uint64_t one = 1;
+    while (write(b->quit, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+    pthread_join(b->thread_id, NULL);
+
+    /* frames queued after the writer stopped */
+    for (unsigned head = b->head; head != b->tail; head++)
+        frame_unref(b->ring[head & (FRAME_QUEUE_SIZE - 1)]);
+    if (b->key)
+        frame_unref(b->key);
+    for (int i = 0; i < b->history_len; i++)
+        frame_unref(b->history[i]);
+
+    close(b->listener);
+    unlink(b->path);
+    close(b->epoll);
+    close(b->wakeup);
+    close(b->quit);
+    free(b->subs);
+    free(b->path);
+    free(b);
+}
+
+void get_broadcast_stats(struct broadcast_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,97 @@
+#ifndef __BROADCAST_H__
+#define __BROADCAST_H__
+
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Live spectating. The game publishes what a spectator sees as a stream of
+ * small messages: a keyframe holds the whole view, a delta only what changed
+ * since the message before it. Each message is encoded once, by the thread
+ * playing the game, into a buffer that all subscribers share; a thread of
+ * its own writes it out to them with writev(). A subscriber falling behind
+ * is not buffered for: it skips to the latest keyframe and the deltas since.
+ *
+ * A message is a kind byte, 'K' or 'D', a 2-byte little-endian length and
+ * the body: a byte of VIEW_* flags, then for each flag set, in this order,
+ *   VIEW_ROWS   3-byte bitmap of the rows changed, then 2 bytes of cells
+ *               per row changed, bit x for column x
+ *   VIEW_BLOCK  has_block, type, orientation, x and y of the current block
+ *   VIEW_NEXT   type and orientation of the next block
+ *   VIEW_SCORE  level, rows_cleared, total_rows and score, 4 bytes each
+ * A keyframe sets every flag, with all the rows in the bitmap.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "tetris.h"
+
+enum {
+    VIEW_ROWS = 1 << 0,
+    VIEW_BLOCK = 1 << 1,
+    VIEW_NEXT = 1 << 2,
+    VIEW_SCORE = 1 << 3,
+    VIEW_OVER = 1 << 4, /* the game is over, no payload */
+};
+
+#define VIEW_MESSAGE_MAX (3 + 1 + 3 + 2 * GAME_BOARD_HEIGHT + 5 + 2 + 16)
+
+/* the game as a spectator sees it */
+struct view {
+    uint16_t rows[GAME_BOARD_HEIGHT]; /* the stack, without the block */
+    bool has_block;
+    struct piece block;
+    int8_t x, y; /* origin of the block */
+    struct piece next;
+    struct game_score score;
+    bool game_over;
+};
+
+void view_of_game(struct view *view, const struct tetris_game *game);
+
+/* Encode the difference from 'old' to 'view', or all of 'view' if 'old' is
+ * NULL, into 'out' of VIEW_MESSAGE_MAX bytes. Returns its length, or 0 if
+ * nothing changed.
+ */
+size_t view_encode(const struct view *old,
+                   const struct view *view,
+                   uint8_t *out);
+
+/* Apply the message at 'data' to 'view'. Returns the length it took, 0 if
+ * the message is not complete yet, or -1 if it is malformed.
+ */
+int view_decode(struct view *view, const uint8_t *data, size_t size);
+
+/* The game in a form the renderers of tetris.h draw. */
+void view_to_game(const struct view *view, struct tetris_game *game);
+
+/* Publishing, on a Unix stream socket at 'path'. */
+struct broadcast;
+
+struct broadcast *broadcast_start(const char *path);
+
+/* Send the view of 'game' if it changed: from the thread playing it only,
+ * and never waiting. NULL does nothing.
+ */
+void broadcast_frame(struct broadcast *broadcast,
+                     const struct tetris_game *game);
+
+/* give the subscribers a second to take the last frames, then close */
+void broadcast_stop(struct broadcast *broadcast);
+
+struct broadcast_stats {
+    unsigned long long frames, keyframes; /* encoded */
+    unsigned long long bytes;             /* encoded, once for everyone */
+    unsigned long long dropped; /* frames the game thread could not queue */
+    unsigned long long subscribers; /* served */
+    unsigned long long skipped;     /* times one was sent back to a keyframe */
+    unsigned long long written;     /* bytes to all subscribers */
+};
+
+/* what the broadcast of the process did so far */
+void get_broadcast_stats(struct broadcast_stats *stats);
+
+#endif /* __BROADCAST_H__ */
@@ -0,0 +1,242 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Board evaluator. The features are all counts, computed exactly by every
+ * implementation, and the weighted sum is always taken in the same order,
+ * so a board scores the same whichever code path ran on whichever CPU.
+ */
+
+#include "ai.h"
+
+#define FIELD_MASK ((row_t) ~BOARD_EMPTY_ROW)
+/* bit j set for each pair of horizontally adjacent cells j, j + 1, walls
+ * included
+ */
+#define TRANSITION_MASK \
+    ((row_t)(((1U << (GAME_BOARD_WIDTH + 1)) - 1) << (BOARD_WALL_BITS - 1)))
+#define HEIGHT_BITS 5 /* enough to count GAME_BOARD_HEIGHT rows */
+
+struct features {
+    int aggregate, holes, bumpiness, wells, transitions;
+};
+
+static double combine(const struct features *f,
+                      int lines,
+                      const struct ai_weights *w)
+{
+    return w->height * f->aggregate + w->lines * lines + w->holes * f->holes +
+           w->bumpiness * f->bumpiness + w->wells * f->wells +
+           w->transitions * f->transitions;
+}
+
+/* the features of the skyline, from the height of every column */
+static void profile(const int *heights, struct features *f)
+{
+    f->bumpiness = f->wells = 0;
+    for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+        int left = x > 0 ? heights[x - 1] : GAME_BOARD_HEIGHT;
+        int right = x < GAME_BOARD_WIDTH - 1 ? heights[x + 1] : GAME_BOARD_HEIGHT;
+        int depth = (left < right ? left : right) - heights[x];
+        if (depth > 0)
+            f->wells += depth;
+        if (x > 0)
+            f->bumpiness += heights[x] > heights[x - 1]
+                                ? heights[x] - heights[x - 1]
+                                : heights[x - 1] - heights[x];
+    }
+}
+
+static void scalar_features(const row_t *board, struct features *f)
+{
+    int heights[GAME_BOARD_WIDTH] = {0};
+    unsigned covered = 0;
+
+    f->aggregate = f->holes = f->transitions = 0;
+
+    /* walk down the rows, tracking which columns have been entered */
+    for (int i = 1; i <= GAME_BOARD_HEIGHT; i++) {
+        unsigned row = board[i] & FIELD_MASK;
+        for (unsigned fresh = row & ~covered; fresh; fresh &= fresh - 1) {
+            int x = __builtin_ctz(fresh) - BOARD_WALL_BITS;
+            heights[x] = GAME_BOARD_HEIGHT - i + 1;
+        }
+        f->holes += __builtin_popcount(covered & ~row);
+        covered |= row;
+        f->aggregate += __builtin_popcount(covered);
+        f->transitions +=
+            __builtin_popcount((board[i] ^ (board[i] >> 1)) & TRANSITION_MASK);
+    }
+    profile(heights, f);
+}
+
+double ai_evaluate(const row_t *board, int lines, const struct ai_weights *w)
+{
+    struct features f;
+    scalar_features(board, &f);
+    return combine(&f, lines, w);
+}
+
+static void batch_scalar(const struct ai_batch *batch,
+                         int count,
+                         const struct ai_weights *w,
+                         double *scores)
+{
+    for (int j = 0; j < count; j++) {
+        row_t board[BOARD_ROWS];
+        for (int i = 0; i < GAME_BOARD_HEIGHT; i++)
+            board[i + 1] = batch->rows[i][j];
+        scores[j] = ai_evaluate(board, 0, w);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/* One 16-bit lane per board. Written with the compiler's vector extensions
+ * and built twice below: once for SSE2, as two 128-bit halves, and once
+ * for AVX2, as a single 256-bit register.
+ */
+typedef uint16_t lanes_t __attribute__((vector_size(AI_BATCH * 2)));
+typedef int16_t slanes_t __attribute__((vector_size(AI_BATCH * 2)));
+
+/* Add the population count of every lane of 'x' to 'sum' (SWAR). Vectors
+ * go by pointer: the helpers are inlined into code built for different
+ * vector units, whose calling conventions for them disagree.
+ */
+#define INLINE static inline __attribute__((always_inline))
+
+INLINE void add_popcount(lanes_t *sum, const lanes_t *x)
+{
+    lanes_t v = *x;
+    v -= (v >> 1) & 0x5555;
+    v = (v & 0x3333) + ((v >> 2) & 0x3333);
+    v = (v + (v >> 4)) & 0x0f0f;
+    *sum += (v + (v >> 8)) & 0x1f;
+}
+
+INLINE void batch_kernel(const struct ai_batch *batch, uint16_t f[][AI_BATCH])
+{
+    lanes_t covered = {0}, holes = {0}, aggregate = {0}, transitions = {0};
+    lanes_t planes[HEIGHT_BITS] = {{0}}; /* bit-sliced column heights */
+
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++) {
+        lanes_t row;
+        memcpy(&row, batch->rows[i], sizeof(row));
+        lanes_t cells = row & FIELD_MASK;
+
+        lanes_t hidden = covered & ~cells;
+        add_popcount(&holes, &hidden);
+        covered |= cells;
+        add_popcount(&aggregate, &covered);
+        lanes_t changes = (row ^ (row >> 1)) & TRANSITION_MASK;
+        add_popcount(&transitions, &changes);
+
+        /* a covered column is one row taller: add 'covered' to the
+         * counters, every column of every board at once
+         */
+        lanes_t carry = covered;
+        for (int k = 0; k < HEIGHT_BITS; k++) {
+            lanes_t next = planes[k] & carry;
+            planes[k] ^= carry;
+            carry = next;
+        }
+    }
+
+    slanes_t heights[GAME_BOARD_WIDTH], bumpiness = {0}, wells = {0};
+    for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+        lanes_t h = {0};
+        for (int k = 0; k < HEIGHT_BITS; k++)
+            h |= ((planes[k] >> (x + BOARD_WALL_BITS)) & 1) << k;
+        heights[x] = (slanes_t) h;
+    }
+    for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+        slanes_t edge = {0};
+        edge += GAME_BOARD_HEIGHT;
+        slanes_t left = x > 0 ? heights[x - 1] : edge;
+        slanes_t right = x < GAME_BOARD_WIDTH - 1 ? heights[x + 1] : edge;
+        slanes_t less = left < right;
+        slanes_t depth = ((left & less) | (right & ~less)) - heights[x];
+        wells += depth & (depth > 0);
+        if (x > 0) {
+            slanes_t d = heights[x] - heights[x - 1];
+            slanes_t sign = d < 0;
+            bumpiness += (d ^ sign) - sign;
+        }
+    }
+
+    memcpy(f[0], &aggregate, sizeof(f[0]));
+    memcpy(f[1], &holes, sizeof(f[1]));
+    memcpy(f[2], &bumpiness, sizeof(f[2]));
+    memcpy(f[3], &wells, sizeof(f[3]));
+    memcpy(f[4], &transitions, sizeof(f[4]));
+}
+
+/* The vector code only counts; the scores are summed by the caller, so the
+ * code built for AVX2 never calls into code built without it.
+ */
+__attribute__((target("sse2"))) static void batch_sse2(
+    const struct ai_batch *batch,
+    uint16_t f[][AI_BATCH])
+{
+    batch_kernel(batch, f);
+}
+
+__attribute__((target("avx2"))) static void batch_avx2(
+    const struct ai_batch *batch,
+    uint16_t f[][AI_BATCH])
+{
+    batch_kernel(batch, f);
+}
+
+typedef void (*batch_fn)(const struct ai_batch *, uint16_t[][AI_BATCH]);
+
+static batch_fn select_batch(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return batch_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return batch_sse2;
+    return NULL;
+}
+
+void ai_evaluate_batch(const struct ai_batch *batch,
+                       int count,
+                       const struct ai_weights *w,
+                       double *scores)
+{
+    /* every thread picks the same one, so a race is harmless */
+    static batch_fn fn;
+    static bool selected;
+    if (!__atomic_load_n(&selected, __ATOMIC_ACQUIRE)) {
+        __atomic_store_n(&fn, select_batch(), __ATOMIC_RELAXED);
+        __atomic_store_n(&selected, true, __ATOMIC_RELEASE);
+    }
+
+    batch_fn kernel = __atomic_load_n(&fn, __ATOMIC_RELAXED);
+    if (!kernel) {
+        batch_scalar(batch, count, w, scores);
+        return;
+    }
+
+    uint16_t f[5][AI_BATCH];
+    kernel(batch, f);
+    for (int j = 0; j < count; j++) {
+        struct features lane = {f[0][j], f[1][j], f[2][j], f[3][j], f[4][j]};
+        scores[j] = combine(&lane, 0, w);
+    }
+}
+
+#else
+
+void ai_evaluate_batch(const struct ai_batch *batch,
+                       int count,
+                       const struct ai_weights *w,
+                       double *scores)
+{
+    batch_scalar(batch, count, w, scores);
+}
+
+#endif
@@ -5,145 +5,192 @@
  */
 
 #include <assert.h>
-#include <pthread.h>
+#include <ctype.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "tetris.h"
 
 #define BASE_SCORE_PER_ROW 10 /* score awarded for each row cleared */
 #define MAX_ROWS_PER_LEVEL 10 /* rows to clear before next level */
-#define INITIAL_TIMEOUT 1000
-
-/* rule for calculating timeout reduction delta with each new level */
-#define TIMEOUT_DELTA(level) ((DIFFICULTY_LEVEL_MAX - (level) + 1) * 3)
-
-typedef enum {
-    ACTION_DROP, /* drop the block at the floor */
-    ACTION_MOVE_LEFT,
-    ACTION_MOVE_RIGHT,
-    ACTION_MOVE_DOWN,
-    ACTION_ROTATE_LEFT,
-    ACTION_PLACE_NEW,
-    TOTAL_MOVEMENTS
-} action_t;
-
-struct thread_data {
-    struct block *current;
-    bool game_over;
-    pthread_mutex_t lock;
-    pthread_t thread_id;
-};
-
-int board[GAME_BOARD_HEIGHT + 2][GAME_BOARD_WIDTH + 2];
-
-static block_t next_block = -1;
-static degree_t next_block_orientation = -1;
-static struct block current_block;
-
-static const struct point starting_position = {4, 0};
-const struct position positions[TOTAL_BLOCKS][TOTAL_DEGREES] =
-    {
-        [BLOCK_SQUARE] =
-            {
-                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_0 */
-                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_90 */
-                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_180 */
-                {{{1, 1}, {2, 1}, {1, 2}, {2, 2}}}, /* DEG_270 */
-            },
-        [BLOCK_LINE] =
-            {
-                {{{0, 1}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_0 */
-                {{{2, 0}, {2, 1}, {2, 2}, {2, 3}}}, /* DEG_90 */
-                {{{0, 1}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_180 */
-                {{{2, 0}, {2, 1}, {2, 2}, {2, 3}}}, /* DEG_270 */
-            },
-        [BLOCK_TEE] =
-            {
-                {{{2, 0}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_0 */
-                {{{2, 0}, {2, 1}, {2, 2}, {3, 1}}}, /* DEG_90 */
-                {{{2, 2}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_180 */
-                {{{2, 0}, {2, 1}, {2, 2}, {1, 1}}}, /* DEG_270 */
-            },
-        [BLOCK_ZEE_1] =
-            {
-                {{{2, 0}, {1, 1}, {2, 1}, {1, 2}}}, /* DEG_0 */
-                {{{1, 1}, {2, 1}, {2, 2}, {3, 2}}}, /* DEG_90 */
-                {{{2, 0}, {1, 1}, {2, 1}, {1, 2}}}, /* DEG_180 */
-                {{{1, 1}, {2, 1}, {2, 2}, {3, 2}}}, /* DEG_270 */
-            },
-        [BLOCK_ZEE_2] =
-            {
-                {{{1, 0}, {1, 1}, {2, 1}, {2, 2}}}, /* DEG_0 */
-                {{{1, 1}, {2, 1}, {0, 2}, {1, 2}}}, /* DEG_90 */
-                {{{1, 0}, {1, 1}, {2, 1}, {2, 2}}}, /* DEG_180 */
-                {{{1, 1}, {2, 1}, {0, 2}, {1, 2}}}, /* DEG_270 */
-            },
-        [BLOCK_ELL_1] =
-            {
-                {{{1, 0}, {1, 1}, {1, 2}, {2, 2}}}, /* DEG_0 */
-                {{{1, 1}, {2, 1}, {3, 1}, {1, 2}}}, /* DEG_90 */
-                {{{1, 0}, {2, 0}, {2, 1}, {2, 2}}}, /* DEG_180 */
-                {{{2, 0}, {0, 1}, {1, 1}, {2, 1}}}, /* DEG_270 */
-            },
-        [BLOCK_ELL_2] =
-            {
-                {{{2, 0}, {2, 1}, {2, 2}, {1, 2}}}, /* DEG_0 */
-                {{{1, 0}, {1, 1}, {2, 1}, {3, 1}}}, /* DEG_90 */
-                {{{1, 0}, {2, 0}, {1, 1}, {1, 2}}}, /* DEG_180 */
-                {{{0, 1}, {1, 1}, {2, 1}, {2, 2}}}, /* DEG_270 */
-            },
-};
-
-static void reset_game_board(void)
+
+const struct point starting_position = {4, 0};
+
+static void reset_game_board(struct tetris_game *game)
+{
+    for (int i = 0; i < BOARD_ROWS; i++)
+        game->board[i] = (i >= 1 && i <= GAME_BOARD_HEIGHT) ? BOARD_EMPTY_ROW
+                                                             : BOARD_FULL_ROW;
+    memset(game->color, 0, sizeof(game->color));
+    memset(game->column_height, 0, sizeof(game->column_height));
+    game->top_row = GAME_BOARD_HEIGHT;
+    game->hash = 0; /* no cell is filled */
+}
+
+static struct piece generate_piece(struct tetris_game *game)
 {
-    memset(board, 0, sizeof(board));
-    memset(board[0], ~0, sizeof(*board));
-    memset(board[GAME_BOARD_HEIGHT + 1], ~0, sizeof(*board));
-    for (int i = 0; i < GAME_BOARD_HEIGHT + 2; i++)
-        board[i][0] = board[i][GAME_BOARD_WIDTH + 1] = ~0;
+    struct piece piece;
+
+    switch (game->policy) {
+    case PIECES_SEQUENCE:
+        piece = game->sequence[game->sequence_pos++];
+        if (game->sequence_pos == game->sequence_length)
+            game->sequence_pos = 0;
+        return piece;
+    case PIECES_BAG:
+        if (!game->bag_left) { /* refill the bag */
+            for (int i = 0; i < TOTAL_BLOCKS; i++)
+                game->bag[i] = i;
+            game->bag_left = TOTAL_BLOCKS;
+        }
+        /* draw a random block out of the remaining ones */
+        int i = tetris_rng_below(&game->rng, game->bag_left--);
+        piece.type = game->bag[i];
+        game->bag[i] = game->bag[game->bag_left];
+        break;
+    case PIECES_UNIFORM:
+    default:
+        piece.type = tetris_rng_below(&game->rng, TOTAL_BLOCKS);
+        break;
+    }
+    piece.orientation = tetris_rng_below(&game->rng, TOTAL_DEGREES);
+    return piece;
 }
 
-static void init_game_internals(void)
+void tetris_init(struct tetris_game *game, const struct tetris_config *config)
 {
+    memset(game, 0, sizeof(*game));
+
     /* initialize the board */
-    reset_game_board();
+    reset_game_board(game);
+
+    /* initialize the piece generator and fill the preview */
+    tetris_rng_seed(&game->rng, config->seed);
+    game->policy = config->policy;
+    if (game->policy == PIECES_SEQUENCE &&
+        (!config->sequence || config->sequence_length <= 0))
+        game->policy = PIECES_UNIFORM;
+    game->sequence = config->sequence;
+    game->sequence_length = config->sequence_length;
+
+    game->preview_length = config->preview;
+    if (game->preview_length < 1)
+        game->preview_length = 1;
+    if (game->preview_length > TETRIS_PREVIEW_MAX)
+        game->preview_length = TETRIS_PREVIEW_MAX;
+    for (int i = 0; i < game->preview_length; i++)
+        game->preview[i] = generate_piece(game);
+
+    game->score.level = 1;
+    game->timeout = INITIAL_TIMEOUT;
+    /* FIXME: setup initial timeout by reducing all delta upto initial_level */
+    for (int i = 1; i <= /* initial_level */ 1; i++)
+        game->timeout -= TIMEOUT_DELTA(i);
+}
+
+static void update_current_block(struct tetris_game *game)
+{
+    int head = game->preview_head;
+
+    game->current.type = game->preview[head].type;
+    game->current.orientation = game->preview[head].orientation;
 
-    /* initialize the current and next block */
-    srand((unsigned) time(NULL));
-    next_block = (block_t)(rand() % TOTAL_BLOCKS);
-    next_block_orientation = (degree_t)(rand() % TOTAL_DEGREES);
+    /* the slot behind the last preview entry becomes the new tail */
+    game->preview[(head + game->preview_length) & (TETRIS_PREVIEW_MAX - 1)] =
+        generate_piece(game);
+    game->preview_head = (head + 1) & (TETRIS_PREVIEW_MAX - 1);
 }
 
-static struct block *update_current_block(struct block *block)
+int tetris_load_sequence(const char *path, struct piece **sequence)
 {
-    if (!block)
-        block = &current_block;
+    static const char letters[TOTAL_BLOCKS] = {
+        [BLOCK_SQUARE] = 'O', [BLOCK_LINE] = 'I',  [BLOCK_TEE] = 'T',
+        [BLOCK_ZEE_1] = 'Z',  [BLOCK_ZEE_2] = 'S', [BLOCK_ELL_1] = 'L',
+        [BLOCK_ELL_2] = 'J',
+    };
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    int count = 0, capacity = 0, c;
+    struct piece *list = NULL;
+    while ((c = fgetc(fp)) != EOF) {
+        if (c == '#') { /* skip the comment */
+            while ((c = fgetc(fp)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if (isspace(c) || c == ',')
+            continue;
+        if (c >= '0' && c < '0' + TOTAL_DEGREES && count) {
+            list[count - 1].orientation = c - '0';
+            continue;
+        }
 
-    block->type = next_block;
-    block->orientation = next_block_orientation;
+        const char *type = memchr(letters, toupper(c), sizeof(letters));
+        if (!type)
+            goto fail;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct piece *p = realloc(list, capacity * sizeof(*list));
+            if (!p)
+                goto fail;
+            list = p;
+        }
+        list[count++] = (struct piece){.type = type - letters,
+                                       .orientation = DEG_0};
+    }
+    fclose(fp);
 
-    next_block = (block_t)(rand() % TOTAL_BLOCKS);
-    next_block_orientation = (degree_t)(rand() % TOTAL_DEGREES);
+    if (!count) {
+        free(list);
+        return -1;
+    }
+    *sequence = list;
+    return count;
 
-    return block;
+fail:
+    fclose(fp);
+    free(list);
+    return -1;
 }
 
-static bool test_movement(struct block *block)
+static bool test_movement(const struct tetris_game *game,
+                          const struct block *block)
 {
-    for (int i = 0; i < ARRAY_SIZE(block->position->pos); i++) {
-        int x = block->origin.x + block->position->pos[i].x;
-        int y = block->origin.y + block->position->pos[i].y;
-        if (board[y + 1][x + 1]) {
-            return false;
-        }
+    assert(block->origin.x >= BLOCK_X_MIN && block->origin.x <= BLOCK_X_MAX);
+    return block_fits(game->board, block->type, block->orientation,
+                      block->origin.x, block->origin.y);
+}
+
+/* Distance the block can fall, computed from the skyline and the bottom
+ * profile of the block. Returns -1 if any column of the block lies below the
+ * skyline (tucked under an overhang), where the skyline says nothing.
+ */
+static int skyline_drop(const struct tetris_game *game,
+                        const struct block *block)
+{
+    const struct block_shape *shape =
+        &block_shapes[block->type][block->orientation];
+    int distance = GAME_BOARD_HEIGHT;
+
+    for (int i = shape->min_x; i <= shape->max_x; i++) {
+        int x = block->origin.x + i;
+        int bottom = block->origin.y + shape->bottom[i];
+        int surface = GAME_BOARD_HEIGHT - game->column_height[x];
+        if (bottom >= surface)
+            return -1;
+        if (surface - 1 - bottom < distance)
+            distance = surface - 1 - bottom;
     }
-    return true;
+    return distance;
 }
 
-static bool move_block(struct block *block, action_t movement)
+static bool move_block(const struct tetris_game *game,
+                       struct block *block,
+                       action_t movement)
 {
     struct block newblock = *block; /* start with a copy of the given block */
 
@@ -161,14 +208,23 @@ static bool move_block(struct block *block, action_t movement)
         ++newblock.origin.y;
         assert(newblock.origin.y < GAME_BOARD_HEIGHT);
         break;
-    case ACTION_DROP:
+    case ACTION_DROP: {
+        int distance = skyline_drop(game, &newblock);
+        if (distance >= 0) {
+            newblock.origin.y += distance;
+            assert(newblock.origin.y < GAME_BOARD_HEIGHT);
+            break;
+        }
+
+        /* under an overhang: probe row by row */
         do {
             newblock.origin.y++;
-        } while (test_movement(&newblock));
+        } while (test_movement(game, &newblock));
 
         newblock.origin.y--;
         assert(newblock.origin.y < GAME_BOARD_HEIGHT);
         break;
+    }
     case ACTION_ROTATE_LEFT:
         if (newblock.orientation == DEG_0)
             newblock.orientation = TOTAL_DEGREES - 1;
@@ -185,134 +241,106 @@ static bool move_block(struct block *block, action_t movement)
     }
 
     /* check if the new changes can be applied */
-    bool result = test_movement(&newblock);
+    bool result = test_movement(game, &newblock);
     if (result)
         *block = newblock; /* apply the new change */
     return result;
 }
 
-static void main_loop(struct thread_data *data)
+static void freeze_block(struct tetris_game *game, const struct block *current)
 {
-    while (1) {
-        input_t input = get_user_input();
-        if (input == INPUT_INVALID)
-            continue;
-
-        pthread_mutex_lock(&data->lock);
-
-        /* check if the game is valid */
-        if (data->game_over) {
-            pthread_mutex_unlock(&data->lock);
-            break;
-        }
-
-        /* in case there is no "current block", do nothing */
-        if (input != INPUT_PAUSE_QUIT && !data->current) {
-            pthread_mutex_unlock(&data->lock);
-            continue;
-        }
-
-        switch (input) {
-            bool status;
-        case INPUT_MOVE_LEFT:
-            if (move_block(data->current, ACTION_MOVE_LEFT))
-                draw_game_board(data->current);
-            break;
-        case INPUT_MOVE_RIGHT:
-            if (move_block(data->current, ACTION_MOVE_RIGHT))
-                draw_game_board(data->current);
-            break;
-        case INPUT_DROP:
-            if (move_block(data->current, ACTION_DROP))
-                draw_game_board(data->current);
-            break;
-        case INPUT_ROTATE_LEFT:
-            if (move_block(data->current, ACTION_ROTATE_LEFT))
-                draw_game_board(data->current);
-            break;
-        case INPUT_PAUSE_QUIT:
-            status = show_quit_dialog();
-            draw_game_board(data->current);
-            if (!status) /* if the user chooses to quit */
-                data->game_over = true;
-            break;
-        case INPUT_TIMEOUT: /* nothing to do */
-        default:
-            break;
-        }
-
-        pthread_mutex_unlock(&data->lock);
-    }
-}
-
-/* the nearest empty row (counting from bottom) in the board */
-static int top_row = GAME_BOARD_HEIGHT;
-
-static void freeze_block(struct block *current)
-{
-    static const int empty_row[GAME_BOARD_WIDTH + 2] = {
-        ~0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, /* GAME_BOARD_WIDTH times */
-        ~0,
-    };
-
     /* fuse the current block with the board */
     for (int i = 0; i < ARRAY_SIZE(current->position->pos); i++) {
         int x = current->origin.x + current->position->pos[i].x;
         int y = current->origin.y + current->position->pos[i].y;
-        assert(board[y + 1][x + 1] == 0);
-        board[y + 1][x + 1] = 1; /* FIXME: change to supported colors */
-    }
-
-    /* now recompute the top_row */
-    for (int i = GAME_BOARD_HEIGHT; i > 0; i--) {
-        if (!memcmp(board[i], empty_row, sizeof(*board))) {
-            top_row = i;
-            break;
-        }
+        assert(!(game->board[y + 1] & BOARD_CELL(x)));
+        game->board[y + 1] |= BOARD_CELL(x);
+        game->color[y + 1][x] = current->type + 1;
+        game->hash ^= row_hash(y + 1, BOARD_CELL(x));
+
+        /* raise the skyline and the top_row over the new cell */
+        if (game->column_height[x] < GAME_BOARD_HEIGHT - y)
+            game->column_height[x] = GAME_BOARD_HEIGHT - y;
+        if (game->top_row > y)
+            game->top_row = y > 0 ? y : 1; /* the stack may reach the top row */
     }
-    assert(top_row > 0);
+    assert(game->top_row > 0);
 }
 
-extern void draw_cleared_rows_animation(int *rows, int count);
-static int clear_even_rows(void)
+static int clear_even_rows(struct tetris_game *game)
 {
     int count = 0;
-    int cleared_rows[4]; /* XXX: max 4 rows can be cleared at a time? */
-
-    /* set animation style */
-    static void (*clear_animation)(int *, int) = draw_cleared_rows_animation;
-
-    for (int abs_row = GAME_BOARD_HEIGHT, i = GAME_BOARD_HEIGHT; i > top_row;
-         abs_row--) {
-        bool found = true;
-        for (int j = 1; j < GAME_BOARD_WIDTH + 1; j++) {
-            if (!board[i][j]) {
-                found = false;
-                break;
-            }
-        }
+    int *cleared_rows = game->cleared_rows; /* max 4 rows: a block's height */
+    row_t *board = game->board;
 
-        if (found)
+    for (int abs_row = GAME_BOARD_HEIGHT, i = GAME_BOARD_HEIGHT;
+         i >= game->top_row; abs_row--) {
+        if (board[i] == BOARD_FULL_ROW)
             cleared_rows[count++] = abs_row - 1; /* save the absolute row */
         else {
             i--;
             continue; /* move on to check the next row */
         }
 
-        memset(board[i], 0, sizeof(*board)); /* clear the current row */
-        /* move down the all the rows above the cleared row */
-        memmove(board[top_row + 1], board[top_row],
+        /* move down the all the rows above the cleared row, rehashing only
+         * the rows that shift
+         */
+        int top_row = game->top_row;
+        game->hash ^= board_hash(board, top_row, i);
+        memmove(&board[top_row + 1], &board[top_row],
                 (i - top_row) * sizeof(*board));
-        top_row++;
-        assert(top_row <= GAME_BOARD_HEIGHT);
+        memmove(game->color[top_row + 1], game->color[top_row],
+                (i - top_row) * sizeof(*game->color));
+        board[top_row] = BOARD_EMPTY_ROW;
+        memset(game->color[top_row], 0, sizeof(*game->color));
+        game->hash ^= board_hash(board, top_row, i);
+        game->top_row++;
+        assert(game->top_row <= GAME_BOARD_HEIGHT);
     }
 
-    /* now animate (blink) the cleared rows */
-    if (count)
-        clear_animation(cleared_rows, count);
+    /* Each cleared row was full, so every column lost one cell below its
+     * top. Lower the skyline and, where the top cell itself was cleared,
+     * walk down to the next filled cell.
+     */
+    if (count) {
+        int max_height = 0;
+        for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+            int h = game->column_height[x] - count;
+            while (h > 0 &&
+                   !(board[GAME_BOARD_HEIGHT - h + 1] & BOARD_CELL(x)))
+                h--;
+            game->column_height[x] = h;
+            if (max_height < h)
+                max_height = h;
+        }
+        game->top_row = max_height < GAME_BOARD_HEIGHT
+                            ? GAME_BOARD_HEIGHT - max_height
+                            : 1;
+    }
+
+    assert(game->hash == board_hash(board, 1, GAME_BOARD_HEIGHT));
+    game->cleared_count = count;
     return count;
 }
 
+void tetris_sync_board(struct tetris_game *game)
+{
+    int max_height = 0;
+
+    for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+        int h = GAME_BOARD_HEIGHT;
+        while (h > 0 &&
+               !(game->board[GAME_BOARD_HEIGHT - h + 1] & BOARD_CELL(x)))
+            h--;
+        game->column_height[x] = h;
+        if (max_height < h)
+            max_height = h;
+    }
+    game->top_row =
+        max_height < GAME_BOARD_HEIGHT ? GAME_BOARD_HEIGHT - max_height : 1;
+    game->hash = board_hash(game->board, 1, GAME_BOARD_HEIGHT);
+}
+
 static bool update_score_level(struct game_score *score,
                                int num_rows,
                                int *timeout)
@@ -335,90 +363,103 @@ static bool update_score_level(struct game_score *score,
     return has_level_changed;
 }
 
-static void *worker_thread(void *arg)
+static unsigned notify(struct tetris_game *game, unsigned events)
 {
-    int timeout = INITIAL_TIMEOUT;
-    struct game_score game_score = {
-        .level = 1, .rows_cleared = 0, .total_rows = 0, .score = 0};
-    struct thread_data *data = (struct thread_data *) arg;
-
-    /* FIXME: setup initial timeout by reducing all delta upto initial_level */
-    for (int i = 1; i <= /* initial_level */ 1; i++)
-        timeout -= TIMEOUT_DELTA(i);
-
-    draw_score_board(&game_score);
-
-    /* main game loop */
-    while (1) {
-        /* wait till timeout */
-        snooze(timeout);
+    if (events && game->observer && game->observer->notify)
+        game->observer->notify(game->observer->opaque, game, events);
+    return events;
+}
 
-        /* acquire the lock */
-        pthread_mutex_lock(&data->lock);
+unsigned tetris_step(struct tetris_game *game, action_t action)
+{
+    /* in case there is no "current block", do nothing */
+    if (game->game_over || !game->has_block)
+        return 0;
+    /* moving down and placing a new block are the ticks' alone */
+    if (action == ACTION_MOVE_DOWN || action == ACTION_PLACE_NEW ||
+        action >= TOTAL_MOVEMENTS)
+        return 0;
+
+    if (!move_block(game, &game->current, action))
+        return 0;
+    if (game->observer && game->observer->input)
+        game->observer->input(game->observer->opaque, game, action);
+    return notify(game, TETRIS_EVENT_MOVED);
+}
 
-        if (data->game_over) {
-            pthread_mutex_unlock(&data->lock);
-            break;
+unsigned tetris_tick(struct tetris_game *game)
+{
+    if (game->game_over)
+        return TETRIS_EVENT_GAME_OVER;
+
+    game->ticks++;
+    if (!game->has_block) {
+        update_current_block(game);
+        if (!move_block(game, &game->current, ACTION_PLACE_NEW)) {
+            game->game_over = true;
+            return notify(game, TETRIS_EVENT_GAME_OVER);
         }
+        game->has_block = true;
+        return notify(game, TETRIS_EVENT_NEW_BLOCK);
+    }
 
-        if (!data->current) {
-            data->current = update_current_block(NULL);
-
-            if (!move_block(data->current, ACTION_PLACE_NEW)) {
-                data->game_over = true;
-                pthread_mutex_unlock(&data->lock);
-                break;
-            }
-
-            draw_next_block(next_block, next_block_orientation);
-        } else {
-            /* try to move the block downwards */
-            if (!move_block(data->current, ACTION_MOVE_DOWN)) {
-                /* freeze this block in the game board */
-                freeze_block(data->current);
-                data->current = NULL; /* reset the current block pointer */
-
-                int num_rows = clear_even_rows();
-                if (num_rows) {
-                    int ret =
-                        update_score_level(&game_score, num_rows, &timeout);
-                    draw_score_board(&game_score);
-
-                    /* see if the level has changed */
-                    if (ret) {
-                        draw_game_board(data->current);
-                        draw_level_info(game_score.level);
-                    }
-                }
-            }
-        }
+    /* try to move the block downwards */
+    if (move_block(game, &game->current, ACTION_MOVE_DOWN))
+        return notify(game, TETRIS_EVENT_MOVED);
+
+    /* freeze this block in the game board */
+    unsigned events = TETRIS_EVENT_LOCKED;
+    freeze_block(game, &game->current);
+    game->has_block = false;
 
-        draw_game_board(data->current);
-        pthread_mutex_unlock(&data->lock);
+    int num_rows = clear_even_rows(game);
+    if (num_rows) {
+        events |= TETRIS_EVENT_LINES_CLEARED;
+        if (update_score_level(&game->score, num_rows, &game->timeout))
+            events |= TETRIS_EVENT_LEVEL_UP;
     }
+    return notify(game, events);
+}
 
-    return arg;
+bool tetris_block_resting(const struct tetris_game *game)
+{
+    struct block below = game->current;
+    below.origin.y++;
+    return game->has_block && !test_movement(game, &below);
 }
 
-bool start_new_game(void)
+bool tetris_state_valid(const struct tetris_game *game)
 {
-    struct thread_data data = {.current = NULL,
-                               .game_over = false,
-                               .lock = PTHREAD_MUTEX_INITIALIZER,
-                               .thread_id = 0};
-    init_game_internals();
-    init_game_screen();
-
-    /* draw the next block and level info */
-    draw_next_block(next_block, next_block_orientation);
-    draw_level_info(/* initial_level */ 1);
-
-    /* create the worker thread */
-    if (pthread_create(&data.thread_id, NULL, worker_thread, (void *) &data))
+    const struct game_score *s = &game->score;
+    if (s->level < 1 || s->score < 0 || s->total_rows < 0 ||
+        s->rows_cleared < 0 || s->rows_cleared >= MAX_ROWS_PER_LEVEL)
         return false;
 
-    main_loop(&data);
-    pthread_join(data.thread_id, NULL);
+    /* each level up took from 10 rows to 3 more, when 4 came at once */
+    long long ups = s->level - 1;
+    if (s->total_rows < ups * MAX_ROWS_PER_LEVEL + s->rows_cleared ||
+        s->total_rows > ups * (MAX_ROWS_PER_LEVEL + 3) + s->rows_cleared)
+        return false;
 
-    return true;
+    /* each row was worth from 1 to 4 times the level at that time */
+    long long rows_score = (long long) s->total_rows * BASE_SCORE_PER_ROW;
+    if (s->score % BASE_SCORE_PER_ROW || s->score < rows_score ||
+        s->score > rows_score * s->level * 4)
+        return false;
+
+    /* as set up by tetris_init(), then by update_score_level() */
+    int timeout = INITIAL_TIMEOUT - TIMEOUT_DELTA(1);
+    for (int level = 1; level < s->level && level < DIFFICULTY_LEVEL_MAX;
+         level++)
+        timeout -= TIMEOUT_DELTA(level);
+    if (game->timeout != timeout)
+        return false;
+
+    /* the game ends as a new block fails to enter the board */
+    if (game->game_over && game->has_block)
+        return false;
+    return !game->has_block ||
+           block_fits(game->board, game->current.type,
+                      game->current.orientation, game->current.origin.x,
+                      game->current.origin.y);
 }
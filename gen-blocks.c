@@ -0,0 +1,148 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Emit the block lookup tables declared in tetris.h. For every block,
+ * orientation and origin.x the four row masks are stored pre-shifted, so a
+ * collision test is a single table lookup and mask test. The Zobrist keys
+ * come from a fixed seed, so every build hashes boards the same way.
+ */
+
+#include <stdio.h>
+
+#include "tetris.h"
+
+static int cell_bit(int x)
+{
+    int bit = x + BOARD_WALL_BITS;
+    if (bit < 0) /* clip to the walls */
+        return 0;
+    if (bit >= (int) (sizeof(row_t) * 8))
+        return sizeof(row_t) * 8 - 1;
+    return bit;
+}
+
+static void emit_shape(const struct position *p)
+{
+    int min_x = 3, max_x = 0, min_y = 3, max_y = 0;
+    int bottom[4] = {-1, -1, -1, -1}, top[4] = {-1, -1, -1, -1};
+
+    for (int i = 0; i < ARRAY_SIZE(p->pos); i++) {
+        int x = p->pos[i].x, y = p->pos[i].y;
+        if (x < min_x)
+            min_x = x;
+        if (x > max_x)
+            max_x = x;
+        if (y < min_y)
+            min_y = y;
+        if (y > max_y)
+            max_y = y;
+        if (y > bottom[x])
+            bottom[x] = y;
+        if (top[x] < 0 || y < top[x])
+            top[x] = y;
+    }
+
+    printf("{%d, %d, %d, %d, {%d, %d, %d, %d}, {%d, %d, %d, %d}},\n", min_x,
+           max_x, min_y, max_y, bottom[0], bottom[1], bottom[2], bottom[3],
+           top[0], top[1], top[2], top[3]);
+}
+
+static void emit_rows(const struct position *p, int origin_x)
+{
+    unsigned rows[4] = {0};
+
+    for (int i = 0; i < ARRAY_SIZE(p->pos); i++)
+        rows[p->pos[i].y] |= 1U << cell_bit(origin_x + p->pos[i].x);
+
+    printf("{0x%04x, 0x%04x, 0x%04x, 0x%04x},\n", rows[0], rows[1], rows[2],
+           rows[3]);
+}
+
+/* splitmix64, as used to seed the piece generator */
+static uint64_t next_key(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void emit_zobrist(void)
+{
+    uint64_t state = 0x7e7715, cells[GAME_BOARD_WIDTH];
+
+    printf("const uint64_t zobrist_rows[GAME_BOARD_HEIGHT][2]"
+           "[1 << ZOBRIST_HALF] = {\n");
+    for (int y = 0; y < GAME_BOARD_HEIGHT; y++) {
+        for (int x = 0; x < GAME_BOARD_WIDTH; x++)
+            cells[x] = next_key(&state);
+        printf("{\n");
+        for (int half = 0; half < 2; half++) {
+            printf("{");
+            for (unsigned m = 0; m < 1U << ZOBRIST_HALF; m++) {
+                uint64_t key = 0;
+                for (int b = 0; b < ZOBRIST_HALF; b++) {
+                    int x = half * ZOBRIST_HALF + b;
+                    if ((m & (1U << b)) && x < GAME_BOARD_WIDTH)
+                        key ^= cells[x];
+                }
+                printf("%s0x%016llxULL,", m % 4 ? " " : "\n",
+                       (unsigned long long) key);
+            }
+            printf("\n},\n");
+        }
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("const uint64_t zobrist_pieces[TETRIS_PREVIEW_MAX + 1]"
+           "[TOTAL_BLOCKS][TOTAL_DEGREES] = {\n");
+    for (int i = 0; i <= TETRIS_PREVIEW_MAX; i++) {
+        printf("{\n");
+        for (int b = 0; b < TOTAL_BLOCKS; b++) {
+            printf("{");
+            for (int d = 0; d < TOTAL_DEGREES; d++)
+                printf("0x%016llxULL,%s", (unsigned long long) next_key(&state),
+                       d < TOTAL_DEGREES - 1 ? " " : "");
+            printf("},\n");
+        }
+        printf("},\n");
+    }
+    printf("};\n");
+}
+
+int main(void)
+{
+    printf("/* generated by gen-blocks, do not edit */\n\n");
+    printf("#include \"tetris.h\"\n\n");
+
+    printf("const struct block_shape "
+           "block_shapes[TOTAL_BLOCKS][TOTAL_DEGREES] = {\n");
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        printf("{\n");
+        for (int d = 0; d < TOTAL_DEGREES; d++)
+            emit_shape(&positions[b][d]);
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    printf("const row_t "
+           "block_rows[TOTAL_BLOCKS][TOTAL_DEGREES][BLOCK_X_SPAN][4] = {\n");
+    for (int b = 0; b < TOTAL_BLOCKS; b++) {
+        printf("{\n");
+        for (int d = 0; d < TOTAL_DEGREES; d++) {
+            printf("{\n");
+            for (int x = BLOCK_X_MIN; x <= BLOCK_X_MAX; x++)
+                emit_rows(&positions[b][d], x);
+            printf("},\n");
+        }
+        printf("},\n");
+    }
+    printf("};\n\n");
+
+    emit_zobrist();
+    return 0;
+}
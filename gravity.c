@@ -0,0 +1,136 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE /* ppoll */
+
+#include <poll.h>
+#include <time.h>
+
+#include "gravity.h"
+
+/* how far behind the schedule may fall before it starts over from now */
+#define GRAVITY_MAX_LAG 50000000ULL /* ns */
+
+static struct gravity_stats stats;
+
+uint64_t gravity_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t gravity_period(const struct tetris_game *game)
+{
+    if (game->timeout > 0 && game->score.level < DIFFICULTY_LEVEL_MAX)
+        return game->timeout * 1000000ULL;
+
+    /* the engine's schedule, up to the last level it keeps above zero */
+    int timeout = INITIAL_TIMEOUT - TIMEOUT_DELTA(1), level = 1;
+    while (level < game->score.level && level < DIFFICULTY_LEVEL_MAX &&
+           timeout > TIMEOUT_DELTA(level))
+        timeout -= TIMEOUT_DELTA(level++);
+
+    uint64_t period = timeout * 1000000ULL;
+    for (; level < game->score.level && period > GRAVITY_MIN_PERIOD; level++)
+        period -= period / 5;
+    return period > GRAVITY_MIN_PERIOD ? period : GRAVITY_MIN_PERIOD;
+}
+
+void gravity_start(struct gravity *gravity,
+                   const struct tetris_game *game,
+                   int lock_delay_ms)
+{
+    gravity->lock_delay = lock_delay_ms > 0 ? lock_delay_ms * 1000000ULL : 0;
+    gravity_reset(gravity, game);
+}
+
+void gravity_woke(struct gravity *gravity)
+{
+    uint64_t now = gravity_clock();
+    uint64_t late = now > gravity->deadline ? now - gravity->deadline : 0;
+    gravity->late = late;
+
+    int bucket = 0;
+    for (uint64_t us = late / 1000; us && bucket < GRAVITY_JITTER_BUCKETS - 1;
+         us >>= 1)
+        bucket++;
+    stats.jitter[bucket]++;
+    if (late > stats.max_jitter_ns)
+        stats.max_jitter_ns = late;
+    stats.ticks++;
+}
+
+bool gravity_sleep(uint64_t time, int fd)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+
+    /* ppoll() only takes a relative timeout, so ask again after a signal */
+    for (uint64_t now; (now = gravity_clock()) < time;) {
+        uint64_t left = time - now;
+        struct timespec ts = {.tv_sec = left / 1000000000ULL,
+                              .tv_nsec = left % 1000000000ULL};
+        if (ppoll(&pfd, 1, &ts, NULL) > 0)
+            return false;
+    }
+    return true;
+}
+
+bool gravity_wait(struct gravity *gravity, int fd)
+{
+    if (!gravity_sleep(gravity->deadline, fd))
+        return false;
+    gravity_woke(gravity);
+    return true;
+}
+
+void gravity_schedule(struct gravity *gravity, const struct tetris_game *game)
+{
+    uint64_t delay = gravity_period(game);
+    gravity->resting = gravity->lock_delay > delay && tetris_block_resting(game);
+    if (gravity->resting)
+        delay = gravity->lock_delay;
+
+    gravity->deadline += delay;
+    if (gravity_clock() > gravity->deadline + GRAVITY_MAX_LAG) {
+        gravity_reset(gravity, game);
+        stats.resyncs++;
+    }
+}
+
+void gravity_moved(struct gravity *gravity, const struct tetris_game *game)
+{
+    uint64_t period = gravity_period(game);
+    if (gravity->lock_delay <= period)
+        return;
+
+    bool resting = tetris_block_resting(game);
+    if (resting == gravity->resting)
+        return;
+    uint64_t now = gravity_clock();
+    if (resting && gravity->deadline < now + gravity->lock_delay)
+        gravity->deadline = now + gravity->lock_delay;
+    else if (!resting && gravity->deadline > now + period)
+        gravity->deadline = now + period;
+    gravity->resting = resting;
+}
+
+void gravity_reset(struct gravity *gravity, const struct tetris_game *game)
+{
+    gravity->deadline = gravity_clock() + gravity_period(game);
+    gravity->resting = false;
+}
+
+void gravity_hold(struct gravity *gravity, uint64_t time)
+{
+    if (gravity->deadline < time)
+        gravity->deadline = time;
+}
+
+void get_gravity_stats(struct gravity_stats *out)
+{
+    *out = stats;
+}
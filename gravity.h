@@ -0,0 +1,89 @@
+#ifndef __GRAVITY_H__
+#define __GRAVITY_H__
+
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* The clock of the interactive game. Gravity ticks fall on absolute
+ * deadlines of CLOCK_MONOTONIC, each one period after the previous deadline
+ * rather than after the previous tick was done, so the time taken to tick
+ * and draw does not slow the game down. A block coming to rest can be given
+ * a lock delay, by holding back the tick that would lock it.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tetris.h"
+
+#define GRAVITY_MIN_PERIOD 100000ULL /* ns */
+
+/* lateness of the ticks: bucket 0 counts those under 1 us, bucket i those
+ * in [2^(i-1), 2^i) us, and the last one everything beyond
+ */
+#define GRAVITY_JITTER_BUCKETS 20
+
+struct gravity_stats {
+    unsigned long long ticks;
+    unsigned long long resyncs; /* times the schedule fell too far behind */
+    unsigned long long jitter[GRAVITY_JITTER_BUCKETS];
+    unsigned long long max_jitter_ns;
+};
+
+struct gravity {
+    uint64_t deadline;   /* of the next tick, in ns of CLOCK_MONOTONIC */
+    uint64_t lock_delay; /* in ns, 0 for none */
+    uint64_t late;       /* how late the last tick woke up, in ns */
+    bool resting;        /* the deadline is that of a lock delay */
+};
+
+uint64_t gravity_clock(void);
+
+/* The gravity period of a game, in ns: the timeout of the engine as long as
+ * its rule keeps it above zero, 13 ms at level 20, then a fifth less each
+ * level, down to GRAVITY_MIN_PERIOD.
+ */
+uint64_t gravity_period(const struct tetris_game *game);
+
+/* the first tick, one period from now */
+void gravity_start(struct gravity *gravity,
+                   const struct tetris_game *game,
+                   int lock_delay_ms);
+
+/* Sleep until the next tick is due, then account for how late it woke up,
+ * and return true. Returns false early if 'fd' turns readable first, unless
+ * it is negative. Loops waiting on a timer of their own call gravity_woke()
+ * instead.
+ */
+bool gravity_wait(struct gravity *gravity, int fd);
+void gravity_woke(struct gravity *gravity);
+
+/* gravity_wait() for anything else due at 'time' */
+bool gravity_sleep(uint64_t time, int fd);
+
+/* Schedule the tick after the one 'game' just took: one period after its
+ * deadline, or the lock delay if that is longer and the block came to rest.
+ * A schedule fallen more than 50 ms behind, after an animation or a
+ * pause, starts over from now instead of rushing to catch up.
+ */
+void gravity_schedule(struct gravity *gravity, const struct tetris_game *game);
+
+/* Schedule anew after a key moved the block of 'game': one coming to rest
+ * gets the lock delay from now, unless the tick is further away, and one
+ * moved off the floor falls again within a period.
+ */
+void gravity_moved(struct gravity *gravity, const struct tetris_game *game);
+
+/* start over from now, after the game was held */
+void gravity_reset(struct gravity *gravity, const struct tetris_game *game);
+
+/* no tick before 'time', as long as an animation holds the game */
+void gravity_hold(struct gravity *gravity, uint64_t time);
+
+/* the lateness of all ticks so far */
+void get_gravity_stats(struct gravity_stats *stats);
+
+#endif /* __GRAVITY_H__ */
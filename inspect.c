@@ -0,0 +1,151 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-inspect: describe replay files, show the position of a replay at
+ * any tick, and check replays by playing them through from the start.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getopt, clock_gettime */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+static const char *const policies[] = {
+    [PIECES_UNIFORM] = "uniform",
+    [PIECES_BAG] = "bag",
+    [PIECES_SEQUENCE] = "sequence",
+};
+
+static const char *const statuses[] = {
+    [REPLAY_OK] = "ok",
+    [REPLAY_CORRUPT] = "corrupt",
+    [REPLAY_DIVERGED] = "diverged",
+};
+
+/* the outcome of a seek or advance, with the reason of a failure */
+static const char *outcome(const struct replay *replay,
+                           replay_status_t result,
+                           char *buf,
+                           size_t size)
+{
+    if (result == REPLAY_OK || !replay_error(replay))
+        return statuses[result];
+    snprintf(buf, size, "%s (%s)", statuses[result], replay_error(replay));
+    return buf;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void print_board(const struct tetris_game *game)
+{
+    static const char cells[] = ".OITZSLJ"; /* by color, 0 for empty */
+
+    for (int i = 1; i <= GAME_BOARD_HEIGHT; i++) {
+        char line[GAME_BOARD_WIDTH + 1] = {0};
+        for (int x = 0; x < GAME_BOARD_WIDTH; x++)
+            line[x] = cells[game->color[i][x]];
+        if (game->has_block) {
+            const struct block *b = &game->current;
+            for (int k = 0; k < ARRAY_SIZE(b->position->pos); k++) {
+                int x = b->origin.x + b->position->pos[k].x;
+                int y = b->origin.y + b->position->pos[k].y;
+                if (y + 1 == i)
+                    line[x] = '@';
+            }
+        }
+        printf("  |%s|\n", line);
+    }
+}
+
+static int inspect(const char *path, bool seek, uint32_t tick, bool check)
+{
+    struct replay *replay = replay_open(path);
+    if (!replay) {
+        fprintf(stderr, "%s: not a replay\n", path);
+        return -1;
+    }
+
+    const struct replay_info *info = replay_info(replay);
+    printf("%s\n", path);
+    printf("  seed %llu, %s pieces, preview %d\n",
+           (unsigned long long) info->config.seed,
+           policies[info->config.policy], info->config.preview);
+    printf("  %u ticks, score %d, lines %d, level %d\n", info->ticks,
+           info->score.score, info->score.total_rows, info->score.level);
+    printf("  %zu bytes, %.2f per tick, %d keyframes\n", info->size,
+           info->ticks ? (double) info->size / info->ticks : 0,
+           info->keyframes);
+
+    int status = 0;
+    struct tetris_game game;
+    char buf[128];
+    if (seek) {
+        double start = now();
+        replay_status_t result = replay_seek(replay, &game, tick);
+        double elapsed = now() - start;
+        printf("  tick %u: %s in %.1f us, score %d, lines %d, level %d\n",
+               game.ticks, outcome(replay, result, buf, sizeof(buf)),
+               elapsed * 1e6, game.score.score, game.score.total_rows,
+               game.score.level);
+        print_board(&game);
+        status |= result != REPLAY_OK;
+    }
+    if (check) {
+        double start = now();
+        replay_start(replay, &game);
+        replay_status_t result = replay_advance(replay, &game, UINT32_MAX);
+        double elapsed = now() - start;
+        if (result == REPLAY_OK && !replay_ended(replay))
+            result = REPLAY_CORRUPT;
+        printf("  check: %s at tick %u, %.3f s\n",
+               outcome(replay, result, buf, sizeof(buf)), game.ticks,
+               elapsed);
+        status |= result != REPLAY_OK;
+    }
+
+    replay_close(replay);
+    return status ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    bool seek = false, check = false;
+    uint32_t tick = 0;
+    int opt, status = 0;
+
+    while ((opt = getopt(argc, argv, "t:ch")) != -1) {
+        switch (opt) {
+        case 't':
+            seek = true;
+            tick = (uint32_t) strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            check = true;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-t tick] [-c] replay-file...\n"
+                    "  -t  show the position at a tick\n"
+                    "  -c  play the replays through, checking every keyframe\n"
+                    "      and the final score\n",
+                    argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    for (int i = optind; i < argc; i++)
+        status |= inspect(argv[i], seek, tick, check);
+    return status ? 1 : 0;
+}
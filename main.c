@@ -1,11 +1,141 @@
+#define _POSIX_C_SOURCE 200809L /* getopt */
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "broadcast.h"
+#include "gravity.h"
 #include "tetris.h"
 
-int main(void)
+/* what rendering and the gravity clock did, for -v */
+static void print_stats(const struct play_options *options)
+{
+    struct ui_stats stats;
+    get_ui_stats(&stats);
+    printf("frames : %llu, %llu redrawn whole\n", stats.frames,
+           stats.full_frames);
+    if (stats.frames)
+        printf("frame  : %.1f cells, %.1f bytes, %.1f us of CPU\n",
+               (double) stats.cells / stats.frames,
+               (double) stats.bytes / stats.frames,
+               stats.cpu_ns / 1e3 / stats.frames);
+    printf("output : %llu bytes\n", stats.output_bytes);
+
+    struct input_stats input;
+    get_input_stats(&input);
+    if (input.keys)
+        printf("input  : %llu keys, waited %.1f us on average, %.1f at most\n",
+               input.keys, input.wait_ns / 1e3 / input.keys,
+               input.max_wait_ns / 1e3);
+
+    struct gravity_stats gravity;
+    get_gravity_stats(&gravity);
+    printf("ticks  : %llu, %llu resynced, at most %.1f us late\n",
+           gravity.ticks, gravity.resyncs, gravity.max_jitter_ns / 1e3);
+    for (int i = 0; i < GRAVITY_JITTER_BUCKETS; i++) {
+        if (!gravity.jitter[i])
+            continue;
+        char bound[32];
+        if (i < GRAVITY_JITTER_BUCKETS - 1)
+            snprintf(bound, sizeof(bound), "< %d us", 1 << i);
+        else
+            snprintf(bound, sizeof(bound), ">= %d us", 1 << (i - 1));
+        printf("  %-12s: %llu\n", bound, gravity.jitter[i]);
+    }
+
+    if (!options->spectate)
+        return;
+    struct broadcast_stats broadcast;
+    get_broadcast_stats(&broadcast);
+    printf("watch  : %llu frames, %llu keyframes, %.1f bytes each, "
+           "%llu dropped\n",
+           broadcast.frames, broadcast.keyframes,
+           broadcast.frames ? (double) broadcast.bytes / broadcast.frames : 0,
+           broadcast.dropped);
+    printf("         %llu spectators, %llu sent back to a keyframe, "
+           "%llu bytes written\n",
+           broadcast.subscribers, broadcast.skipped, broadcast.written);
+}
+
+int main(int argc, char *argv[])
 {
+    struct play_options options = {.config.seed = (uint64_t) time(NULL),
+                                   .beam_depth = 3,
+                                   .beam_width = 32};
+    struct tetris_config *config = &options.config;
+    struct piece *sequence = NULL;
+    bool verbose = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "abDeL:l:M:nq:r:S:s:vw:")) != -1) {
+        switch (opt) {
+        case 'a':
+            options.autoplay = true;
+            break;
+        case 'D': /* the debug HUD */
+            options.hud = true;
+            break;
+        case 'e': /* a single thread, woken by the keyboard or the timer */
+            options.event_loop = true;
+            break;
+        case 'L': /* lock delay, in ms */
+            options.lock_delay = atoi(optarg);
+            break;
+        case 'l': /* blocks of the preview the bot places */
+            options.beam_depth = atoi(optarg) + 1;
+            break;
+        case 'M': /* keep the metrics in a file */
+            options.metrics = optarg;
+            break;
+        case 'n': /* no animations, for competitive play */
+            options.no_animations = true;
+            break;
+        case 'b': /* 7-bag */
+            config->policy = PIECES_BAG;
+            break;
+        case 'q': /* fixed piece sequence */
+            config->sequence_length = tetris_load_sequence(optarg, &sequence);
+            if (config->sequence_length < 0) {
+                fprintf(stderr, "Fail to read pieces from %s\n", optarg);
+                return -1;
+            }
+            config->policy = PIECES_SEQUENCE;
+            config->sequence = sequence;
+            break;
+        case 'r': /* record the game */
+            options.record = optarg;
+            break;
+        case 'S': /* broadcast to spectators */
+            options.spectate = optarg;
+            break;
+        case 's':
+            config->seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'v': /* report the rendering cost on exit */
+            verbose = true;
+            break;
+        case 'w': /* boards the bot keeps at each level */
+            options.beam_width = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-a [-l lookahead] [-w width]] "
+                    "[-b | -q sequence-file] [-s seed] [-r replay-file] [-e] "
+                    "[-L lock-delay] [-n] [-S socket] [-M metrics-file] "
+                    "[-D] [-v]\n",
+                    argv[0]);
+            return -1;
+        }
+    }
+
+    /* the bot looks ahead through the preview */
+    if (options.beam_depth < 1)
+        options.beam_depth = 1;
+    config->preview = options.beam_depth - 1;
+
     /* register exit handler */
     if (atexit(deinit_ui)) {
         fprintf(stderr, "Fail to register exit handlers\n");
@@ -17,7 +147,13 @@ int main(void)
         return -1;
     }
 
-    if (!start_new_game())
+    if (!start_new_game(&options))
         return -1;
+    free(sequence);
+
+    if (verbose) {
+        deinit_ui(); /* back to the plain terminal */
+        print_stats(&options);
+    }
     return 0;
 }
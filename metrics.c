@@ -0,0 +1,285 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE /* eventfd */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define WRITE_INTERVAL 1000 /* ms between two rewrites of the file */
+
+struct histogram {
+    uint64_t counts[METRICS_BUCKETS];
+    uint64_t count, sum, max;
+};
+
+/* the histograms of one thread, which alone stores to them */
+struct shard {
+    struct histogram metrics[TOTAL_METRICS];
+} __attribute__((aligned(64)));
+
+static struct shard shards[METRICS_MAX_THREADS];
+static unsigned nshards; /* claimed so far, may run past the array */
+static __thread struct shard *own;
+
+static const char *const names[TOTAL_METRICS] = {
+    [METRIC_KEY_LATENCY] = "key_latency_ns",
+    [METRIC_KEY_WAIT] = "key_wait_ns",
+    [METRIC_TICK_LATE] = "tick_late_ns",
+    [METRIC_FRAME_TIME] = "frame_time_ns",
+    [METRIC_FRAME_BYTES] = "frame_bytes",
+};
+
+/* the file rewritten by the writer thread */
+static struct {
+    const char *path;
+    pthread_t thread;
+    int stop; /* eventfd */
+    uint64_t start;
+    bool running;
+} writer = {.stop = -1};
+
+static int bucket_of(uint64_t value)
+{
+    if (value >> METRICS_MAX_BITS)
+        value = (1ULL << METRICS_MAX_BITS) - 1;
+    if (value < 2 * SUB_BUCKETS)
+        return value;
+    int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BITS;
+    return shift * SUB_BUCKETS + (int) (value >> shift);
+}
+
+static uint64_t bucket_low(int bucket)
+{
+    if (bucket < 2 * SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    return (uint64_t) (bucket - shift * SUB_BUCKETS) << shift;
+}
+
+static uint64_t bucket_high(int bucket)
+{
+    return bucket_low(bucket + 1) - 1;
+}
+
+/* an increment by the only thread storing to 'p' */
+static inline void bump(uint64_t *p, uint64_t n)
+{
+    __atomic_store_n(p, *p + n, __ATOMIC_RELAXED);
+}
+
+void metrics_record(enum metric metric, uint64_t value)
+{
+    if (!own) {
+        unsigned i = __atomic_fetch_add(&nshards, 1, __ATOMIC_RELAXED);
+        if (i >= METRICS_MAX_THREADS)
+            return; /* and so for every later record of the thread */
+        own = &shards[i];
+    }
+
+    struct histogram *h = &own->metrics[metric];
+    bump(&h->counts[bucket_of(value)], 1);
+    bump(&h->sum, value);
+    if (value > h->max)
+        __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+    /* the count last: a reader loading it sees the buckets it counts */
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+static void merge(enum metric metric, struct histogram *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+        const struct histogram *h = &shards[i].metrics[metric];
+        uint64_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+        if (!count)
+            continue;
+        out->count += count;
+        out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+        if (max > out->max)
+            out->max = max;
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+            out->counts[b] += __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+    }
+}
+
+/* the value under which a fraction 'q' of the recorded ones fall */
+static uint64_t percentile(const struct histogram *h, double q)
+{
+    uint64_t rank = (uint64_t) (q * h->count), seen = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen > rank)
+            return bucket_high(b) < h->max ? bucket_high(b) : h->max;
+    }
+    return h->max;
+}
+
+static void summarize(const struct histogram *h, struct metrics_summary *s)
+{
+    *s = (struct metrics_summary){
+        .count = h->count,
+        .sum = h->sum,
+        .max = h->max,
+    };
+    if (!h->count)
+        return;
+    s->p50 = percentile(h, 0.5);
+    s->p90 = percentile(h, 0.9);
+    s->p99 = percentile(h, 0.99);
+    s->p999 = percentile(h, 0.999);
+}
+
+void metrics_summarize(enum metric metric, struct metrics_summary *summary)
+{
+    struct histogram h;
+    merge(metric, &h);
+    summarize(&h, summary);
+}
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Write all the metrics to a temporary file and put it in place: a line of
+ * counts and percentiles per metric, and one of its buckets in use, each as
+ * the lowest value of the bucket and its count.
+ */
+static void write_file(void)
+{
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", writer.path) >= (int) sizeof(tmp))
+        return;
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return;
+
+    fprintf(fp, "uptime_ms %llu\n",
+            (unsigned long long) (clock_ns() - writer.start) / 1000000);
+    for (int m = 0; m < TOTAL_METRICS; m++) {
+        static struct histogram h; /* of the writer thread only */
+        struct metrics_summary s;
+        merge(m, &h);
+        summarize(&h, &s);
+        fprintf(fp,
+                "%s count %llu sum %llu max %llu p50 %llu p90 %llu "
+                "p99 %llu p999 %llu\n",
+                names[m], s.count, s.sum, s.max, s.p50, s.p90, s.p99, s.p999);
+        fprintf(fp, "%s_buckets", names[m]);
+        for (int b = 0; b < METRICS_BUCKETS; b++)
+            if (h.counts[b])
+                fprintf(fp, " %llu:%llu", (unsigned long long) bucket_low(b),
+                        (unsigned long long) h.counts[b]);
+        fputc('\n', fp);
+    }
+
+    if (fclose(fp) || rename(tmp, writer.path))
+        unlink(tmp);
+}
+
+static void *writer_thread(void *arg)
+{
+    struct pollfd pfd = {.fd = writer.stop, .events = POLLIN};
+
+    for (;;) {
+        int n = poll(&pfd, 1, WRITE_INTERVAL);
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n > 0)
+            break;
+        write_file();
+    }
+    return arg;
+}
+
+bool metrics_start(const char *path)
+{
+    if (!path)
+        return true;
+    writer.path = path;
+    writer.start = clock_ns();
+    writer.stop = eventfd(0, EFD_CLOEXEC);
+    if (writer.stop < 0)
+        return false;
+    if (pthread_create(&writer.thread, NULL, writer_thread, NULL)) {
+        close(writer.stop);
+        writer.stop = -1;
+        return false;
+    }
+    writer.running = true;
+    return true;
+}
+
+void metrics_stop(void)
+{
+    if (!writer.running)
+        return;
+
+    uint64_t one = 1;
+    while (write(writer.stop, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+    pthread_join(writer.thread, NULL);
+    write_file();
+    close(writer.stop);
+    writer.stop = -1;
+    writer.running = false;
+}
+
+/* a time in 6 characters, 9999 ms at most */
+static void format_ns(char buf[7], unsigned long long ns)
+{
+    unsigned value = ns < 10000      ? ns
+                     : ns < 10000000 ? ns / 1000
+                     : ns < 10000000000ULL ? ns / 1000000
+                                           : 9999;
+    const char *unit = ns < 10000 ? "ns" : ns < 10000000 ? "us" : "ms";
+    snprintf(buf, 7, "%4u%s", value % 10000, unit);
+}
+
+void metrics_hud(char text[HUD_LINES][HUD_WIDTH + 1])
+{
+    static const struct {
+        const char *label;
+        enum metric metric;
+    } lines[] = {
+        {"key  ", METRIC_KEY_LATENCY},
+        {"tick ", METRIC_TICK_LATE},
+        {"frame", METRIC_FRAME_TIME},
+    };
+
+    for (int i = 0; i < HUD_LINES && i < ARRAY_SIZE(lines); i++) {
+        struct metrics_summary s;
+        char p99[7], max[7];
+        metrics_summarize(lines[i].metric, &s);
+        format_ns(p99, s.p99);
+        format_ns(max, s.max);
+        if (lines[i].metric != METRIC_FRAME_TIME) {
+            snprintf(text[i], HUD_WIDTH + 1, "%s p99 %s  max %s",
+                     lines[i].label, p99, max);
+            continue;
+        }
+        /* the size of the frames instead of the worst one */
+        struct metrics_summary bytes;
+        metrics_summarize(METRIC_FRAME_BYTES, &bytes);
+        unsigned mean = bytes.count ? bytes.sum / bytes.count : 0;
+        snprintf(text[i], HUD_WIDTH + 1, "%s p99 %s  %5u B/frame",
+                 lines[i].label, p99, mean < 99999 ? mean : 99999);
+    }
+}
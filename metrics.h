@@ -0,0 +1,69 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Runtime metrics of the interactive game: latency and size histograms, kept
+ * per thread so that recording takes no lock and allocates nothing. Each
+ * thread records into a shard of its own, claimed on its first record out of
+ * a static array; it alone stores to the shard, and readers merge the shards
+ * at any time without stopping it.
+ *
+ * The histograms are log-linear, as in HdrHistogram: values below
+ * 2 * 2^METRICS_SUB_BITS have a bucket each, and every power of two above is
+ * split into 2^METRICS_SUB_BITS buckets, so that the bounds of a bucket are
+ * within 1/16 of each other. Values from 2^METRICS_MAX_BITS on count as the
+ * largest one below.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tetris.h"
+
+#define METRICS_SUB_BITS 4
+#define METRICS_MAX_BITS 40 /* 18 minutes in ns */
+#define METRICS_BUCKETS \
+    ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+#define METRICS_MAX_THREADS 8 /* threads past these record nothing */
+
+enum metric {
+    METRIC_KEY_LATENCY, /* ns from reading a key to the frame showing it */
+    METRIC_KEY_WAIT,    /* ns a key waited for the game thread to take it */
+    METRIC_TICK_LATE,   /* ns a gravity tick came after its deadline */
+    METRIC_FRAME_TIME,  /* ns draw_game_board() took */
+    METRIC_FRAME_BYTES, /* written to the terminal by a frame */
+    TOTAL_METRICS,
+};
+
+/* from any thread, at the cost of a few stores */
+void metrics_record(enum metric metric, uint64_t value);
+
+struct metrics_summary {
+    unsigned long long count, sum, max;
+    unsigned long long p50, p90, p99, p999; /* upper bounds of the buckets */
+};
+
+/* what all threads recorded so far */
+void metrics_summarize(enum metric metric, struct metrics_summary *summary);
+
+/* Rewrite the file at 'path' every second with the counts, the percentiles
+ * and the buckets in use of every metric, from a thread of its own. Readers
+ * never see a file half written: it is replaced with rename(). NULL does
+ * nothing.
+ */
+bool metrics_start(const char *path);
+
+/* write the file one last time, and stop */
+void metrics_stop(void);
+
+/* The debug HUD: the latencies of keys, ticks and frames on HUD_LINES lines
+ * of HUD_WIDTH characters.
+ */
+void metrics_hud(char text[HUD_LINES][HUD_WIDTH + 1]);
+
+#endif /* __METRICS_H__ */
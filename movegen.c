@@ -0,0 +1,144 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#include "ai.h"
+
+#define LOCKED_SIZE ARRAY_SIZE(((struct movegen_scratch *) 0)->locked)
+
+static inline int encode(int x, int y, int o)
+{
+    return (o * GAME_BOARD_HEIGHT + y) * BLOCK_X_SPAN + (x - BLOCK_X_MIN);
+}
+
+static inline void decode(int state, int *x, int *y, int *o)
+{
+    *x = state % BLOCK_X_SPAN + BLOCK_X_MIN;
+    state /= BLOCK_X_SPAN;
+    *y = state % GAME_BOARD_HEIGHT;
+    *o = state / GAME_BOARD_HEIGHT;
+}
+
+static inline bool test_and_set(uint64_t *bits, int i)
+{
+    uint64_t bit = 1ULL << (i & 63);
+    bool set = bits[i >> 6] & bit;
+    bits[i >> 6] |= bit;
+    return set;
+}
+
+/* Record a lock footprint, returning false if it was seen before. The mask
+ * is aligned to its first occupied row, so that orientations and origins
+ * covering the same cells compare equal.
+ */
+static bool add_locked(struct movegen_scratch *s, int type, int o, int x, int y)
+{
+    int min_y = block_shapes[type][o].min_y;
+    uint64_t cells = block_mask(type, o, x) >> (16 * min_y);
+    int8_t row = y + min_y;
+
+    unsigned h = (unsigned) ((cells * 0x9e3779b97f4a7c15ULL) >> 40) ^ row;
+    for (;; h++) {
+        h %= LOCKED_SIZE;
+        if (s->locked[h].epoch != s->epoch) {
+            s->locked[h].epoch = s->epoch;
+            s->locked[h].cells = cells;
+            s->locked[h].y = row;
+            return true;
+        }
+        if (s->locked[h].cells == cells && s->locked[h].y == row)
+            return false;
+    }
+}
+
+int movegen_run(struct movegen_scratch *s,
+                const row_t *board,
+                int type,
+                int orientation,
+                int x,
+                int y,
+                bool paths,
+                struct movegen_placement *out)
+{
+    int head = 0, tail = 0, count = 0;
+
+    memset(s->visited, 0, sizeof(s->visited));
+    if (++s->epoch == 0) { /* wrapped around: forget every footprint */
+        memset(s->locked, 0, sizeof(s->locked));
+        s->epoch = 1;
+    }
+
+    if (!block_fits(board, type, orientation, x, y))
+        return 0;
+
+    int start = encode(x, y, orientation);
+    test_and_set(s->visited, start);
+    s->parent[start] = start;
+    s->action[start] = TOTAL_MOVEMENTS;
+    s->queue[tail++] = start;
+
+#define VISIT(nx, ny, no, act)                             \
+    do {                                                   \
+        int next = encode((nx), (ny), (no));               \
+        if (!test_and_set(s->visited, next)) {             \
+            s->parent[next] = state;                       \
+            s->action[next] = (act);                       \
+            s->queue[tail++] = next;                       \
+        }                                                  \
+    } while (0)
+
+    while (head < tail) {
+        int state = s->queue[head++], cx, cy, co;
+        decode(state, &cx, &cy, &co);
+
+        if (block_fits(board, type, co, cx, cy + 1)) {
+            VISIT(cx, cy + 1, co, ACTION_MOVE_DOWN);
+            if (paths) { /* a hard drop reaches the floor in one input */
+                int ny = cy + 1;
+                while (block_fits(board, type, co, cx, ny + 1))
+                    ny++;
+                if (ny > cy + 1)
+                    VISIT(cx, ny, co, ACTION_DROP);
+            }
+        } else if (count < MOVEGEN_MAX_PLACEMENTS &&
+                   add_locked(s, type, co, cx, cy)) {
+            out[count++] = (struct movegen_placement){
+                .x = cx, .y = cy, .orientation = co, .state = state};
+        }
+
+        if (block_fits(board, type, co, cx - 1, cy))
+            VISIT(cx - 1, cy, co, ACTION_MOVE_LEFT);
+        if (block_fits(board, type, co, cx + 1, cy))
+            VISIT(cx + 1, cy, co, ACTION_MOVE_RIGHT);
+
+        int no = (co + TOTAL_DEGREES - 1) % TOTAL_DEGREES;
+        if (block_fits(board, type, no, cx, cy))
+            VISIT(cx, cy, no, ACTION_ROTATE_LEFT);
+    }
+#undef VISIT
+
+    return count;
+}
+
+int movegen_path(const struct movegen_scratch *s,
+                 const struct movegen_placement *placement,
+                 action_t *path,
+                 int max)
+{
+    int length = 0;
+
+    /* count the inputs first, then fill the path from its end */
+    for (int state = placement->state; s->parent[state] != state;
+         state = s->parent[state])
+        length++;
+    if (length > max)
+        return -1;
+
+    int i = length;
+    for (int state = placement->state; s->parent[state] != state;
+         state = s->parent[state])
+        path[--i] = (action_t) s->action[state];
+    return length;
+}
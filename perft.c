@@ -0,0 +1,565 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-perft: count the placement tree of a position, as perft does for
+ * chess. From a board and a fixed sequence of pieces, every lock position
+ * the current block can reach with the moves of the engine is a node; each
+ * is locked by the engine itself, clearing its rows, and the next block of
+ * the sequence is placed in every way from there, down to the given depth.
+ * Lock positions covering the same cells count once, as the move generator
+ * reports them.
+ *
+ * The counts depend on nothing but the rules, so the reference positions
+ * below, with their known counts, check any rewrite of the board, the move
+ * code or the move generator: 'tetris-perft -c' tells which count changed.
+ * The subtrees are counted on all cores, and nodes per second measure the
+ * engine and the move generator together.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getopt, clock_gettime */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "pool.h"
+
+#define PERFT_MAX_DEPTH 10
+#define PERFT_MAX_PIECES 64
+#define JOBS_PER_WORKER 16 /* subtrees to count, so that all cores stay busy */
+
+/* what a ply of the tree holds */
+struct perft_counts {
+    unsigned long long nodes;
+    unsigned long long lines;      /* cleared by the locks of the ply */
+    unsigned long long game_overs; /* locks the next block cannot follow */
+};
+
+/* a position to count from, with its known node counts */
+struct reference {
+    const char *name;
+    const char *pieces;
+    const char *rows[GAME_BOARD_HEIGHT + 1]; /* the stack down to the floor */
+    int depth;
+    unsigned long long nodes[PERFT_MAX_DEPTH]; /* at each ply */
+};
+
+static const struct reference references[] = {
+    {"empty", "TIOLJSZ", {NULL}, 4, {42, 908, 10250, 449918}},
+    {"tuck",
+     "TSZLJ",
+     {"XXX.....XXXX", "XX...X.XXXXX", "X....X..XXX.", "XX.XXXX.XXX.",
+      NULL},
+     3,
+     {49, 1111, 25383}},
+    {"clears",
+     "IOTIL",
+     {"..........X.", "XXXXX.XXX.X.", "XXXXXXXXX.X.", "XXXXXXXXXXX.",
+      "XXXXXXXXXXX.", NULL},
+     4,
+     {21, 231, 9809, 213348}},
+    {"top-out",
+     "ZSOI",
+     {"XXXX....XXXX", "XXX......XXX", "XXXX.XX.XXXX", "XXXXX.XXXXXX",
+      "XXXXX.XXXXXX", "XXXXX.XXXXXX", "XXXXX.XXXXXX", "XXXXX.XXXXXX",
+      "XXXXX.XXXXXX", "XXXXX.XXXXXX", "XXXXX.XXXXXX", "XXXXX.XXXXXX",
+      "XXXXX.XXXXXX", "XXXXX.XXXXXX", "XXXXX.XXXXXX", "XXXXX.XXXXXX",
+      NULL},
+     4,
+     {22, 381, 2192, 25503}},
+};
+
+/* a subtree left to count */
+struct subtree {
+    struct tetris_game game;
+    int root; /* the placement at the first ply it descends from */
+};
+
+/* per-thread working memory, and the counts found by the thread */
+struct worker {
+    struct movegen_scratch gen;
+    struct movegen_placement placements[PERFT_MAX_DEPTH]
+                                       [MOVEGEN_MAX_PLACEMENTS];
+    struct perft_counts counts[PERFT_MAX_DEPTH];
+};
+
+struct perft {
+    struct worker *workers;
+    struct subtree *subtrees;
+    unsigned long long *leaves; /* under each subtree, at the last ply */
+    int ply, depth;             /* of the subtrees, and of the tree */
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const char letters[TOTAL_BLOCKS] = {
+    [BLOCK_SQUARE] = 'O', [BLOCK_LINE] = 'I',  [BLOCK_TEE] = 'T',
+    [BLOCK_ZEE_1] = 'Z',  [BLOCK_ZEE_2] = 'S', [BLOCK_ELL_1] = 'L',
+    [BLOCK_ELL_2] = 'J',
+};
+
+/* Pieces written as in the files of tetris_load_sequence(), such as "TIO2".
+ * Returns how many were read, or -1 if the text is not a sequence.
+ */
+static int parse_pieces(const char *text, struct piece *out, int max)
+{
+    int count = 0;
+
+    for (; *text; text++) {
+        if (*text >= '0' && *text < '0' + TOTAL_DEGREES && count) {
+            out[count - 1].orientation = *text - '0';
+            continue;
+        }
+        const char *type = memchr(letters, toupper(*text), sizeof(letters));
+        if (!type || count == max)
+            return -1;
+        out[count++] = (struct piece){.type = type - letters};
+    }
+    return count ? count : -1;
+}
+
+/* Fill the board from its rows, the last one on the floor; '.' or ' ' is an
+ * empty cell and anything else a filled one.
+ */
+static bool set_board(struct tetris_game *game, const char *const *rows, int n)
+{
+    if (n > GAME_BOARD_HEIGHT)
+        return false;
+    for (int r = 0; r < n; r++) {
+        int y = GAME_BOARD_HEIGHT - n + 1 + r;
+        if (strlen(rows[r]) > GAME_BOARD_WIDTH)
+            return false;
+        for (int x = 0; rows[r][x]; x++) {
+            if (rows[r][x] == '.' || rows[r][x] == ' ')
+                continue;
+            game->board[y] |= BOARD_CELL(x);
+            game->color[y][x] = 1;
+        }
+    }
+    tetris_sync_board(game);
+    return true;
+}
+
+/* a board file: one line per row, as set_board() reads them */
+static bool load_board(struct tetris_game *game, const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    char lines[GAME_BOARD_HEIGHT + 1][GAME_BOARD_WIDTH + 2];
+    const char *rows[GAME_BOARD_HEIGHT + 1];
+    int n = 0;
+    while (n <= GAME_BOARD_HEIGHT && fgets(lines[n], sizeof(lines[n]), fp)) {
+        size_t len = strcspn(lines[n], "\r\n");
+        if (!lines[n][len] && !feof(fp)) { /* longer than the board */
+            n = GAME_BOARD_HEIGHT + 1;
+            break;
+        }
+        lines[n][len] = '\0';
+        rows[n] = lines[n];
+        n++;
+    }
+    fclose(fp);
+    return set_board(game, rows, n);
+}
+
+/* Lock 'game' with its block moved to 'p' into 'child', and let the next
+ * block enter. Returns whether the game goes on.
+ */
+static bool lock(struct tetris_game *child,
+                 const struct tetris_game *game,
+                 const struct movegen_placement *p,
+                 struct perft_counts *counts)
+{
+    *child = *game;
+    child->current.origin = (struct point){p->x, p->y};
+    child->current.orientation = p->orientation;
+    child->current.position = &positions[child->current.type][p->orientation];
+
+    tetris_tick(child); /* the block rests there, so this locks it */
+    counts->nodes++;
+    counts->lines += child->cleared_count;
+    if (tetris_tick(child) & TETRIS_EVENT_GAME_OVER) {
+        counts->game_overs++;
+        return false;
+    }
+    return true;
+}
+
+static int generate(struct worker *w,
+                    const struct tetris_game *game,
+                    struct movegen_placement *out)
+{
+    const struct block *b = &game->current;
+    return movegen_run(&w->gen, game->board, b->type, b->orientation,
+                       b->origin.x, b->origin.y, false, out);
+}
+
+/* count the tree under 'game', whose block is the one of ply 'ply' */
+static void count_tree(struct worker *w,
+                       const struct tetris_game *game,
+                       int ply,
+                       int depth)
+{
+    struct movegen_placement *placements = w->placements[ply];
+    int n = generate(w, game, placements);
+
+    for (int i = 0; i < n; i++) {
+        struct tetris_game child;
+        if (lock(&child, game, &placements[i], &w->counts[ply]) &&
+            ply + 1 < depth)
+            count_tree(w, &child, ply + 1, depth);
+    }
+}
+
+static void count_job(void *arg, int job, int worker)
+{
+    struct perft *perft = arg;
+    struct worker *w = &perft->workers[worker];
+    unsigned long long before = w->counts[perft->depth - 1].nodes;
+
+    count_tree(w, &perft->subtrees[job].game, perft->ply, perft->depth);
+    perft->leaves[job] = w->counts[perft->depth - 1].nodes - before;
+}
+
+/* Split the tree into subtrees at the first ply with enough of them for
+ * every worker, counting the plies above on this thread. Returns how many,
+ * or -1 if out of memory.
+ */
+static int split(struct perft *perft,
+                 const struct tetris_game *root,
+                 int nthreads,
+                 struct movegen_placement *first,
+                 int *nfirst)
+{
+    struct worker *w = &perft->workers[0];
+    struct subtree *level = malloc(sizeof(*level));
+    int n = 1;
+
+    if (!level)
+        return -1;
+    level[0] = (struct subtree){.game = *root, .root = -1};
+    perft->ply = 0;
+    *nfirst = 0;
+
+    while (perft->ply < perft->depth - 1 && n < nthreads * JOBS_PER_WORKER) {
+        struct movegen_placement *placements = w->placements[0];
+        struct subtree *next = NULL;
+        int count = 0, capacity = 0;
+
+        for (int i = 0; i < n; i++) {
+            int np = generate(w, &level[i].game, placements);
+            if (!perft->ply) {
+                memcpy(first, placements, np * sizeof(*placements));
+                *nfirst = np;
+            }
+            if (count + np > capacity) {
+                capacity = (count + np) * 2;
+                struct subtree *p = realloc(next, capacity * sizeof(*next));
+                if (!p) {
+                    free(next);
+                    free(level);
+                    return -1;
+                }
+                next = p;
+            }
+            for (int j = 0; j < np; j++) {
+                if (lock(&next[count].game, &level[i].game, &placements[j],
+                         &w->counts[perft->ply]))
+                    next[count++].root = perft->ply ? level[i].root : j;
+            }
+        }
+        free(level);
+        level = next;
+        n = count;
+        perft->ply++;
+    }
+
+    perft->subtrees = level;
+    return n;
+}
+
+/* Count the tree of 'root' down to 'depth' into 'counts'. With 'divide',
+ * print the nodes at the last ply under each placement of the first.
+ */
+static bool perft_run(struct pool *pool,
+                      const struct tetris_game *root,
+                      int depth,
+                      bool divide,
+                      struct perft_counts *counts)
+{
+    int nthreads = pool_size(pool), nfirst;
+    struct perft perft = {.depth = depth};
+    static struct movegen_placement first[MOVEGEN_MAX_PLACEMENTS];
+
+    memset(counts, 0, depth * sizeof(*counts));
+    if (!root->has_block)
+        return true; /* the first block could not even enter */
+
+    perft.workers = calloc(nthreads, sizeof(*perft.workers));
+    int n = perft.workers ? split(&perft, root, nthreads, first, &nfirst) : -1;
+    perft.leaves = n >= 0 ? calloc(n + 1, sizeof(*perft.leaves)) : NULL;
+    if (!perft.leaves) {
+        free(perft.subtrees);
+        free(perft.workers);
+        return false;
+    }
+
+    pool_run(pool, n, count_job, &perft);
+
+    for (int i = 0; i < nthreads; i++) {
+        for (int ply = 0; ply < depth; ply++) {
+            counts[ply].nodes += perft.workers[i].counts[ply].nodes;
+            counts[ply].lines += perft.workers[i].counts[ply].lines;
+            counts[ply].game_overs += perft.workers[i].counts[ply].game_overs;
+        }
+    }
+
+    if (divide) {
+        if (!perft.ply) /* a tree of one ply, not split */
+            nfirst = generate(&perft.workers[0], root, first);
+        unsigned long long *below = calloc(nfirst + 1, sizeof(*below));
+        if (!below) {
+            free(perft.leaves);
+            free(perft.subtrees);
+            free(perft.workers);
+            return false;
+        }
+        if (perft.ply) {
+            for (int i = 0; i < n; i++)
+                below[perft.subtrees[i].root] += perft.leaves[i];
+        } else {
+            for (int i = 0; i < nfirst; i++)
+                below[i] = 1;
+        }
+        for (int i = 0; i < nfirst; i++)
+            printf("%c%d x=%d y=%d: %llu\n", letters[root->current.type],
+                   first[i].orientation, first[i].x, first[i].y, below[i]);
+        free(below);
+    }
+
+    free(perft.leaves);
+    free(perft.subtrees);
+    free(perft.workers);
+    return true;
+}
+
+/* The game at the start of the tree, its first block entered. */
+static bool setup(struct tetris_game *game,
+                  const struct piece *pieces,
+                  int npieces,
+                  const char *const *rows,
+                  int nrows,
+                  const char *board_file)
+{
+    struct tetris_config config = {
+        .policy = PIECES_SEQUENCE,
+        .sequence = pieces,
+        .sequence_length = npieces,
+    };
+
+    tetris_init(game, &config);
+    if (board_file ? !load_board(game, board_file)
+                   : !set_board(game, rows, nrows))
+        return false;
+    tetris_tick(game);
+    return true;
+}
+
+static int reference_rows(const struct reference *ref)
+{
+    int n = 0;
+    while (ref->rows[n])
+        n++;
+    return n;
+}
+
+/* Count every reference position and compare with its known counts. */
+static int check(struct pool *pool)
+{
+    unsigned long long total = 0;
+    double elapsed = 0;
+    int failed = 0;
+
+    for (int i = 0; i < ARRAY_SIZE(references); i++) {
+        const struct reference *ref = &references[i];
+        struct piece pieces[PERFT_MAX_PIECES];
+        struct perft_counts counts[PERFT_MAX_DEPTH];
+        struct tetris_game game;
+        int npieces = parse_pieces(ref->pieces, pieces, PERFT_MAX_PIECES);
+
+        setup(&game, pieces, npieces, ref->rows, reference_rows(ref), NULL);
+        double start = now();
+        if (!perft_run(pool, &game, ref->depth, false, counts)) {
+            fprintf(stderr, "Fail to allocate the tree\n");
+            return -1;
+        }
+        elapsed += now() - start;
+
+        int bad = -1;
+        for (int ply = 0; ply < ref->depth; ply++) {
+            total += counts[ply].nodes;
+            if (bad < 0 && counts[ply].nodes != ref->nodes[ply])
+                bad = ply;
+        }
+        if (bad < 0) {
+            printf("%-10s ok, %llu nodes at depth %d\n", ref->name,
+                   counts[ref->depth - 1].nodes, ref->depth);
+            continue;
+        }
+        printf("%-10s FAILED at ply %d: %llu nodes, expected %llu\n",
+               ref->name, bad + 1, counts[bad].nodes, ref->nodes[bad]);
+        failed++;
+    }
+
+    printf("%llu nodes in %.3f s, %.0f nodes/s on %d threads\n", total,
+           elapsed, elapsed > 0 ? total / elapsed : 0, pool_size(pool));
+    return failed ? -1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-j threads] [-r reference | [-b board-file]\n"
+            "          [-p pieces | -q sequence-file]] [-v] [depth]\n"
+            "       %s [-j threads] -c\n"
+            "  -j  worker threads, 0 for one per CPU (default 0)\n"
+            "  -r  start from a reference position:",
+            prog, prog);
+    for (int i = 0; i < ARRAY_SIZE(references); i++)
+        fprintf(stderr, " %s", references[i].name);
+    fprintf(stderr,
+            "\n"
+            "  -b  start from a board read from a file, one line per row\n"
+            "      down to the floor, '.' for an empty cell (default empty)\n"
+            "  -p  the pieces, repeated, such as TIOLJSZ (the default)\n"
+            "  -q  the pieces, read from a file\n"
+            "  -v  print the nodes at the last ply under each placement of\n"
+            "      the first block\n"
+            "  -c  count the reference positions and check the counts\n"
+            "  depth  blocks to place, up to %d (default 3, or that of the\n"
+            "         reference position)\n",
+            PERFT_MAX_DEPTH);
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = 0, depth = 0, npieces = -1, opt;
+    const struct reference *ref = NULL;
+    const char *board_file = NULL;
+    bool divide = false, check_all = false;
+    struct piece pieces[PERFT_MAX_PIECES], *sequence = pieces;
+
+    while ((opt = getopt(argc, argv, "j:r:b:p:q:vch")) != -1) {
+        switch (opt) {
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'r':
+            for (int i = 0; i < ARRAY_SIZE(references); i++)
+                if (!strcmp(optarg, references[i].name))
+                    ref = &references[i];
+            if (!ref) {
+                fprintf(stderr, "No reference position %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'b':
+            board_file = optarg;
+            break;
+        case 'p':
+            npieces = parse_pieces(optarg, pieces, PERFT_MAX_PIECES);
+            if (npieces < 0) {
+                fprintf(stderr, "Not a sequence of pieces: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'q':
+            npieces = tetris_load_sequence(optarg, &sequence);
+            if (npieces < 0) {
+                fprintf(stderr, "Fail to read pieces from %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'v':
+            divide = true;
+            break;
+        case 'c':
+            check_all = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (optind < argc)
+        depth = atoi(argv[optind++]);
+    if (optind < argc || depth < 0 || depth > PERFT_MAX_DEPTH ||
+        (ref && (board_file || npieces >= 0))) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    struct pool *pool = pool_create(nthreads);
+    if (!pool) {
+        fprintf(stderr, "Fail to start worker threads\n");
+        return -1;
+    }
+    if (check_all) {
+        int result = check(pool);
+        pool_destroy(pool);
+        return result;
+    }
+
+    struct tetris_game game;
+    if (ref) {
+        npieces = parse_pieces(ref->pieces, pieces, PERFT_MAX_PIECES);
+        if (!depth)
+            depth = ref->depth;
+    } else if (npieces < 0) {
+        npieces = parse_pieces("TIOLJSZ", pieces, PERFT_MAX_PIECES);
+    }
+    if (!depth)
+        depth = 3;
+    if (!setup(&game, sequence, npieces, ref ? ref->rows : NULL,
+               ref ? reference_rows(ref) : 0, board_file)) {
+        fprintf(stderr, "Fail to read the board from %s\n", board_file);
+        return -1;
+    }
+
+    struct perft_counts counts[PERFT_MAX_DEPTH];
+    double start = now();
+    if (!perft_run(pool, &game, depth, divide, counts)) {
+        fprintf(stderr, "Fail to allocate the tree\n");
+        return -1;
+    }
+    double elapsed = now() - start;
+
+    unsigned long long total = 0;
+    printf("ply %14s %14s %14s\n", "nodes", "lines", "game overs");
+    for (int ply = 0; ply < depth; ply++) {
+        printf("%3d %14llu %14llu %14llu\n", ply + 1, counts[ply].nodes,
+               counts[ply].lines, counts[ply].game_overs);
+        total += counts[ply].nodes;
+    }
+    printf("%llu nodes in %.3f s, %.0f nodes/s on %d threads\n", total,
+           elapsed, elapsed > 0 ? total / elapsed : 0, pool_size(pool));
+
+    pool_destroy(pool);
+    if (sequence != pieces)
+        free(sequence);
+    return 0;
+}
@@ -0,0 +1,644 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE /* epoll, eventfd, timerfd */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "broadcast.h"
+#include "gravity.h"
+#include "metrics.h"
+#include "pool.h"
+#include "replay.h"
+#include "tetris.h"
+
+#define INPUT_QUEUE_SIZE 256 /* a power of two */
+
+/* a key, stamped with the time it was read */
+struct input_event {
+    input_t input;
+    uint64_t time; /* ns of CLOCK_MONOTONIC */
+};
+
+/* Lock-free queue of keys from the input thread, its only producer, to the
+ * game thread, its only consumer. Each side owns one of the indices, which
+ * only grow, and publishes it with a release store; the eventfd wakes the
+ * game thread up.
+ */
+struct input_queue {
+    struct input_event events[INPUT_QUEUE_SIZE];
+    unsigned head; /* next to read, advanced by the consumer */
+    unsigned tail; /* next to write, advanced by the producer */
+    int wakeup;
+};
+
+#define CLEAR_DELAY 300000000ULL  /* ns before the cleared rows start to go */
+#define CLEAR_STEP 30000000ULL    /* ns between two frames wiping them out */
+#define BANNER_TIME 1500000000ULL /* ns the level banner stays up */
+#define HUD_PERIOD 250000000ULL   /* ns between two updates of the HUD */
+
+/* How the game is drawn. With 'batch' set, render_events() only notes that
+ * the board changed, to be drawn once when the batch of keys is applied.
+ * Animations are timed effects, played frame by frame by the thread running
+ * the game in between ticks and keys, see render_due(); the cleared rows
+ * hold the board, and the next block, until they are gone. Spectators get
+ * every frame, without the animations. Every frame is measured, see
+ * draw_frame().
+ */
+struct render {
+    bool batch, dirty;
+    bool animate; /* false to skip the animations */
+    struct broadcast *broadcast; /* to the spectators, or NULL */
+
+    uint64_t key_time; /* when the oldest key not drawn yet was read, or 0 */
+    bool hud;          /* show the metrics, updated by HUD_PERIOD */
+    uint64_t hud_due;
+
+    /* the rows of the last clear, being wiped out */
+    bool clearing, from_ends;
+    int rows[4], count, steps;
+    uint64_t clear_start;
+
+    int banner, next_banner; /* levels shown, and to show after the clear */
+    uint64_t banner_end;
+};
+
+struct thread_data {
+    struct tetris_game *game;
+    const struct play_options *options;
+    struct render *render;
+    struct input_queue queue;
+    int resume; /* eventfd the game thread signals when the dialog is done */
+    bool done;  /* set by the game thread when the game is over */
+    pthread_t thread_id;
+};
+
+static struct input_stats input_stats;
+
+static void input_push(struct input_queue *queue, input_t input)
+{
+    unsigned tail = queue->tail;
+
+    /* never drop a key: wait for the game thread to make room */
+    while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) ==
+           INPUT_QUEUE_SIZE)
+        snooze(1);
+    queue->events[tail & (INPUT_QUEUE_SIZE - 1)] =
+        (struct input_event){.input = input, .time = gravity_clock()};
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    while (write(queue->wakeup, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static bool input_pop(struct input_queue *queue, struct input_event *event)
+{
+    unsigned head = queue->head;
+
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+        return false;
+    *event = queue->events[head & (INPUT_QUEUE_SIZE - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void get_input_stats(struct input_stats *stats)
+{
+    *stats = input_stats;
+}
+
+/* Draw the board, and record how long it took, how many bytes it wrote and
+ * how long ago the keys it shows were read. The HUD is refreshed after, so
+ * that none of it counts.
+ */
+static void draw_frame(struct render *render, const struct tetris_game *game)
+{
+    struct ui_stats before, after;
+    uint64_t start = gravity_clock();
+
+    get_ui_stats(&before);
+    draw_game_board(game);
+    get_ui_stats(&after);
+
+    uint64_t end = gravity_clock();
+    metrics_record(METRIC_FRAME_TIME, end - start);
+    metrics_record(METRIC_FRAME_BYTES, after.bytes - before.bytes);
+    if (render->key_time) {
+        metrics_record(METRIC_KEY_LATENCY, end - render->key_time);
+        render->key_time = 0;
+    }
+
+    if (render->hud && end >= render->hud_due) {
+        char text[HUD_LINES][HUD_WIDTH + 1];
+        metrics_hud(text);
+        draw_debug_hud(text);
+        render->hud_due = end + HUD_PERIOD;
+    }
+}
+
+/* the keys of a batch read at 'time' are waiting to be drawn */
+static void note_key(struct render *render, uint64_t time)
+{
+    if (!render->key_time)
+        render->key_time = time;
+}
+
+/* observer drawing the game on screen as the engine reports events */
+static void render_events(void *opaque,
+                          const struct tetris_game *game,
+                          unsigned events)
+{
+    struct render *render = opaque;
+
+    if (events & TETRIS_EVENT_NEW_BLOCK) {
+        struct piece next = tetris_preview(game, 0);
+        draw_next_block(next.type, next.orientation);
+    }
+
+    if (events & TETRIS_EVENT_LINES_CLEARED) {
+        draw_score_board(&game->score);
+
+        /* wipe the rows out, then show the new level */
+        if (render->animate) {
+            memcpy(render->rows, game->cleared_rows, sizeof(render->rows));
+            render->count = game->cleared_count;
+            render->from_ends = !render->from_ends;
+            render->steps = 0;
+            render->clear_start = gravity_clock();
+            render->clearing = true;
+            if (events & TETRIS_EVENT_LEVEL_UP)
+                render->next_banner = game->score.level;
+        }
+    }
+
+    if (!render->batch)
+        broadcast_frame(render->broadcast, game);
+    if (events & TETRIS_EVENT_GAME_OVER)
+        return;
+    if (render->batch || render->clearing)
+        render->dirty = true;
+    else
+        draw_frame(render, game);
+}
+
+static uint64_t clear_end(const struct render *render)
+{
+    return render->clear_start + CLEAR_DELAY + CLEARED_ROWS_STEPS * CLEAR_STEP;
+}
+
+/* when the next frame of the animations is due, UINT64_MAX for never */
+static uint64_t render_due(const struct render *render)
+{
+    if (render->clearing)
+        return render->clear_start + CLEAR_DELAY + render->steps * CLEAR_STEP;
+    return render->banner ? render->banner_end : UINT64_MAX;
+}
+
+static void start_banner(struct render *render, int level)
+{
+    render->banner = level;
+    render->banner_end = gravity_clock() + BANNER_TIME;
+    show_level_banner(level);
+}
+
+/* Play the frames of the animations that are due, or with 'finish' set, end
+ * them at once.
+ */
+static void render_effects(struct render *render,
+                           const struct tetris_game *game,
+                           bool finish)
+{
+    uint64_t now = gravity_clock();
+    bool ended = false;
+
+    if (render->clearing && (finish || now >= render_due(render))) {
+        int steps = CLEARED_ROWS_STEPS;
+        if (!finish && now < clear_end(render))
+            steps = (now - render->clear_start - CLEAR_DELAY) / CLEAR_STEP + 1;
+        if (steps > render->steps)
+            draw_cleared_rows(render->rows, render->count, steps,
+                              render->from_ends);
+        render->steps = steps;
+        if (finish || now >= clear_end(render)) {
+            render->clearing = false;
+            ended = true;
+            if (render->next_banner && !finish)
+                start_banner(render, render->next_banner);
+            render->next_banner = 0;
+        }
+    }
+
+    if (render->banner && (finish || now >= render->banner_end)) {
+        render->banner = 0;
+        show_level_banner(0);
+        ended = true;
+    }
+
+    if (ended && !game->game_over) {
+        draw_frame(render, game);
+        render->dirty = false;
+    }
+}
+
+/* draw the board once, if the batch of keys changed it */
+static void render_batch(struct render *render, const struct tetris_game *game)
+{
+    render->batch = false;
+    broadcast_frame(render->broadcast, game);
+    if (render->dirty && !game->game_over)
+        draw_frame(render, game);
+    else
+        render->key_time = 0; /* the keys changed nothing to draw */
+    render->dirty = false;
+}
+
+/* apply a key to a game still going */
+static void handle_input(struct tetris_game *game,
+                         const struct play_options *options,
+                         input_t input)
+{
+    /* the bot is in control of the block */
+    if (options->autoplay && input != INPUT_PAUSE_QUIT)
+        return;
+
+    switch (input) {
+        bool status;
+    case INPUT_MOVE_LEFT:
+        tetris_step(game, ACTION_MOVE_LEFT);
+        break;
+    case INPUT_MOVE_RIGHT:
+        tetris_step(game, ACTION_MOVE_RIGHT);
+        break;
+    case INPUT_DROP:
+        tetris_step(game, ACTION_DROP);
+        break;
+    case INPUT_ROTATE_LEFT:
+        tetris_step(game, ACTION_ROTATE_LEFT);
+        break;
+    case INPUT_PAUSE_QUIT:
+        status = show_quit_dialog();
+        draw_game_board(game);
+        if (!status) /* if the user chooses to quit */
+            game->game_over = true;
+        break;
+    case INPUT_TIMEOUT: /* nothing to do */
+    default:
+        break;
+    }
+}
+
+/* The input thread: read the keyboard and queue the keys for the game
+ * thread, which owns the game and alone draws it. While the game thread runs
+ * the quit dialog, which reads the keyboard itself, this one waits.
+ */
+static void main_loop(struct thread_data *data)
+{
+    while (!__atomic_load_n(&data->done, __ATOMIC_ACQUIRE)) {
+        input_t input = get_user_input();
+        if (input == INPUT_INVALID || input == INPUT_TIMEOUT)
+            continue;
+
+        input_push(&data->queue, input);
+        if (input == INPUT_PAUSE_QUIT) {
+            uint64_t count;
+            while (read(data->resume, &count, sizeof(count)) < 0 &&
+                   errno == EINTR)
+                ;
+        }
+    }
+}
+
+static void signal_resume(struct thread_data *data)
+{
+    uint64_t one = 1;
+    while (write(data->resume, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+/* apply all the queued keys in order, then draw the board once */
+static void drain_input(struct thread_data *data, struct gravity *gravity)
+{
+    struct tetris_game *game = data->game;
+    struct input_event event;
+    uint64_t count;
+
+    /* consume the wakeup first, so that a key pushed meanwhile sets it anew */
+    if (read(data->queue.wakeup, &count, sizeof(count)) < 0)
+        count = 0;
+
+    data->render->batch = true;
+    while (!game->game_over && input_pop(&data->queue, &event)) {
+        uint64_t wait = gravity_clock() - event.time;
+        input_stats.keys++;
+        input_stats.wait_ns += wait;
+        if (wait > input_stats.max_wait_ns)
+            input_stats.max_wait_ns = wait;
+        metrics_record(METRIC_KEY_WAIT, wait);
+
+        if (event.input == INPUT_PAUSE_QUIT)
+            render_effects(data->render, game, true);
+        else
+            note_key(data->render, event.time);
+        handle_input(game, data->options, event.input);
+        if (event.input == INPUT_PAUSE_QUIT) {
+            gravity_reset(gravity, game);
+            signal_resume(data);
+        } else {
+            gravity_moved(gravity, game);
+        }
+    }
+    render_batch(data->render, game);
+}
+
+/* the bot of autoplay, NULL beam for the greedy search */
+struct bot {
+    struct pool *pool;
+    struct ai_beam *beam;
+};
+
+static void bot_init(struct bot *bot, const struct play_options *options)
+{
+    struct ai_beam_options beam_options = {
+        .depth = options->beam_depth,
+        .width = options->beam_width,
+        .reachability = true,
+    };
+
+    bot->pool = pool_create(0);
+    bot->beam = bot->pool ? ai_beam_create(bot->pool, &beam_options) : NULL;
+}
+
+static void bot_destroy(struct bot *bot)
+{
+    ai_beam_destroy(bot->beam);
+    pool_destroy(bot->pool);
+}
+
+/* a move for the block of 'position', found within half a gravity period */
+static bool bot_decide(struct bot *bot,
+                       const struct tetris_game *position,
+                       struct ai_move *move)
+{
+    if (bot->beam) {
+        ai_beam_set_budget(bot->beam, gravity_period(position) / 2000);
+        return ai_beam_move(bot->beam, position, move);
+    }
+    struct ai_options options = {.lookahead = 1};
+    return ai_best_move(position, &options, move);
+}
+
+/* The game thread: the gravity ticks and the keys queued by the input
+ * thread, which wake it up between two ticks. It alone touches the game, so
+ * there is no lock.
+ */
+static void *worker_thread(void *arg)
+{
+    struct thread_data *data = (struct thread_data *) arg;
+    struct tetris_game *game = data->game;
+    struct bot bot = {NULL, NULL};
+    struct gravity gravity;
+
+    if (data->options->autoplay)
+        bot_init(&bot, data->options);
+
+    draw_score_board(&game->score);
+    gravity_start(&gravity, game, data->options->lock_delay);
+
+    /* main game loop */
+    while (!game->game_over) {
+        struct render *render = data->render;
+        if (render->clearing)
+            gravity_hold(&gravity, clear_end(render));
+
+        uint64_t frame = render_due(render);
+        if (frame <= gravity.deadline) {
+            if (gravity_sleep(frame, data->queue.wakeup))
+                render_effects(render, game, false);
+            else
+                drain_input(data, &gravity);
+            continue;
+        }
+        if (!gravity_wait(&gravity, data->queue.wakeup)) {
+            drain_input(data, &gravity);
+            continue;
+        }
+        metrics_record(METRIC_TICK_LATE, gravity.late);
+
+        unsigned events = tetris_tick(game);
+        if (events & TETRIS_EVENT_GAME_OVER)
+            break;
+        gravity_schedule(&gravity, game);
+
+        /* keys arriving while the bot thinks wait in the queue */
+        if (data->options->autoplay && (events & TETRIS_EVENT_NEW_BLOCK)) {
+            struct ai_move move;
+            if (bot_decide(&bot, game, &move)) {
+                ai_apply_move(game, &move);
+                gravity_moved(&gravity, game);
+            }
+        }
+    }
+
+    __atomic_store_n(&data->done, true, __ATOMIC_RELEASE);
+    signal_resume(data); /* in case the input thread waits for the dialog */
+    bot_destroy(&bot);
+    return arg;
+}
+
+/* the timer firing at 'time', the next tick or frame of animation */
+static bool arm_timer(int fd, uint64_t time)
+{
+    struct itimerspec spec = {
+        .it_value = {.tv_sec = time / 1000000000ULL,
+                     .tv_nsec = time % 1000000000ULL},
+    };
+    return !timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/* The game on a single thread: one epoll set waits for the keyboard and for
+ * a timerfd firing the gravity ticks. Keys are applied as soon as they
+ * arrive and nothing is shared, so there is no lock. The bot thinks right
+ * after the tick bringing a new block, with half a period to do so.
+ */
+static bool event_loop(struct tetris_game *game,
+                       const struct play_options *options,
+                       struct render *render)
+{
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN};
+    bool ok = epfd >= 0 && timerfd >= 0;
+
+    ev.data.fd = STDIN_FILENO;
+    ok = ok && !epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    ev.data.fd = timerfd;
+    ok = ok && !epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+
+    struct gravity gravity;
+    gravity_start(&gravity, game, options->lock_delay);
+
+    struct bot bot = {NULL, NULL};
+    if (ok && options->autoplay)
+        bot_init(&bot, options);
+    if (ok)
+        draw_score_board(&game->score);
+
+    while (ok && !game->game_over) {
+        if (render->clearing)
+            gravity_hold(&gravity, clear_end(render));
+        uint64_t frame = render_due(render);
+        if (!arm_timer(timerfd, frame < gravity.deadline ? frame
+                                                         : gravity.deadline)) {
+            ok = false;
+            break;
+        }
+
+        struct epoll_event events[2];
+        int n = epoll_wait(epfd, events, ARRAY_SIZE(events), -1);
+        if (n < 0 && errno != EINTR)
+            ok = false;
+
+        for (int i = 0; i < n && !game->game_over; i++) {
+            if (events[i].data.fd == STDIN_FILENO) {
+                /* the UI may have read more than one key at once */
+                input_t input;
+                render->batch = true;
+                while (!game->game_over &&
+                       (input = wait_user_input(0)) != INPUT_TIMEOUT) {
+                    if (input == INPUT_PAUSE_QUIT)
+                        render_effects(render, game, true);
+                    else
+                        note_key(render, gravity_clock());
+                    handle_input(game, options, input);
+                    /* a new period after the pause */
+                    if (input == INPUT_PAUSE_QUIT)
+                        gravity_reset(&gravity, game);
+                    else
+                        gravity_moved(&gravity, game);
+                }
+                render_batch(render, game);
+                continue;
+            }
+
+            uint64_t expired;
+            if (read(timerfd, &expired, sizeof(expired)) != sizeof(expired))
+                continue;
+            if (render_due(render) <= gravity_clock())
+                render_effects(render, game, false);
+            if (gravity.deadline > gravity_clock())
+                continue;
+
+            gravity_woke(&gravity);
+            metrics_record(METRIC_TICK_LATE, gravity.late);
+            unsigned events = tetris_tick(game);
+            if (events & TETRIS_EVENT_GAME_OVER)
+                break;
+            gravity_schedule(&gravity, game);
+            if (options->autoplay && (events & TETRIS_EVENT_NEW_BLOCK)) {
+                struct ai_move move;
+                if (bot_decide(&bot, game, &move)) {
+                    ai_apply_move(game, &move);
+                    gravity_moved(&gravity, game);
+                }
+            }
+        }
+    }
+
+    bot_destroy(&bot);
+    if (timerfd >= 0)
+        close(timerfd);
+    if (epfd >= 0)
+        close(epfd);
+    return ok;
+}
+
+bool start_new_game(const struct play_options *options)
+{
+    struct tetris_game game;
+    struct render render = {.animate = !options->no_animations,
+                            .hud = options->hud};
+    struct tetris_observer observer = {.notify = render_events,
+                                       .opaque = &render};
+    struct thread_data data = {.game = &game,
+                               .options = options,
+                               .render = &render,
+                               .queue.wakeup = -1,
+                               .resume = -1,
+                               .thread_id = 0};
+
+    tetris_init(&game, &options->config);
+    game.observer = &observer;
+
+    struct replay_writer *writer = NULL;
+    if (options->record) {
+        writer = replay_writer_create(&options->config, 0);
+        if (!writer)
+            return false;
+        game.observer = replay_writer_observer(writer, &observer);
+    }
+    if (options->spectate &&
+        !(render.broadcast = broadcast_start(options->spectate))) {
+        replay_writer_destroy(writer);
+        return false;
+    }
+    if (!metrics_start(options->metrics)) {
+        broadcast_stop(render.broadcast);
+        replay_writer_destroy(writer);
+        return false;
+    }
+    init_game_screen();
+
+    /* draw the next block and level info */
+    struct piece next = tetris_preview(&game, 0);
+    draw_next_block(next.type, next.orientation);
+    if (render.animate)
+        start_banner(&render, /* initial_level */ 1);
+    draw_frame(&render, &game);
+    broadcast_frame(render.broadcast, &game);
+
+    bool played = true;
+    if (options->event_loop) {
+        played = event_loop(&game, options, &render);
+    } else {
+        data.queue.wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        data.resume = eventfd(0, EFD_CLOEXEC);
+
+        /* create the worker thread */
+        played = data.queue.wakeup >= 0 && data.resume >= 0 &&
+                 !pthread_create(&data.thread_id, NULL, worker_thread,
+                                 (void *) &data);
+        if (played) {
+            main_loop(&data);
+            pthread_join(data.thread_id, NULL);
+        }
+        if (data.queue.wakeup >= 0)
+            close(data.queue.wakeup);
+        if (data.resume >= 0)
+            close(data.resume);
+    }
+    /* the last frame, also after quitting from the dialog */
+    broadcast_frame(render.broadcast, &game);
+    broadcast_stop(render.broadcast);
+    metrics_stop();
+    if (!played) {
+        replay_writer_destroy(writer);
+        return false;
+    }
+
+    bool saved = !writer || replay_writer_save(writer, &game, options->record);
+    replay_writer_destroy(writer);
+    return played && saved;
+}
@@ -0,0 +1,233 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* posix_memalign, sysconf */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define CACHE_LINE 64
+
+/* Chase-Lev deque over a contiguous range of job numbers. The owner takes
+ * jobs from the bottom and thieves take them from the top. No job is pushed
+ * while a batch runs, so the range [top, bottom) is the whole deque.
+ */
+struct deque {
+    long top, bottom;
+    char pad[CACHE_LINE - 2 * sizeof(long)];
+};
+
+struct worker {
+    struct pool *pool;
+    int id;
+};
+
+struct pool {
+    struct deque *deques; /* one per worker, each on its own cache line */
+    struct worker *workers;
+    pthread_t *threads;
+    int nthreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned long generation; /* bumped for every batch */
+    int running;              /* workers still busy with the batch */
+    bool shutdown;
+
+    pool_job_fn fn;
+    void *arg;
+};
+
+#define EMPTY (-1)
+#define ABORT (-2) /* lost a race against another thread, try again */
+
+static long take(struct deque *q)
+{
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+    if (t > b) { /* already empty */
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return EMPTY;
+    }
+    if (t == b) { /* the last job: race the thieves for it */
+        bool won = __atomic_compare_exchange_n(&q->top, &t, t + 1, false,
+                                               __ATOMIC_SEQ_CST,
+                                               __ATOMIC_RELAXED);
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return won ? b : EMPTY;
+    }
+    return b;
+}
+
+static long steal(struct deque *q)
+{
+    long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+    if (t >= b)
+        return EMPTY;
+    if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return ABORT;
+    return t;
+}
+
+static void run_batch(struct pool *pool, int self)
+{
+    long job;
+
+    while ((job = take(&pool->deques[self])) != EMPTY)
+        pool->fn(pool->arg, (int) job, self);
+
+    /* out of work: steal from the others until every deque is drained */
+    for (bool busy = true; busy;) {
+        busy = false;
+        for (int i = 1; i < pool->nthreads; i++) {
+            struct deque *victim = &pool->deques[(self + i) % pool->nthreads];
+            while ((job = steal(victim)) == ABORT)
+                ;
+            if (job != EMPTY) {
+                pool->fn(pool->arg, (int) job, self);
+                busy = true;
+            }
+        }
+    }
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    struct pool *pool = worker->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_batch(pool, worker->id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct pool *pool_create(int nthreads)
+{
+    if (nthreads <= 0)
+        nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    struct pool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    void *deques;
+    if (posix_memalign(&deques, CACHE_LINE, nthreads * sizeof(struct deque))) {
+        free(pool);
+        return NULL;
+    }
+    pool->deques = deques;
+    pool->workers = calloc(nthreads, sizeof(*pool->workers));
+    pool->threads = calloc(nthreads, sizeof(*pool->threads));
+    pool->nthreads = nthreads;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    if (!pool->workers || !pool->threads) {
+        pool->nthreads = 1; /* nothing to join */
+        pool_destroy(pool);
+        return NULL;
+    }
+
+    /* worker 0 is the thread calling pool_run */
+    for (int i = 0; i < nthreads; i++) {
+        pool->workers[i] = (struct worker){.pool = pool, .id = i};
+        pool->deques[i].top = pool->deques[i].bottom = 0;
+    }
+    for (int i = 1; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_thread,
+                           &pool->workers[i])) {
+            pool->nthreads = i;
+            pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    return pool;
+}
+
+void pool_destroy(struct pool *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
+
+int pool_size(const struct pool *pool)
+{
+    return pool->nthreads;
+}
+
+void pool_run(struct pool *pool, int njobs, pool_job_fn fn, void *arg)
+{
+    if (njobs <= 0)
+        return;
+
+    /* hand every worker an even slice of the jobs */
+    for (int i = 0; i < pool->nthreads; i++) {
+        pool->deques[i].top = (long) njobs * i / pool->nthreads;
+        pool->deques[i].bottom = (long) njobs * (i + 1) / pool->nthreads;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->running = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_batch(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running)
+        while (pool->running)
+            pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
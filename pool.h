@@ -0,0 +1,30 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* A fixed set of worker threads running batches of indexed jobs. Each batch
+ * is split evenly across the workers, and a worker that runs out of jobs
+ * steals from the others, so uneven job lengths still keep every core busy.
+ */
+
+struct pool;
+
+/* run job number 'job' on worker number 'worker' (0 <= worker < pool_size) */
+typedef void (*pool_job_fn)(void *arg, int job, int worker);
+
+/* nthreads <= 0 creates one worker per online CPU */
+struct pool *pool_create(int nthreads);
+void pool_destroy(struct pool *pool);
+int pool_size(const struct pool *pool);
+
+/* Run jobs [0, njobs) and return once all of them are done. The calling
+ * thread takes part as worker 0.
+ */
+void pool_run(struct pool *pool, int njobs, pool_job_fn fn, void *arg);
+
+#endif /* __POOL_H__ */
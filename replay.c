@@ -0,0 +1,709 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Replay files, integers little-endian:
+ *
+ *   header   "TTRP", version, policy, preview, 8-byte seed, then the varint
+ *            length of the piece sequence and one byte per piece
+ *   records  varint (ticks since the previous record << 3 | code), where
+ *            the code is an action_t tetris_step() takes (drop, left, right
+ *            or rotate), KEYFRAME followed by the varint length of a
+ *            snapshot of the game, or END
+ *   index    per keyframe, 4-byte tick and 4-byte offset of its record
+ *   trailer  offset of the index, keyframes, last tick, score, lines and
+ *            level, 4 bytes each, then "TTRX"
+ *
+ * Most actions follow their predecessor within the same tick or a few
+ * later, and encode in one byte. The trailer is at a fixed distance from
+ * the end of the file, so a seek reads it, bisects the index and decodes a
+ * single keyframe, whatever the length of the game.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* mmap */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "replay.h"
+
+#define HEADER_MAGIC "TTRP"
+#define TRAILER_MAGIC "TTRX"
+#define VERSION 1
+#define HEADER_SIZE 15
+#define TRAILER_SIZE 28
+#define INDEX_ENTRY_SIZE 8
+
+/* record codes beyond the actions, all below 1 << CODE_BITS */
+#define CODE_BITS 3
+enum { KEYFRAME = TOTAL_MOVEMENTS, END };
+
+#define SNAPSHOT_MAX 256 /* enough for a full board */
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    for (; v >= 0x80; v >>= 7)
+        *p++ = (uint8_t) v | 0x80;
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+/* small negative numbers as small varints */
+static uint8_t *put_signed(uint8_t *p, int v)
+{
+    return put_varint(p, ((uint32_t) v << 1) ^ (uint32_t)(v < 0 ? -1 : 0));
+}
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        *p++ = (uint8_t)(v >> (8 * i));
+    return p;
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+/* bounds-checked reader, which latches 'bad' and returns zeroes on overrun */
+struct cursor {
+    const uint8_t *p, *end;
+    bool bad;
+};
+
+static uint64_t get_varint(struct cursor *c)
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64 && c->p < c->end; shift += 7) {
+        uint8_t byte = *c->p++;
+        v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return v;
+    }
+    c->bad = true;
+    return 0;
+}
+
+static int get_signed(struct cursor *c)
+{
+    uint32_t v = (uint32_t) get_varint(c);
+    return (int) (v >> 1) ^ -(int) (v & 1);
+}
+
+static uint8_t get_byte(struct cursor *c)
+{
+    if (c->p < c->end)
+        return *c->p++;
+    c->bad = true;
+    return 0;
+}
+
+static uint8_t encode_piece(int type, int orientation)
+{
+    return (uint8_t)(type << 2 | orientation);
+}
+
+static struct piece decode_piece(struct cursor *c)
+{
+    uint8_t byte = get_byte(c);
+    if ((byte >> 2) >= TOTAL_BLOCKS)
+        c->bad = true;
+    return (struct piece){.type = byte >> 2, .orientation = byte & 3};
+}
+
+static int stack_height(const struct tetris_game *game)
+{
+    int height = 0;
+    for (int x = 0; x < GAME_BOARD_WIDTH; x++)
+        if (height < game->column_height[x])
+            height = game->column_height[x];
+    return height;
+}
+
+/* Everything tetris_init() does not derive from the configuration and
+ * tetris_sync_board() not from the cells. The board is stored as its color
+ * plane, bottom up and only as high as the stack, in 3 bits per cell.
+ */
+static size_t snapshot(const struct tetris_game *game, uint8_t *out)
+{
+    uint8_t *p = out;
+
+    p = put_varint(p, game->score.score);
+    p = put_varint(p, game->score.total_rows);
+    p = put_varint(p, game->score.rows_cleared);
+    p = put_varint(p, game->score.level);
+    p = put_signed(p, game->timeout);
+    *p++ = game->has_block | game->game_over << 1;
+    if (game->has_block) {
+        *p++ = encode_piece(game->current.type, game->current.orientation);
+        *p++ = (uint8_t)(game->current.origin.x - BLOCK_X_MIN);
+        *p++ = (uint8_t) game->current.origin.y;
+    }
+    for (int i = 0; i < game->preview_length; i++) {
+        struct piece piece = tetris_preview(game, i);
+        *p++ = encode_piece(piece.type, piece.orientation);
+    }
+    for (int i = 0; i < ARRAY_SIZE(game->rng.s); i++)
+        p = put_u32(p, game->rng.s[i]);
+    if (game->policy == PIECES_BAG) {
+        *p++ = game->bag_left;
+        for (int i = 0; i < game->bag_left; i++)
+            *p++ = game->bag[i];
+    } else if (game->policy == PIECES_SEQUENCE) {
+        p = put_varint(p, game->sequence_pos);
+    }
+
+    int height = stack_height(game);
+    uint32_t bits = 0;
+    int nbits = 0;
+    *p++ = (uint8_t) height;
+    for (int i = GAME_BOARD_HEIGHT; i > GAME_BOARD_HEIGHT - height; i--) {
+        for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+            bits |= (uint32_t) game->color[i][x] << nbits;
+            nbits += 3;
+            if (nbits >= 8) {
+                *p++ = (uint8_t) bits;
+                bits >>= 8;
+                nbits -= 8;
+            }
+        }
+    }
+    if (nbits)
+        *p++ = (uint8_t) bits;
+    return p - out;
+}
+
+/* load a snapshot into a game fresh from tetris_init() */
+static bool restore(struct tetris_game *game, struct cursor *c, uint32_t tick)
+{
+    game->score.score = (int) get_varint(c);
+    game->score.total_rows = (int) get_varint(c);
+    game->score.rows_cleared = (int) get_varint(c);
+    game->score.level = (int) get_varint(c);
+    game->timeout = get_signed(c);
+    uint8_t flags = get_byte(c);
+    game->has_block = flags & 1;
+    game->game_over = flags & 2;
+    if (game->has_block) {
+        struct piece piece = decode_piece(c);
+        game->current.type = piece.type;
+        game->current.orientation = piece.orientation;
+        game->current.origin.x = get_byte(c) + BLOCK_X_MIN;
+        game->current.origin.y = get_byte(c);
+        game->current.position = &positions[piece.type][piece.orientation];
+        if (game->current.origin.x > BLOCK_X_MAX ||
+            game->current.origin.y >= GAME_BOARD_HEIGHT)
+            return false;
+    }
+    game->preview_head = 0;
+    for (int i = 0; i < game->preview_length; i++)
+        game->preview[i] = decode_piece(c);
+    for (int i = 0; i < ARRAY_SIZE(game->rng.s); i++) {
+        uint32_t s = 0;
+        for (int k = 0; k < 4; k++)
+            s |= (uint32_t) get_byte(c) << (8 * k);
+        game->rng.s[i] = s;
+    }
+    if (game->policy == PIECES_BAG) {
+        game->bag_left = get_byte(c);
+        if (game->bag_left > TOTAL_BLOCKS)
+            return false;
+        for (int i = 0; i < game->bag_left; i++)
+            if ((game->bag[i] = get_byte(c)) >= TOTAL_BLOCKS)
+                return false;
+    } else if (game->policy == PIECES_SEQUENCE) {
+        game->sequence_pos = (int) get_varint(c);
+        if (game->sequence_pos >= game->sequence_length)
+            return false;
+    }
+
+    int height = get_byte(c);
+    uint32_t bits = 0;
+    int nbits = 0;
+    if (height > GAME_BOARD_HEIGHT)
+        return false;
+    for (int i = GAME_BOARD_HEIGHT; i > GAME_BOARD_HEIGHT - height; i--) {
+        for (int x = 0; x < GAME_BOARD_WIDTH; x++) {
+            if (nbits < 3) {
+                bits |= (uint32_t) get_byte(c) << nbits;
+                nbits += 8;
+            }
+            game->color[i][x] = bits & 7;
+            if (game->color[i][x] > TOTAL_BLOCKS)
+                return false;
+            if (game->color[i][x])
+                game->board[i] |= BOARD_CELL(x);
+            bits >>= 3;
+            nbits -= 3;
+        }
+    }
+    if (c->bad || c->p != c->end)
+        return false;
+
+    game->ticks = tick;
+    tetris_sync_board(game);
+    /* the engine takes the rest for granted, a block that fits for one */
+    return tetris_state_valid(game);
+}
+
+/* growable byte array, which stops growing once memory ran out */
+struct buffer {
+    uint8_t *data;
+    size_t length, capacity;
+    bool failed;
+};
+
+static void append(struct buffer *b, const void *data, size_t n)
+{
+    if (b->failed)
+        return;
+    if (b->length + n > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 4096;
+        while (capacity < b->length + n)
+            capacity *= 2;
+        uint8_t *p = realloc(b->data, capacity);
+        if (!p) {
+            b->failed = true;
+            return;
+        }
+        b->data = p;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->length, data, n);
+    b->length += n;
+}
+
+struct replay_writer {
+    struct tetris_observer observer;
+    const struct tetris_observer *next;
+    struct buffer records, index;
+    uint32_t last_tick;     /* of the last record */
+    uint32_t seen_tick;     /* last tick the game reported */
+    uint32_t keyframe_tick; /* of the last keyframe, 0 for the start */
+    uint32_t keyframe_ticks;
+    int keyframes;
+    bool finished;
+};
+
+static void put_record(struct replay_writer *w, uint32_t tick, int code)
+{
+    uint8_t record[16];
+    uint8_t *p = put_varint(record, (uint64_t)(tick - w->last_tick)
+                                            << CODE_BITS |
+                                        code);
+    append(&w->records, record, p - record);
+    w->last_tick = tick;
+}
+
+static void put_keyframe(struct replay_writer *w,
+                         const struct tetris_game *game)
+{
+    uint8_t entry[INDEX_ENTRY_SIZE], data[SNAPSHOT_MAX], length[8];
+    put_u32(put_u32(entry, game->ticks), (uint32_t) w->records.length);
+    append(&w->index, entry, sizeof(entry));
+
+    put_record(w, game->ticks, KEYFRAME);
+    size_t size = snapshot(game, data);
+    append(&w->records, length, put_varint(length, size) - length);
+    append(&w->records, data, size);
+    w->keyframe_tick = game->ticks;
+    w->keyframes++;
+}
+
+static void record_input(void *opaque,
+                         const struct tetris_game *game,
+                         action_t action)
+{
+    struct replay_writer *w = opaque;
+
+    put_record(w, game->ticks, action);
+    if (w->next && w->next->input)
+        w->next->input(w->next->opaque, game, action);
+}
+
+static void record_events(void *opaque,
+                          const struct tetris_game *game,
+                          unsigned events)
+{
+    struct replay_writer *w = opaque;
+
+    /* every tick reports an event; take the keyframe before its actions */
+    if (game->ticks != w->seen_tick) {
+        w->seen_tick = game->ticks;
+        if (game->ticks - w->keyframe_tick >= w->keyframe_ticks)
+            put_keyframe(w, game);
+    }
+    if (w->next && w->next->notify)
+        w->next->notify(w->next->opaque, game, events);
+}
+
+struct replay_writer *replay_writer_create(const struct tetris_config *config,
+                                           int keyframe_ticks)
+{
+    struct replay_writer *w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->observer = (struct tetris_observer){
+        .notify = record_events, .input = record_input, .opaque = w};
+    w->keyframe_ticks =
+        keyframe_ticks > 0 ? keyframe_ticks : REPLAY_KEYFRAME_TICKS;
+
+    bool sequence = config->policy == PIECES_SEQUENCE && config->sequence &&
+                    config->sequence_length > 0;
+    int preview = config->preview;
+    if (preview < 0)
+        preview = 0;
+    if (preview > TETRIS_PREVIEW_MAX)
+        preview = TETRIS_PREVIEW_MAX;
+
+    uint8_t header[HEADER_SIZE + 8], *p = header;
+    memcpy(p, HEADER_MAGIC, 4);
+    p += 4;
+    *p++ = VERSION;
+    *p++ = sequence ? PIECES_SEQUENCE
+                    : config->policy == PIECES_BAG ? PIECES_BAG
+                                                   : PIECES_UNIFORM;
+    *p++ = (uint8_t) preview;
+    p = put_u32(put_u32(p, (uint32_t) config->seed),
+                (uint32_t)(config->seed >> 32));
+    p = put_varint(p, sequence ? config->sequence_length : 0);
+    append(&w->records, header, p - header);
+    for (int i = 0; sequence && i < config->sequence_length; i++) {
+        uint8_t piece = encode_piece(config->sequence[i].type,
+                                     config->sequence[i].orientation);
+        append(&w->records, &piece, 1);
+    }
+    return w;
+}
+
+void replay_writer_destroy(struct replay_writer *writer)
+{
+    if (!writer)
+        return;
+    free(writer->records.data);
+    free(writer->index.data);
+    free(writer);
+}
+
+const struct tetris_observer *replay_writer_observer(
+    struct replay_writer *writer,
+    const struct tetris_observer *next)
+{
+    writer->next = next;
+    return &writer->observer;
+}
+
+const void *replay_writer_finish(struct replay_writer *writer,
+                                 const struct tetris_game *game,
+                                 size_t *size)
+{
+    struct replay_writer *w = writer;
+
+    if (!w->finished) {
+        w->finished = true;
+        put_record(w, game->ticks, END);
+
+        uint8_t trailer[TRAILER_SIZE], *p = trailer;
+        p = put_u32(p, (uint32_t) w->records.length);
+        p = put_u32(p, (uint32_t) w->keyframes);
+        p = put_u32(p, game->ticks);
+        p = put_u32(p, (uint32_t) game->score.score);
+        p = put_u32(p, (uint32_t) game->score.total_rows);
+        p = put_u32(p, (uint32_t) game->score.level);
+        memcpy(p, TRAILER_MAGIC, 4);
+        append(&w->records, w->index.data, w->index.length);
+        append(&w->records, trailer, sizeof(trailer));
+    }
+    if (w->records.failed || w->index.failed)
+        return NULL;
+    *size = w->records.length;
+    return w->records.data;
+}
+
+bool replay_writer_save(struct replay_writer *writer,
+                        const struct tetris_game *game,
+                        const char *path)
+{
+    size_t size;
+    const void *data = replay_writer_finish(writer, game, &size);
+    if (!data)
+        return false;
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(data, 1, size, fp) == size;
+    return fclose(fp) == 0 && ok;
+}
+
+struct replay {
+    const uint8_t *data;
+    bool mapped;
+    struct replay_info info;
+    struct piece *sequence;
+    const uint8_t *records, *index; /* the records end at the index */
+
+    /* the next record to apply, decoded up to its payload */
+    struct cursor pos;
+    uint32_t next_tick;
+    int code;
+    bool ended;
+    const char *error; /* why the last seek or advance failed */
+};
+
+static struct replay *parse(const uint8_t *data, size_t size)
+{
+    if (size < HEADER_SIZE + TRAILER_SIZE ||
+        memcmp(data, HEADER_MAGIC, 4) || data[4] != VERSION ||
+        memcmp(data + size - 4, TRAILER_MAGIC, 4))
+        return NULL;
+
+    const uint8_t *trailer = data + size - TRAILER_SIZE;
+    uint32_t index = get_u32(trailer), keyframes = get_u32(trailer + 4);
+    if (index < HEADER_SIZE || index > size - TRAILER_SIZE ||
+        (uint64_t) keyframes * INDEX_ENTRY_SIZE !=
+            size - TRAILER_SIZE - index ||
+        data[5] > PIECES_SEQUENCE || data[6] > TETRIS_PREVIEW_MAX)
+        return NULL;
+
+    struct replay *r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+    r->data = data;
+    r->index = data + index;
+    r->info = (struct replay_info){
+        .config = {.policy = data[5],
+                   .preview = data[6],
+                   .seed = get_u32(data + 7) |
+                           (uint64_t) get_u32(data + 11) << 32},
+        .ticks = get_u32(trailer + 8),
+        .score = {.score = (int) get_u32(trailer + 12),
+                  .total_rows = (int) get_u32(trailer + 16),
+                  .level = (int) get_u32(trailer + 20)},
+        .keyframes = (int) keyframes,
+        .size = size,
+    };
+
+    struct cursor c = {data + HEADER_SIZE, r->index, false};
+    uint64_t length = get_varint(&c);
+    if (length > (uint64_t)(c.end - c.p) ||
+        (r->info.config.policy == PIECES_SEQUENCE) != (length > 0))
+        goto fail;
+    if (length) {
+        r->sequence = malloc(length * sizeof(*r->sequence));
+        if (!r->sequence)
+            goto fail;
+        for (uint64_t i = 0; i < length; i++)
+            r->sequence[i] = decode_piece(&c);
+        r->info.config.sequence = r->sequence;
+        r->info.config.sequence_length = (int) length;
+    }
+    if (c.bad)
+        goto fail;
+    r->records = c.p;
+
+    /* keyframes every so many ticks from the first one, never at tick 0, in
+     * records of their own
+     */
+    uint32_t spacing = keyframes ? get_u32(r->index) : 0;
+    uint32_t last = (uint32_t)(r->records - data);
+    for (uint32_t i = 0; i < keyframes; i++) {
+        const uint8_t *entry = r->index + i * INDEX_ENTRY_SIZE;
+        uint32_t offset = get_u32(entry + 4);
+        if (!spacing || get_u32(entry) != (uint64_t) spacing * (i + 1) ||
+            offset < last || (i && offset == last) || offset >= index)
+            goto fail;
+        last = offset;
+    }
+    return r;
+
+fail:
+    free(r->sequence);
+    free(r);
+    return NULL;
+}
+
+struct replay *replay_open_memory(const void *data, size_t size)
+{
+    return parse(data, size);
+}
+
+struct replay *replay_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (!fstat(fd, &st) && st.st_size >= HEADER_SIZE + TRAILER_SIZE)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    struct replay *r = parse(data, st.st_size);
+    if (!r) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    r->mapped = true;
+    return r;
+}
+
+void replay_close(struct replay *replay)
+{
+    if (!replay)
+        return;
+    if (replay->mapped)
+        munmap((void *) replay->data, replay->info.size);
+    free(replay->sequence);
+    free(replay);
+}
+
+const struct replay_info *replay_info(const struct replay *replay)
+{
+    return &replay->info;
+}
+
+bool replay_ended(const struct replay *replay)
+{
+    return replay->ended;
+}
+
+const char *replay_error(const struct replay *replay)
+{
+    return replay->error;
+}
+
+static replay_status_t fail(struct replay *r,
+                            replay_status_t status,
+                            const char *error)
+{
+    r->error = error;
+    return status;
+}
+
+/* decode the header of the next record */
+static void next_record(struct replay *r)
+{
+    uint64_t v = get_varint(&r->pos);
+    r->next_tick += (uint32_t)(v >> CODE_BITS);
+    r->code = v & ((1 << CODE_BITS) - 1);
+}
+
+/* the payload of the keyframe record at the cursor */
+static bool keyframe_payload(struct replay *r, struct cursor *payload)
+{
+    uint64_t length = get_varint(&r->pos);
+    if (r->pos.bad || length > (uint64_t)(r->pos.end - r->pos.p))
+        return false;
+    *payload = (struct cursor){r->pos.p, r->pos.p + length, false};
+    r->pos.p += length;
+    return true;
+}
+
+replay_status_t replay_advance(struct replay *replay,
+                               struct tetris_game *game,
+                               uint32_t tick)
+{
+    struct replay *r = replay;
+
+    r->error = NULL;
+    for (;;) {
+        if (r->pos.bad || r->code > END || r->next_tick < game->ticks)
+            return fail(r, REPLAY_CORRUPT, "malformed record");
+
+        if (r->next_tick == game->ticks && r->code == END) {
+            r->ended = true;
+            if (game->ticks != r->info.ticks)
+                return fail(r, REPLAY_CORRUPT, "ends at another tick");
+            if (game->score.score != r->info.score.score ||
+                game->score.total_rows != r->info.score.total_rows ||
+                game->score.level != r->info.score.level)
+                return fail(r, REPLAY_DIVERGED, "score differs from claim");
+            return REPLAY_OK;
+        }
+        if (game->ticks >= tick)
+            return REPLAY_OK;
+
+        if (r->next_tick > game->ticks) {
+            if (game->game_over)
+                return fail(r, REPLAY_DIVERGED, "records past game over");
+            tetris_tick(game);
+            continue;
+        }
+
+        if (r->code == KEYFRAME) {
+            struct cursor payload;
+            uint8_t data[SNAPSHOT_MAX];
+            if (!keyframe_payload(r, &payload))
+                return fail(r, REPLAY_CORRUPT, "malformed keyframe");
+            size_t size = snapshot(game, data);
+            if (size != (size_t)(payload.end - payload.p) ||
+                memcmp(data, payload.p, size))
+                return fail(r, REPLAY_DIVERGED, "keyframe differs from game");
+        } else if (!tetris_step(game, (action_t) r->code)) {
+            /* only accepted actions are recorded */
+            return fail(r, REPLAY_DIVERGED, "illegal action");
+        }
+        next_record(r);
+    }
+}
+
+void replay_start(struct replay *replay, struct tetris_game *game)
+{
+    struct replay *r = replay;
+
+    tetris_init(game, &r->info.config);
+    r->ended = false;
+    r->error = NULL;
+    r->next_tick = 0;
+    r->pos = (struct cursor){r->records, r->index, false};
+    next_record(r);
+}
+
+replay_status_t replay_seek(struct replay *replay,
+                            struct tetris_game *game,
+                            uint32_t tick)
+{
+    struct replay *r = replay;
+    const uint8_t *end = r->index;
+
+    replay_start(r, game);
+
+    /* bisect the index for the last keyframe at or before the tick */
+    int lo = 0, hi = r->info.keyframes;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (get_u32(r->index + mid * INDEX_ENTRY_SIZE) <= tick)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo) {
+        const uint8_t *entry = r->index + (lo - 1) * INDEX_ENTRY_SIZE;
+        struct cursor payload;
+
+        /* parse() checked the offset and the tick */
+        r->pos = (struct cursor){r->data + get_u32(entry + 4), end, false};
+        next_record(r);
+        r->next_tick = get_u32(entry);
+        if (r->code != KEYFRAME || !keyframe_payload(r, &payload) ||
+            !restore(game, &payload, r->next_tick))
+            return fail(r, REPLAY_CORRUPT, "malformed keyframe");
+        next_record(r);
+    }
+    return replay_advance(r, game, tick);
+}
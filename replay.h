@@ -0,0 +1,114 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* Game replays. A game is fully determined by its configuration and by the
+ * actions the engine accepted, each stamped with the tick it followed, so
+ * that is all a replay stores, about a byte per action. Keyframes holding
+ * the whole state of the game are added at regular intervals and indexed
+ * at the end of the file, so a reader can jump to any tick by restoring the
+ * nearest keyframe before it and playing the few ticks after it.
+ *
+ * The position "at tick t" is the one right after the t-th call to
+ * tetris_tick(), before the actions that followed it.
+ */
+
+#include <stddef.h>
+
+#include "tetris.h"
+
+#define REPLAY_KEYFRAME_TICKS 1024 /* default spacing of the keyframes */
+
+/* Recording. The writer is attached to a game through its observer, before
+ * the first tick, and finished once the game ends.
+ */
+struct replay_writer;
+
+/* keyframe_ticks <= 0 selects REPLAY_KEYFRAME_TICKS */
+struct replay_writer *replay_writer_create(const struct tetris_config *config,
+                                           int keyframe_ticks);
+void replay_writer_destroy(struct replay_writer *writer);
+
+/* Observer recording the game, then passing every event on to 'next',
+ * which may be NULL. It lives as long as the writer.
+ */
+const struct tetris_observer *replay_writer_observer(
+    struct replay_writer *writer,
+    const struct tetris_observer *next);
+
+/* Close the replay at the current state of 'game' and return it, valid until
+ * the writer is destroyed. Returns NULL if memory ran out while recording.
+ */
+const void *replay_writer_finish(struct replay_writer *writer,
+                                 const struct tetris_game *game,
+                                 size_t *size);
+
+/* replay_writer_finish() into a file */
+bool replay_writer_save(struct replay_writer *writer,
+                        const struct tetris_game *game,
+                        const char *path);
+
+/* Playback */
+struct replay;
+
+typedef enum {
+    REPLAY_OK,
+    REPLAY_CORRUPT,  /* malformed or truncated data */
+    REPLAY_DIVERGED, /* the game disagrees with what the replay recorded */
+} replay_status_t;
+
+/* what a replay says about its game */
+struct replay_info {
+    struct tetris_config config;
+    uint32_t ticks; /* when the recording ended */
+    struct game_score score; /* at the end, as claimed by the recorder */
+    int keyframes;
+    size_t size; /* in bytes */
+};
+
+/* Map a replay file into memory, or read one from a buffer which must stay
+ * valid until the replay is closed. Both return NULL if the data is not a
+ * replay, checking its framing but not the game itself.
+ */
+struct replay *replay_open(const char *path);
+struct replay *replay_open_memory(const void *data, size_t size);
+void replay_close(struct replay *replay);
+
+const struct replay_info *replay_info(const struct replay *replay);
+
+/* Set 'game' to the start of the replay: tetris_init() with the
+ * configuration of its header, nothing taken from a keyframe. A verifier
+ * plays from here, so that every keyframe is checked against the game.
+ */
+void replay_start(struct replay *replay, struct tetris_game *game);
+
+/* Set 'game' to the position at 'tick', from the keyframe before it. Stops
+ * at the end of the replay if that comes first. This is a playback aid, not
+ * an integrity check: a restored keyframe must be one the engine could have
+ * reached, at a tick of the keyframe spacing and after tick 0, but nothing
+ * proves the game before it led there.
+ */
+replay_status_t replay_seek(struct replay *replay,
+                            struct tetris_game *game,
+                            uint32_t tick);
+
+/* Play 'game', left by the last start, seek or advance, forward to 'tick',
+ * checking every keyframe met on the way and, at the end, the claimed score.
+ * The claim comes from the same file: what the game reached is the score.
+ */
+replay_status_t replay_advance(struct replay *replay,
+                               struct tetris_game *game,
+                               uint32_t tick);
+
+/* whether the last seek or advance reached the end of the replay */
+bool replay_ended(const struct replay *replay);
+
+/* what the last failed seek or advance ran into, NULL after a success */
+const char *replay_error(const struct replay *replay);
+
+#endif /* __REPLAY_H__ */
@@ -0,0 +1,57 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* xoshiro128** by David Blackman and Sebastiano Vigna, seeded through
+ * splitmix64 so that nearby seeds still give unrelated streams.
+ */
+
+#include "tetris.h"
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+void tetris_rng_seed(struct tetris_rng *rng, uint64_t seed)
+{
+    uint64_t a = splitmix64(&seed), b = splitmix64(&seed);
+    rng->s[0] = (uint32_t) a;
+    rng->s[1] = (uint32_t)(a >> 32);
+    rng->s[2] = (uint32_t) b;
+    rng->s[3] = (uint32_t)(b >> 32);
+}
+
+uint32_t tetris_rng_next(struct tetris_rng *rng)
+{
+    uint32_t *s = rng->s;
+    uint32_t result = rotl(s[1] * 5, 7) * 9;
+    uint32_t t = s[1] << 9;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 11);
+
+    return result;
+}
+
+/* uniform in [0, bound) by multiply-shift; the bias is negligible for the
+ * small bounds used here.
+ */
+uint32_t tetris_rng_below(struct tetris_rng *rng, uint32_t bound)
+{
+    return (uint32_t)(((uint64_t) tetris_rng_next(rng) * bound) >> 32);
+}
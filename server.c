@@ -0,0 +1,921 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-server: host thousands of games in one process, for players
+ * connecting to a Unix stream socket from a terminal in raw mode, e.g.
+ *
+ *   socat -,raw,echo=0 UNIX-CONNECT:tetris.sock
+ *
+ * A few event threads, one per CPU by default, share the listening socket.
+ * Each one serves the sessions it accepted from start to end, so a session
+ * is only ever touched by one thread and nothing is locked. A thread waits
+ * in epoll for its clients and for a timerfd, armed on the earliest gravity
+ * deadline of its sessions, which it keeps in a hashed timer wheel: a slot
+ * per WHEEL_GRAIN of the monotonic clock, each a list linked through the
+ * sessions themselves, so scheduling a tick is O(1) and allocates nothing.
+ *
+ * Sessions are carved out of slabs owned by their thread and recycled
+ * through a free list. Each holds its game, the screen as its client last
+ * got it, and one output buffer of fixed size: a frame is only composed
+ * once the previous one went out, as the difference between the game and
+ * that screen, so a client reading slowly gets fewer frames, each bringing
+ * it up to date, and never costs more memory.
+ */
+
+#define _GNU_SOURCE /* accept4, epoll, eventfd, timerfd */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gravity.h"
+#include "tetris.h"
+
+#define WHEEL_SLOTS 4096      /* a power of two */
+#define WHEEL_GRAIN 250000ULL /* ns of a slot, 1.024 s for the whole wheel */
+#define SLAB_SESSIONS 64      /* sessions allocated at once */
+#define SESSION_OUTPUT 8192   /* bytes: two whole frames, at the worst */
+#define MAX_LAG 50000000ULL   /* ns behind before a schedule starts over */
+#define MAX_EVENTS 256        /* taken from epoll at once */
+
+/* UTF-8 glyphs, as in ansi.c */
+#define GLYPH_BLOCK "\xe2\x96\x88"
+#define GLYPH_HLINE "\xe2\x94\x80"
+#define GLYPH_VLINE "\xe2\x94\x82"
+#define GLYPH_ULCORNER "\xe2\x94\x8c"
+#define GLYPH_URCORNER "\xe2\x94\x90"
+#define GLYPH_LLCORNER "\xe2\x94\x94"
+#define GLYPH_LRCORNER "\xe2\x94\x98"
+
+struct session {
+    /* in a slot of the timer wheel, or in the free list */
+    struct session *next, **pprev;
+    uint64_t deadline; /* of the next tick, in ns of CLOCK_MONOTONIC */
+    bool resting;      /* the deadline is that of a lock delay */
+
+    int fd;
+    uint8_t escape; /* bytes of an arrow key read so far */
+    bool closing;   /* the game is over, close once the output is out */
+    bool writing;   /* waiting for the socket to take more output */
+    bool stale;     /* a frame is due once the output is out */
+    bool redraw_all;
+
+    struct tetris_game game;
+
+    /* the screen of the client, once the output is out */
+    bool shown[GAME_BOARD_HEIGHT][GAME_BOARD_WIDTH];
+    struct piece next_shown;
+    struct game_score score_shown;
+    int cursor_y, cursor_x; /* -1 when not known */
+
+    uint32_t out_len, out_pos; /* composed, and written so far */
+    char out[SESSION_OUTPUT];
+};
+
+struct slab {
+    struct slab *next;
+    struct session sessions[SLAB_SESSIONS];
+};
+
+/* The gravity deadlines of the sessions of a thread. Slot s holds those
+ * due in [s, s + 1) * WHEEL_GRAIN, modulo the size of the wheel; everything
+ * before 'cursor' was fired, and what is overdue waits in the slot of the
+ * cursor.
+ */
+struct wheel {
+    struct session *slots[WHEEL_SLOTS];
+    uint64_t cursor; /* absolute slot number */
+    bool changed;    /* since the timer was last armed */
+};
+
+struct server_stats {
+    unsigned long long sessions; /* served */
+    unsigned long long ticks, keys;
+    unsigned long long frames, deferred; /* sent, and put off for a client */
+    unsigned long long bytes;
+    unsigned long long jitter[GRAVITY_JITTER_BUCKETS], max_jitter_ns;
+};
+
+struct server;
+
+/* an event thread and the sessions it serves */
+struct worker {
+    struct server *server;
+    int epoll, timer;
+    uint64_t armed; /* deadline the timer is armed on, 0 for none */
+    struct wheel wheel;
+    struct slab *slabs;
+    struct session *free;
+    struct server_stats stats;
+    pthread_t thread_id;
+};
+
+struct server {
+    int listener, quit;
+    int max_sessions;
+    int sessions, peak; /* connected, shared by all threads */
+    unsigned serial;    /* of the last session, to seed its game */
+    struct tetris_config config;
+    uint64_t lock_delay; /* ns */
+    struct worker *workers;
+    int nworkers;
+};
+
+/* the tags of the fds other than clients in the epoll data */
+static char tag_listener, tag_timer, tag_quit;
+
+static int quit_fd = -1;
+
+static void stop(int sig)
+{
+    (void) sig;
+    uint64_t one = 1;
+    if (write(quit_fd, &one, sizeof(one)) < 0) {
+        /* nothing to do about it in a signal handler */
+    }
+}
+
+static void wheel_add(struct wheel *w, struct session *s)
+{
+    uint64_t slot = s->deadline / WHEEL_GRAIN;
+    if (slot < w->cursor)
+        slot = w->cursor;
+    struct session **head = &w->slots[slot & (WHEEL_SLOTS - 1)];
+
+    s->next = *head;
+    if (s->next)
+        s->next->pprev = &s->next;
+    s->pprev = head;
+    *head = s;
+    w->changed = true;
+}
+
+static void wheel_del(struct wheel *w, struct session *s)
+{
+    if (!s->pprev)
+        return;
+    *s->pprev = s->next;
+    if (s->next)
+        s->next->pprev = s->pprev;
+    s->pprev = NULL;
+    w->changed = true;
+}
+
+/* Fire the sessions due by 'now', which may schedule themselves again,
+ * but only get fired the next time.
+ */
+static void wheel_expire(struct wheel *w,
+                         uint64_t now,
+                         void (*fire)(void *, struct session *),
+                         void *arg)
+{
+    uint64_t last = now / WHEEL_GRAIN;
+
+    /* one round visits every slot, however long the wheel stood still */
+    if (last - w->cursor >= WHEEL_SLOTS)
+        w->cursor = last - WHEEL_SLOTS + 1;
+    for (;; w->cursor++) {
+        struct session **head = &w->slots[w->cursor & (WHEEL_SLOTS - 1)];
+        struct session *list = *head;
+        *head = NULL;
+        while (list) {
+            struct session *s = list;
+            list = s->next;
+            s->pprev = NULL;
+            if (s->deadline <= now)
+                fire(arg, s);
+            else
+                wheel_add(w, s); /* a later round, or later in this slot */
+        }
+        if (w->cursor >= last)
+            break;
+    }
+    w->changed = true;
+}
+
+/* The earliest deadline in the wheel, or UINT64_MAX if it is empty. Beyond
+ * a whole round it returns the end of the round, to look again then.
+ */
+static uint64_t wheel_next(const struct wheel *w)
+{
+    bool empty = true;
+
+    for (uint64_t slot = w->cursor; slot < w->cursor + WHEEL_SLOTS; slot++) {
+        uint64_t end = (slot + 1) * WHEEL_GRAIN, first = UINT64_MAX;
+        for (const struct session *s = w->slots[slot & (WHEEL_SLOTS - 1)]; s;
+             s = s->next) {
+            empty = false;
+            if (s->deadline < end && s->deadline < first)
+                first = s->deadline;
+        }
+        if (first != UINT64_MAX)
+            return first;
+    }
+    return empty ? UINT64_MAX : (w->cursor + WHEEL_SLOTS) * WHEEL_GRAIN;
+}
+
+static void arm_timer(struct worker *worker)
+{
+    if (!worker->wheel.changed)
+        return;
+    worker->wheel.changed = false;
+
+    uint64_t next = wheel_next(&worker->wheel);
+    if (next == UINT64_MAX)
+        next = 0; /* disarm */
+    if (next == worker->armed)
+        return;
+    struct itimerspec its = {
+        .it_value = {.tv_sec = next / 1000000000ULL,
+                     .tv_nsec = next % 1000000000ULL},
+    };
+    timerfd_settime(worker->timer, TFD_TIMER_ABSTIME, &its, NULL);
+    worker->armed = next;
+}
+
+/* output, dropped past the end of the buffer: the frame is then redrawn */
+static void put(struct session *s, const char *text, size_t len)
+{
+    if (s->out_len + len > sizeof(s->out)) {
+        s->redraw_all = true;
+        return;
+    }
+    memcpy(s->out + s->out_len, text, len);
+    s->out_len += len;
+}
+
+#define PUT(s, literal) put((s), (literal), sizeof(literal) - 1)
+
+static void move_to(struct session *s, int y, int x)
+{
+    char seq[24];
+    int len;
+
+    if (y == s->cursor_y && x == s->cursor_x)
+        return;
+    if (y == s->cursor_y && x > s->cursor_x)
+        len = snprintf(seq, sizeof(seq), "\033[%dC", x - s->cursor_x);
+    else
+        len = snprintf(seq, sizeof(seq), "\033[%d;%dH", y + 1, x + 1);
+    put(s, seq, len);
+    s->cursor_y = y;
+    s->cursor_x = x;
+}
+
+/* text at row y and column x of the layout of ansi.c */
+static void print_at(struct session *s, int y, int x, const char *fmt, ...)
+{
+    char text[128];
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    if (len >= (int) sizeof(text))
+        len = sizeof(text) - 1;
+    move_to(s, y, x);
+    put(s, text, len);
+    for (int i = 0; i < len; i++)
+        s->cursor_x += ((unsigned char) text[i] & 0xc0) != 0x80;
+}
+
+static void draw_box(struct session *s, int y, int x, int height, int width)
+{
+    char line[(WINDOW_MAIN_SIZE_X + 2) * 3 + 1];
+
+    for (int i = 0; i < 2; i++) {
+        strcpy(line, i ? GLYPH_LLCORNER : GLYPH_ULCORNER);
+        for (int j = 0; j < width - 2; j++)
+            strcat(line, GLYPH_HLINE);
+        strcat(line, i ? GLYPH_LRCORNER : GLYPH_URCORNER);
+        print_at(s, i ? y + height - 1 : y, x, "%s", line);
+    }
+    for (int i = 1; i < height - 1; i++) {
+        print_at(s, y + i, x, GLYPH_VLINE);
+        print_at(s, y + i, x + width - 1, GLYPH_VLINE);
+    }
+}
+
+static void draw_cell(struct session *s, int y, int x, bool filled)
+{
+    print_at(s, y, x, filled ? GLYPH_BLOCK GLYPH_BLOCK : "  ");
+}
+
+static void draw_screen(struct session *s)
+{
+    /* the alternate screen, without a cursor */
+    PUT(s, "\033[?1049h\033[?25l\033[m\033[2J");
+    s->cursor_y = s->cursor_x = -1;
+
+    print_at(s, 3, 47, "Next Block");
+    print_at(s, 14, 47, "Level        :  ");
+    print_at(s, 16, 47, "rows cleared :  ");
+    print_at(s, 17, 47, "total rows   :  ");
+    print_at(s, 18, 47, "Score        :  ");
+    draw_box(s, 4, 46, 6, 12);
+    draw_box(s, 1, 13, 22, 26);
+
+    memset(s->shown, 0, sizeof(s->shown));
+    s->next_shown.type = TOTAL_BLOCKS;
+    s->score_shown.level = -1;
+}
+
+/* Compose what changed since the last frame, unless the client has not
+ * taken that one yet.
+ */
+static void compose_frame(struct worker *worker, struct session *s)
+{
+    const struct tetris_game *game = &s->game;
+
+    if (s->out_len) {
+        if (!s->stale)
+            worker->stats.deferred++;
+        s->stale = true;
+        return;
+    }
+    s->stale = false;
+
+    if (s->redraw_all) {
+        s->redraw_all = false;
+        draw_screen(s);
+    }
+
+    bool cells[GAME_BOARD_HEIGHT][GAME_BOARD_WIDTH];
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++)
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++)
+            cells[i][j] = game->color[i + 1][j];
+    if (game->has_block) {
+        const struct block *block = &game->current;
+        for (int i = 0; i < ARRAY_SIZE(block->position->pos); i++)
+            cells[block->origin.y + block->position->pos[i].y]
+                 [block->origin.x + block->position->pos[i].x] = true;
+    }
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++)
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++)
+            if (cells[i][j] != s->shown[i][j])
+                draw_cell(s, 2 + i, 14 + (j << 1), cells[i][j]);
+    memcpy(s->shown, cells, sizeof(s->shown));
+
+    struct piece next = tetris_preview(game, 0);
+    if (next.type != s->next_shown.type ||
+        next.orientation != s->next_shown.orientation) {
+        for (int i = 0; i < 4; i++)
+            print_at(s, 5 + i, 48, "%8s", "");
+        const struct position *p = &positions[next.type][next.orientation];
+        for (int i = 0; i < ARRAY_SIZE(p->pos); i++)
+            draw_cell(s, 5 + p->pos[i].y, 48 + (p->pos[i].x << 1), true);
+        s->next_shown = next;
+    }
+
+    if (memcmp(&game->score, &s->score_shown, sizeof(game->score))) {
+        print_at(s, 14, 63, "%-8d", game->score.level);
+        print_at(s, 16, 63, "%-8d", game->score.rows_cleared);
+        print_at(s, 17, 63, "%-8d", game->score.total_rows);
+        print_at(s, 18, 63, "%-8d", game->score.score);
+        s->score_shown = game->score;
+    }
+
+    if (s->out_len)
+        worker->stats.frames++;
+}
+
+static void close_session(struct worker *worker, struct session *s)
+{
+    wheel_del(&worker->wheel, s);
+    close(s->fd);
+    s->fd = -1;
+    s->next = worker->free;
+    worker->free = s;
+    __atomic_sub_fetch(&worker->server->sessions, 1, __ATOMIC_RELAXED);
+}
+
+/* Write what the socket takes. Returns false once the session is closed. */
+static bool flush_output(struct worker *worker, struct session *s)
+{
+    while (s->out_pos < s->out_len) {
+        ssize_t n = send(s->fd, s->out + s->out_pos, s->out_len - s->out_pos,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n < 0) {
+            close_session(worker, s);
+            return false;
+        }
+        s->out_pos += n;
+        worker->stats.bytes += n;
+    }
+
+    bool done = s->out_pos == s->out_len;
+    if (done) {
+        s->out_pos = s->out_len = 0;
+        if (s->closing) {
+            close_session(worker, s);
+            return false;
+        }
+    }
+    if (done == s->writing) { /* wait for room, or stop waiting */
+        struct epoll_event ev = {
+            .events = (s->closing ? 0 : EPOLLIN) | (done ? 0 : EPOLLOUT),
+            .data.ptr = s};
+        epoll_ctl(worker->epoll, EPOLL_CTL_MOD, s->fd, &ev);
+        s->writing = !done;
+    }
+    return true;
+}
+
+/* the last frame, then the terminal as it was */
+static void end_session(struct worker *worker, struct session *s)
+{
+    wheel_del(&worker->wheel, s);
+    s->closing = true;
+    compose_frame(worker, s);
+    char line[128];
+    int len = snprintf(line, sizeof(line),
+                       "\033[m\033[?25h\033[?1049l"
+                       "Game over: score %d, %d rows, level %d\r\n",
+                       s->game.score.score, s->game.score.total_rows,
+                       s->game.score.level);
+    s->redraw_all = false;
+    put(s, line, len);
+    flush_output(worker, s);
+}
+
+static void schedule(struct worker *worker, struct session *s, uint64_t now)
+{
+    uint64_t delay = gravity_period(&s->game);
+    s->resting = worker->server->lock_delay > delay &&
+                 tetris_block_resting(&s->game);
+    if (s->resting)
+        delay = worker->server->lock_delay;
+
+    s->deadline += delay;
+    if (now > s->deadline + MAX_LAG)
+        s->deadline = now + delay;
+    wheel_add(&worker->wheel, s);
+}
+
+/* gravity_moved() for a session, whose deadline is in the wheel */
+static void moved(struct worker *worker, struct session *s)
+{
+    uint64_t lock_delay = worker->server->lock_delay;
+    uint64_t period = gravity_period(&s->game);
+    if (lock_delay <= period)
+        return;
+
+    bool resting = tetris_block_resting(&s->game);
+    if (resting == s->resting)
+        return;
+    uint64_t now = gravity_clock(), deadline = s->deadline;
+    if (resting && deadline < now + lock_delay)
+        deadline = now + lock_delay;
+    else if (!resting && deadline > now + period)
+        deadline = now + period;
+    s->resting = resting;
+    if (deadline != s->deadline) {
+        wheel_del(&worker->wheel, s);
+        s->deadline = deadline;
+        wheel_add(&worker->wheel, s);
+    }
+}
+
+static void tick_session(void *arg, struct session *s)
+{
+    struct worker *worker = arg;
+    uint64_t now = gravity_clock();
+    uint64_t late = now - s->deadline;
+
+    int bucket = 0;
+    for (uint64_t us = late / 1000; us && bucket < GRAVITY_JITTER_BUCKETS - 1;
+         us >>= 1)
+        bucket++;
+    worker->stats.jitter[bucket]++;
+    if (late > worker->stats.max_jitter_ns)
+        worker->stats.max_jitter_ns = late;
+    worker->stats.ticks++;
+
+    if (tetris_tick(&s->game) & TETRIS_EVENT_GAME_OVER) {
+        end_session(worker, s);
+        return;
+    }
+    schedule(worker, s, now);
+    compose_frame(worker, s);
+    flush_output(worker, s);
+}
+
+static void accept_sessions(struct worker *worker)
+{
+    struct server *server = worker->server;
+
+    /* a few at a time, leaving the rest to the other threads */
+    for (int i = 0; i < 16; i++) {
+        int fd = accept4(server->listener, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return;
+        int count = __atomic_add_fetch(&server->sessions, 1, __ATOMIC_RELAXED);
+        if (count > server->max_sessions) { /* full: turn the client away */
+            __atomic_sub_fetch(&server->sessions, 1, __ATOMIC_RELAXED);
+            close(fd);
+            continue;
+        }
+        for (int peak = __atomic_load_n(&server->peak, __ATOMIC_RELAXED);
+             count > peak &&
+             !__atomic_compare_exchange_n(&server->peak, &peak, count, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED);)
+            ;
+
+        if (!worker->free) {
+            struct slab *slab = calloc(1, sizeof(*slab));
+            if (!slab) {
+                __atomic_sub_fetch(&server->sessions, 1, __ATOMIC_RELAXED);
+                close(fd);
+                continue;
+            }
+            slab->next = worker->slabs;
+            worker->slabs = slab;
+            for (int j = 0; j < SLAB_SESSIONS; j++) {
+                slab->sessions[j].fd = -1;
+                slab->sessions[j].next = worker->free;
+                worker->free = &slab->sessions[j];
+            }
+        }
+        struct session *s = worker->free;
+        worker->free = s->next;
+
+        *s = (struct session){.fd = fd, .redraw_all = true};
+        struct tetris_config config = server->config;
+        config.seed +=
+            __atomic_add_fetch(&server->serial, 1, __ATOMIC_RELAXED);
+        tetris_init(&s->game, &config);
+        worker->stats.sessions++;
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+        if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &ev)) {
+            close_session(worker, s);
+            continue;
+        }
+
+        compose_frame(worker, s);
+        if (!flush_output(worker, s))
+            continue;
+        s->deadline = gravity_clock();
+        schedule(worker, s, s->deadline);
+    }
+}
+
+/* keys as in ansi.c, arrows included, split across reads or not */
+static input_t decode_key(struct session *s, unsigned char c)
+{
+    if (s->escape == 1) {
+        s->escape = c == '[' || c == 'O' ? 2 : 0;
+        return INPUT_INVALID;
+    }
+    if (s->escape == 2) {
+        s->escape = 0;
+        switch (c) {
+        case 'A':
+            return INPUT_ROTATE_LEFT;
+        case 'B':
+            return INPUT_DROP;
+        case 'C':
+            return INPUT_MOVE_RIGHT;
+        case 'D':
+            return INPUT_MOVE_LEFT;
+        default:
+            return INPUT_INVALID;
+        }
+    }
+
+    switch (c) {
+    case '\033':
+        s->escape = 1;
+        return INPUT_INVALID;
+    case 'h':
+        return INPUT_MOVE_LEFT;
+    case 'l':
+        return INPUT_MOVE_RIGHT;
+    case ' ':
+    case 'j':
+        return INPUT_DROP;
+    case 'k':
+        return INPUT_ROTATE_LEFT;
+    case 'q':
+    case 'Q':
+    case 3: /* ^C, which a raw terminal passes on */
+        return INPUT_PAUSE_QUIT;
+    default:
+        return INPUT_INVALID;
+    }
+}
+
+/* apply what the client typed, and draw the result once */
+static void read_session(struct worker *worker, struct session *s)
+{
+    unsigned char buf[256];
+
+    for (;;) {
+        ssize_t n = read(s->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            close_session(worker, s);
+            return;
+        }
+        for (ssize_t i = 0; i < n && !s->closing; i++) {
+            switch (decode_key(s, buf[i])) {
+            case INPUT_MOVE_LEFT:
+                tetris_step(&s->game, ACTION_MOVE_LEFT);
+                break;
+            case INPUT_MOVE_RIGHT:
+                tetris_step(&s->game, ACTION_MOVE_RIGHT);
+                break;
+            case INPUT_DROP:
+                tetris_step(&s->game, ACTION_DROP);
+                break;
+            case INPUT_ROTATE_LEFT:
+                tetris_step(&s->game, ACTION_ROTATE_LEFT);
+                break;
+            case INPUT_PAUSE_QUIT: /* the others play on: no pause */
+                end_session(worker, s);
+                return;
+            default:
+                continue;
+            }
+            moved(worker, s);
+            worker->stats.keys++;
+        }
+        if (s->closing) /* what is left is not read */
+            return;
+    }
+    compose_frame(worker, s);
+    flush_output(worker, s);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    worker->wheel.cursor = gravity_clock() / WHEEL_GRAIN;
+    for (bool running = true; running;) {
+        arm_timer(worker);
+        int n = epoll_wait(worker->epoll, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+            break;
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &tag_quit) {
+                running = false;
+            } else if (ptr == &tag_listener) {
+                accept_sessions(worker);
+            } else if (ptr == &tag_timer) {
+                uint64_t expirations;
+                if (read(worker->timer, &expirations, sizeof(expirations)) <
+                    0) {
+                    /* a spurious wakeup: look at the wheel anyway */
+                }
+                worker->armed = 0;
+                wheel_expire(&worker->wheel, gravity_clock(), tick_session,
+                             worker);
+            } else {
+                struct session *s = ptr;
+                /* closed by an earlier event of this round */
+                if (s->fd < 0)
+                    continue;
+                if (events[i].events & EPOLLOUT) {
+                    if (!flush_output(worker, s))
+                        continue;
+                    if (s->stale) {
+                        compose_frame(worker, s);
+                        if (!flush_output(worker, s))
+                            continue;
+                    }
+                }
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                    read_session(worker, s);
+            }
+        }
+    }
+
+    /* the games still going end with the server */
+    for (struct slab *slab = worker->slabs; slab; slab = slab->next)
+        for (int i = 0; i < SLAB_SESSIONS; i++)
+            if (slab->sessions[i].fd >= 0 && !slab->sessions[i].closing)
+                end_session(worker, &slab->sessions[i]);
+    return NULL;
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+        listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool start_worker(struct server *server, struct worker *worker)
+{
+    *worker = (struct worker){.server = server};
+    worker->epoll = epoll_create1(EPOLL_CLOEXEC);
+    worker->timer =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (worker->epoll < 0 || worker->timer < 0)
+        return false;
+
+    /* only one of the threads wakes up for a new client */
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                             .data.ptr = &tag_listener};
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, server->listener, &ev))
+        return false;
+    ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &tag_timer};
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, worker->timer, &ev))
+        return false;
+    ev = (struct epoll_event){.events = EPOLLIN, .data.ptr = &tag_quit};
+    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, server->quit, &ev))
+        return false;
+    return !pthread_create(&worker->thread_id, NULL, worker_thread, worker);
+}
+
+/* sum up the threads when the server stops */
+static void print_stats(const struct server *server, double elapsed)
+{
+    struct server_stats total = {0};
+
+    for (int i = 0; i < server->nworkers; i++) {
+        const struct server_stats *stats = &server->workers[i].stats;
+        total.sessions += stats->sessions;
+        total.ticks += stats->ticks;
+        total.keys += stats->keys;
+        total.frames += stats->frames;
+        total.deferred += stats->deferred;
+        total.bytes += stats->bytes;
+        for (int j = 0; j < GRAVITY_JITTER_BUCKETS; j++)
+            total.jitter[j] += stats->jitter[j];
+        if (stats->max_jitter_ns > total.max_jitter_ns)
+            total.max_jitter_ns = stats->max_jitter_ns;
+    }
+
+    fprintf(stderr,
+            "sessions: %llu served, %d at once at most, %zu bytes each\n",
+            total.sessions, server->peak, sizeof(struct session));
+    fprintf(stderr,
+            "traffic : %.0f ticks/sec, %.0f keys/sec, %.0f frames/sec, "
+            "%llu put off, %.0f bytes/sec\n",
+            total.ticks / elapsed, total.keys / elapsed, total.frames / elapsed,
+            total.deferred, total.bytes / elapsed);
+    fprintf(stderr, "ticks   : %llu, at most %.1f us late\n", total.ticks,
+            total.max_jitter_ns / 1e3);
+    for (int i = 0; i < GRAVITY_JITTER_BUCKETS; i++) {
+        if (!total.jitter[i])
+            continue;
+        char bound[32];
+        if (i < GRAVITY_JITTER_BUCKETS - 1)
+            snprintf(bound, sizeof(bound), "< %d us", 1 << i);
+        else
+            snprintf(bound, sizeof(bound), ">= %d us", 1 << (i - 1));
+        fprintf(stderr, "  %-12s: %llu\n", bound, total.jitter[i]);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -u socket [-j threads] [-c sessions] [-b] [-s seed]\n"
+            "          [-L lock-delay]\n"
+            "  -u  accept players on a Unix socket\n"
+            "  -j  event threads, 0 for one per CPU (default 0)\n"
+            "  -c  sessions at once, at most (default 16384)\n"
+            "  -b  deal the blocks from a shuffled bag of all seven\n"
+            "  -s  seed of the first session, the next ones counting up\n"
+            "  -L  ms a resting block waits before locking (default 0)\n"
+            "Play with: socat -,raw,echo=0 UNIX-CONNECT:<socket>\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct server server = {.max_sessions = 16384,
+                            .config.seed = (uint64_t) time(NULL)};
+    const char *socket_path = NULL;
+    int nthreads = 0, opt;
+
+    while ((opt = getopt(argc, argv, "u:j:c:bs:L:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            socket_path = optarg;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'c':
+            server.max_sessions = atoi(optarg);
+            break;
+        case 'b':
+            server.config.policy = PIECES_BAG;
+            break;
+        case 's':
+            server.config.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'L':
+            server.lock_delay = atoi(optarg) * 1000000ULL;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (!socket_path || server.max_sessions <= 0) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+
+    /* a descriptor per session, and a few more */
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < (rlim_t) server.max_sessions + 64)
+            fprintf(stderr, "warning: room for %llu descriptors only\n",
+                    (unsigned long long) limit.rlim_cur);
+    }
+
+    server.quit = quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (server.quit < 0 || (server.listener = listen_on(socket_path)) < 0) {
+        fprintf(stderr, "Fail to listen on %s\n", socket_path);
+        return -1;
+    }
+    struct sigaction sa = {.sa_handler = stop};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    server.workers = calloc(nthreads, sizeof(*server.workers));
+    if (!server.workers) {
+        fprintf(stderr, "Fail to start event threads\n");
+        return -1;
+    }
+    for (; server.nworkers < nthreads; server.nworkers++) {
+        if (!start_worker(&server, &server.workers[server.nworkers])) {
+            fprintf(stderr, "Fail to start event threads\n");
+            stop(0);
+            break;
+        }
+    }
+    fprintf(stderr, "serving on %s with %d threads\n", socket_path,
+            server.nworkers);
+
+    uint64_t start = gravity_clock();
+    for (int i = 0; i < server.nworkers; i++)
+        pthread_join(server.workers[i].thread_id, NULL);
+    print_stats(&server, (gravity_clock() - start) / 1e9);
+
+    for (int i = 0; i < server.nworkers; i++) {
+        struct worker *worker = &server.workers[i];
+        while (worker->slabs) {
+            struct slab *slab = worker->slabs;
+            worker->slabs = slab->next;
+            free(slab);
+        }
+        close(worker->timer);
+        close(worker->epoll);
+    }
+    free(server.workers);
+    close(server.listener);
+    unlink(socket_path);
+    return 0;
+}
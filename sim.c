@@ -0,0 +1,401 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-sim: play many headless games across all cores and report score,
+ * line and level statistics together with the throughput. Every game is
+ * seeded on its own, so the results only depend on the seed list and not
+ * on the number of threads or the order in which the games ran.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getopt, clock_gettime */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "pool.h"
+#include "replay.h"
+#include "tetris.h"
+
+struct game_result {
+    unsigned seed;
+    int pieces, score, lines, level;
+};
+
+/* per-thread accumulator, padded so that workers never share a line */
+struct sim_stats {
+    unsigned long long games, pieces, score, lines, levels;
+    unsigned long long unsaved; /* replays that could not be written */
+    int min_score, max_score, max_level;
+    char pad[64];
+};
+
+struct sim {
+    struct game_result *results;
+    struct sim_stats *stats;
+    struct tetris_config config; /* shared by all games but the seed */
+    int max_pieces;
+    int lookahead; /* for the bot, or -1 to play at random */
+    bool reachability;
+    struct ai_scratch *scratch; /* one per worker */
+    struct ai_table *table;     /* shared by all workers */
+    struct ai_beam *beam;       /* when the pool searches each move instead */
+    const char *record; /* directory to save the replays in, or NULL */
+};
+
+/* Stand-in player: turn and shift the block at random, then drop it. */
+static void random_policy(struct tetris_game *game, struct tetris_rng *rng)
+{
+    int turns = tetris_rng_below(rng, TOTAL_DEGREES);
+    int shift = (int) tetris_rng_below(rng, GAME_BOARD_WIDTH) -
+                GAME_BOARD_WIDTH / 2;
+
+    for (int i = 0; i < turns; i++)
+        tetris_step(game, ACTION_ROTATE_LEFT);
+    for (; shift < 0; shift++)
+        tetris_step(game, ACTION_MOVE_LEFT);
+    for (; shift > 0; shift--)
+        tetris_step(game, ACTION_MOVE_RIGHT);
+    tetris_step(game, ACTION_DROP);
+}
+
+static void play_game(void *arg, int job, int worker)
+{
+    struct sim *sim = arg;
+    struct game_result *r = &sim->results[job];
+    struct sim_stats *s = &sim->stats[worker];
+    struct tetris_game game;
+    struct tetris_config config = sim->config;
+    struct tetris_rng rng;
+
+    config.seed = r->seed;
+    tetris_init(&game, &config);
+    struct replay_writer *writer = NULL;
+    if (sim->record) {
+        writer = replay_writer_create(&config, 0);
+        if (writer)
+            game.observer = replay_writer_observer(writer, NULL);
+    }
+    tetris_rng_seed(&rng, ~(uint64_t) r->seed); /* the player's own stream */
+    while (!sim->max_pieces || r->pieces < sim->max_pieces) {
+        unsigned events = tetris_tick(&game);
+        if (events & TETRIS_EVENT_GAME_OVER)
+            break;
+        if (events & TETRIS_EVENT_NEW_BLOCK) {
+            struct ai_move move;
+            struct ai_options ai = {.lookahead = sim->lookahead,
+                                    .reachability = sim->reachability,
+                                    .scratch = &sim->scratch[worker],
+                                    .table = sim->table};
+            r->pieces++;
+            if (sim->lookahead < 0)
+                random_policy(&game, &rng);
+            else if (sim->beam ? ai_beam_move(sim->beam, &game, &move)
+                               : ai_best_move(&game, &ai, &move))
+                ai_apply_move(&game, &move);
+        }
+    }
+
+    if (sim->record) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%u.replay", sim->record, r->seed);
+        if (!writer || !replay_writer_save(writer, &game, path))
+            s->unsaved++;
+        replay_writer_destroy(writer);
+    }
+
+    r->score = game.score.score;
+    r->lines = game.score.total_rows;
+    r->level = game.score.level;
+
+    s->games++;
+    s->pieces += r->pieces;
+    s->score += r->score;
+    s->lines += r->lines;
+    s->levels += r->level;
+    if (s->games == 1 || r->score < s->min_score)
+        s->min_score = r->score;
+    if (r->score > s->max_score)
+        s->max_score = r->score;
+    if (r->level > s->max_level)
+        s->max_level = r->level;
+}
+
+static int load_seeds(const char *path, unsigned **seeds)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+
+    int count = 0, capacity = 0;
+    unsigned seed, *list = NULL;
+    while (fscanf(fp, "%u", &seed) == 1) {
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            unsigned *p = realloc(list, capacity * sizeof(*list));
+            if (!p) {
+                free(list);
+                fclose(fp);
+                return -1;
+            }
+            list = p;
+        }
+        list[count++] = seed;
+    }
+    fclose(fp);
+
+    *seeds = list;
+    return count;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n games] [-j threads] [-s seed | -S seed-file]\n"
+            "          [-p max-pieces] [-b | -q sequence-file] [-l depth | -r]\n"
+            "          [-t] [-c bits] [-w width [-T budget]] [-o dir] [-v]\n"
+            "  -n  number of games to play (default 1000)\n"
+            "  -j  worker threads, 0 for one per CPU (default 0)\n"
+            "  -s  seed of the first game, the others count up (default 1)\n"
+            "  -S  read the seed of every game from a file\n"
+            "  -p  stop a game after this many pieces, 0 for no limit\n"
+            "      (default 10000)\n"
+            "  -b  deal the blocks from a shuffled bag of all seven\n"
+            "  -q  deal the blocks from a fixed sequence read from a file\n"
+            "  -l  blocks the bot looks ahead, 0 to %d, or to %d with -w\n"
+            "      (default 0)\n"
+            "  -r  play at random instead of using the bot\n"
+            "  -t  let the bot search every reachable placement, including\n"
+            "      tucks and spins, instead of drops only\n"
+            "  -c  log2 of the buckets in the bot's transposition table,\n"
+            "      0 for none (default 18, 16 MiB)\n"
+            "  -w  beam search keeping this many boards at each level, with\n"
+            "      all threads working on one move at a time\n"
+            "  -T  stop the beam search of a move after this many us\n"
+            "  -o  save the replay of every game in a directory, named\n"
+            "      after its seed\n"
+            "  -v  print the result of every game\n",
+            prog, AI_MAX_LOOKAHEAD, AI_BEAM_MAX_DEPTH - 1);
+}
+
+int main(int argc, char *argv[])
+{
+    int ngames = 1000, nthreads = 0, table_bits = 18, opt;
+    int beam_width = 0, budget = 0;
+    unsigned base_seed = 1, *seeds = NULL;
+    const char *seed_file = NULL;
+    bool verbose = false;
+    struct sim sim = {.max_pieces = 10000, .lookahead = 0};
+    struct piece *sequence = NULL;
+
+    while ((opt = getopt(argc, argv, "n:j:s:S:p:bq:l:rtc:w:T:o:vh")) != -1) {
+        switch (opt) {
+        case 'n':
+            ngames = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 's':
+            base_seed = (unsigned) strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            seed_file = optarg;
+            break;
+        case 'p':
+            sim.max_pieces = atoi(optarg);
+            break;
+        case 'b':
+            sim.config.policy = PIECES_BAG;
+            break;
+        case 'q':
+            sim.config.sequence_length = tetris_load_sequence(optarg, &sequence);
+            if (sim.config.sequence_length < 0) {
+                fprintf(stderr, "Fail to read pieces from %s\n", optarg);
+                return -1;
+            }
+            sim.config.policy = PIECES_SEQUENCE;
+            sim.config.sequence = sequence;
+            break;
+        case 'l':
+            sim.lookahead = atoi(optarg);
+            /* the upper bound depends on -w, checked once all are read */
+            if (sim.lookahead < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'r':
+            sim.lookahead = -1;
+            break;
+        case 't':
+            sim.reachability = true;
+            break;
+        case 'c':
+            table_bits = atoi(optarg);
+            break;
+        case 'w':
+            beam_width = atoi(optarg);
+            break;
+        case 'T':
+            budget = atoi(optarg);
+            break;
+        case 'o':
+            sim.record = optarg;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (seed_file) {
+        ngames = load_seeds(seed_file, &seeds);
+        if (ngames < 0) {
+            fprintf(stderr, "Fail to read seeds from %s\n", seed_file);
+            return -1;
+        }
+    }
+    if (sim.lookahead > (beam_width > 0 ? AI_BEAM_MAX_DEPTH - 1
+                                        : AI_MAX_LOOKAHEAD)) {
+        usage(argv[0]);
+        return -1;
+    }
+    /* the bot can only look as far ahead as the game shows */
+    sim.config.preview = sim.lookahead;
+    if (ngames <= 0) {
+        fprintf(stderr, "Nothing to simulate\n");
+        return -1;
+    }
+
+    struct pool *pool = pool_create(nthreads);
+    if (!pool) {
+        fprintf(stderr, "Fail to start worker threads\n");
+        return -1;
+    }
+    nthreads = pool_size(pool);
+
+    sim.results = calloc(ngames, sizeof(*sim.results));
+    sim.stats = calloc(nthreads, sizeof(*sim.stats));
+    sim.scratch = calloc(nthreads, sizeof(*sim.scratch));
+    if (table_bits > 0 && sim.lookahead > 0)
+        sim.table = ai_table_create(table_bits);
+    if (!sim.results || !sim.stats || !sim.scratch ||
+        (table_bits > 0 && sim.lookahead > 0 && !sim.table)) {
+        fprintf(stderr, "Fail to allocate %d games\n", ngames);
+        return -1;
+    }
+    for (int i = 0; i < ngames; i++)
+        sim.results[i].seed = seeds ? seeds[i] : base_seed + (unsigned) i;
+
+    if (beam_width > 0 && sim.lookahead >= 0) {
+        struct ai_beam_options options = {.depth = sim.lookahead + 1,
+                                          .width = beam_width,
+                                          .budget = budget,
+                                          .reachability = sim.reachability};
+        sim.beam = ai_beam_create(pool, &options);
+        if (!sim.beam) {
+            fprintf(stderr, "Fail to allocate the beam search\n");
+            return -1;
+        }
+    }
+
+    double start = now();
+    if (sim.beam) { /* one game at a time, each move on all threads */
+        for (int i = 0; i < ngames; i++)
+            play_game(&sim, i, 0);
+    } else {
+        pool_run(pool, ngames, play_game, &sim);
+    }
+    double elapsed = now() - start;
+
+    /* merge the per-thread accumulators */
+    struct sim_stats total = {.games = 0};
+    double score_sq = 0;
+    for (int i = 0; i < nthreads; i++) {
+        struct sim_stats *s = &sim.stats[i];
+        if (!s->games)
+            continue;
+        if (!total.games || s->min_score < total.min_score)
+            total.min_score = s->min_score;
+        if (s->max_score > total.max_score)
+            total.max_score = s->max_score;
+        if (s->max_level > total.max_level)
+            total.max_level = s->max_level;
+        total.games += s->games;
+        total.pieces += s->pieces;
+        total.score += s->score;
+        total.lines += s->lines;
+        total.levels += s->levels;
+        total.unsaved += s->unsaved;
+    }
+    /* summed in game order so that rounding never depends on the threads */
+    for (int i = 0; i < ngames; i++)
+        score_sq += (double) sim.results[i].score * sim.results[i].score;
+
+    if (verbose) {
+        for (int i = 0; i < ngames; i++) {
+            struct game_result *r = &sim.results[i];
+            printf("%u\t%d\t%d\t%d\t%d\n", r->seed, r->score, r->lines,
+                   r->level, r->pieces);
+        }
+    }
+
+    double mean = (double) total.score / total.games;
+    double variance = score_sq / total.games - mean * mean;
+    printf("games      : %llu on %d threads\n", total.games, nthreads);
+    printf("score      : mean %.2f, stddev %.2f, min %d, max %d\n", mean,
+           variance > 0 ? sqrt(variance) : 0, total.min_score,
+           total.max_score);
+    printf("lines      : mean %.2f, total %llu\n",
+           (double) total.lines / total.games, total.lines);
+    printf("level      : mean %.2f, max %d\n",
+           (double) total.levels / total.games, total.max_level);
+    printf("pieces     : mean %.2f, total %llu\n",
+           (double) total.pieces / total.games, total.pieces);
+    if (sim.lookahead >= 0 && !sim.beam) {
+        unsigned long long evaluations = 0, probes = 0, hits = 0;
+        for (int i = 0; i < nthreads; i++) {
+            evaluations += sim.scratch[i].evaluations;
+            probes += sim.scratch[i].probes;
+            hits += sim.scratch[i].hits;
+        }
+        printf("search     : %.1f evaluations/piece, %.1f%% table hits\n",
+               (double) evaluations / total.pieces,
+               probes ? 100.0 * hits / probes : 0);
+    }
+    printf("throughput : %.0f games/sec, %.0f pieces/sec (%.3f s)\n",
+           total.games / elapsed, total.pieces / elapsed, elapsed);
+
+    if (total.unsaved)
+        fprintf(stderr, "Fail to save %llu replays in %s\n", total.unsaved,
+                sim.record);
+
+    pool_destroy(pool);
+    ai_beam_destroy(sim.beam);
+    ai_table_destroy(sim.table);
+    free(sim.scratch);
+    free(sim.stats);
+    free(sim.results);
+    free(seeds);
+    free(sequence);
+    return 0;
+}
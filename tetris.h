@@ -7,14 +7,37 @@
  * found in the LICENSE file.
  */
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
 #define WINDOW_MAIN_SIZE_X 80
 #define WINDOW_MAIN_SIZE_Y 24
 
 #define DIFFICULTY_LEVEL_MAX 25
+#define INITIAL_TIMEOUT 1000
+
+/* rule for calculating timeout reduction delta with each new level */
+#define TIMEOUT_DELTA(level) ((DIFFICULTY_LEVEL_MAX - (level) + 1) * 3)
 
 #define GAME_BOARD_HEIGHT 20
 #define GAME_BOARD_WIDTH 12
 
+/* The board is stored as one bitmask per row. The cells of the playing field
+ * occupy bits [BOARD_WALL_BITS, BOARD_WALL_BITS + GAME_BOARD_WIDTH) and every
+ * other bit is permanently set, acting as the left and right walls. Row 0 is
+ * the ceiling and the rows below GAME_BOARD_HEIGHT are the floor, so a block
+ * probing outside the field collides just like on an occupied cell.
+ */
+typedef uint16_t row_t;
+
+#define BOARD_WALL_BITS 2
+#define BOARD_ROWS (GAME_BOARD_HEIGHT + 4)
+#define BOARD_CELL(x) ((row_t)(1U << ((x) + BOARD_WALL_BITS)))
+#define BOARD_FULL_ROW ((row_t) ~0U)
+#define BOARD_EMPTY_ROW \
+    ((row_t) ~(((1U << GAME_BOARD_WIDTH) - 1) << BOARD_WALL_BITS))
+
 #define ARRAY_SIZE(arr) ((int) (sizeof(arr) / sizeof(*(arr))))
 
 typedef enum {
@@ -59,12 +82,254 @@ typedef enum {
     INPUT_PAUSE_QUIT,
 } input_t;
 
-extern int board[GAME_BOARD_HEIGHT + 2][GAME_BOARD_WIDTH + 2];
 extern const struct position positions[TOTAL_BLOCKS][TOTAL_DEGREES];
+extern const struct point starting_position; /* where new blocks enter */
+
+/* Range of block origins covered by the precomputed row masks. Cells falling
+ * outside the board map onto wall bits, so any mask collides with a wall.
+ */
+#define BLOCK_X_MIN (-4)
+#define BLOCK_X_MAX GAME_BOARD_WIDTH
+#define BLOCK_X_SPAN (BLOCK_X_MAX - BLOCK_X_MIN + 1)
+
+struct block_shape {
+    int8_t min_x, max_x, min_y, max_y; /* bounding box relative to origin */
+    int8_t bottom[4]; /* lowest cell of each column, -1 if the column is empty */
+    int8_t top[4];    /* highest cell of each column, -1 if empty */
+};
+
+/* generated by gen-blocks from the positions table */
+extern const struct block_shape block_shapes[TOTAL_BLOCKS][TOTAL_DEGREES];
+extern const row_t block_rows[TOTAL_BLOCKS][TOTAL_DEGREES][BLOCK_X_SPAN][4];
+
+/* four consecutive rows as one word, to test or merge a block in one go */
+static inline uint64_t load_rows(const row_t *rows)
+{
+    uint64_t v;
+    memcpy(&v, rows, sizeof(v));
+    return v;
+}
+
+static inline void store_rows(row_t *rows, uint64_t v)
+{
+    memcpy(rows, &v, sizeof(v));
+}
+
+static inline uint64_t block_mask(int type, int orientation, int x)
+{
+    return load_rows(block_rows[type][orientation][x - BLOCK_X_MIN]);
+}
+
+/* whether a block with its origin at (x, y) fits on the board */
+static inline bool block_fits(const row_t *board,
+                              int type,
+                              int orientation,
+                              int x,
+                              int y)
+{
+    return !(load_rows(&board[y + 1]) & block_mask(type, orientation, x));
+}
+
+typedef enum {
+    ACTION_DROP, /* drop the block at the floor */
+    ACTION_MOVE_LEFT,
+    ACTION_MOVE_RIGHT,
+    ACTION_MOVE_DOWN, /* by tetris_tick() only */
+    ACTION_ROTATE_LEFT,
+    ACTION_PLACE_NEW, /* by tetris_tick() only */
+    TOTAL_MOVEMENTS
+} action_t;
+
+/* events reported by tetris_step() and tetris_tick() */
+enum {
+    TETRIS_EVENT_MOVED = 1 << 0,     /* the current block changed its pose */
+    TETRIS_EVENT_NEW_BLOCK = 1 << 1, /* the next block entered the board */
+    TETRIS_EVENT_LOCKED = 1 << 2,    /* the current block froze in place */
+    TETRIS_EVENT_LINES_CLEARED = 1 << 3,
+    TETRIS_EVENT_LEVEL_UP = 1 << 4,
+    TETRIS_EVENT_GAME_OVER = 1 << 5,
+};
+
+/* xoshiro128** generator: small, fast, and private to whoever owns it */
+struct tetris_rng {
+    uint32_t s[4];
+};
+
+void tetris_rng_seed(struct tetris_rng *rng, uint64_t seed);
+uint32_t tetris_rng_next(struct tetris_rng *rng);
+uint32_t tetris_rng_below(struct tetris_rng *rng, uint32_t bound);
+
+/* a block type together with the orientation it enters the board in */
+struct piece {
+    uint8_t type, orientation;
+};
+
+/* how the stream of upcoming pieces is generated */
+typedef enum {
+    PIECES_UNIFORM,  /* any block in any orientation, equally likely */
+    PIECES_BAG,      /* all seven blocks in random order, then repeat */
+    PIECES_SEQUENCE, /* a fixed list of pieces, repeated */
+} piece_policy_t;
+
+#define TETRIS_PREVIEW_MAX 8 /* must be a power of 2 */
+
+/* Zobrist keys, generated by gen-blocks. The key of a board is the xor of
+ * the keys of its filled cells; they are tabulated per half row so that a
+ * whole row hashes in two lookups. A piece key depends on how far ahead in
+ * the stream the piece is, 0 being the current block.
+ */
+#define ZOBRIST_HALF ((GAME_BOARD_WIDTH + 1) / 2)
+
+extern const uint64_t zobrist_rows[GAME_BOARD_HEIGHT][2][1 << ZOBRIST_HALF];
+extern const uint64_t zobrist_pieces[TETRIS_PREVIEW_MAX + 1][TOTAL_BLOCKS]
+                                    [TOTAL_DEGREES];
+
+/* key of the cells filled in row i (1 to GAME_BOARD_HEIGHT) of a board */
+static inline uint64_t row_hash(int i, row_t row)
+{
+    unsigned cells =
+        (row >> BOARD_WALL_BITS) & ((1U << GAME_BOARD_WIDTH) - 1);
+    return zobrist_rows[i - 1][0][cells & ((1U << ZOBRIST_HALF) - 1)] ^
+           zobrist_rows[i - 1][1][cells >> ZOBRIST_HALF];
+}
+
+/* key of the rows first to last of a board */
+static inline uint64_t board_hash(const row_t *board, int first, int last)
+{
+    uint64_t hash = 0;
+    for (int i = first; i <= last; i++)
+        hash ^= row_hash(i, board[i]);
+    return hash;
+}
+
+struct tetris_config {
+    uint64_t seed;
+    piece_policy_t policy;
+    const struct piece *sequence; /* for PIECES_SEQUENCE, not copied */
+    int sequence_length;
+    int preview; /* upcoming pieces to look ahead, 1 when left at 0 */
+};
+
+struct tetris_game;
+
+/* Optional hooks: notify is invoked after every step or tick that produced
+ * events, input after every action the engine accepted. The engine itself
+ * never renders; front ends attach a renderer here, and a replay recorder.
+ */
+struct tetris_observer {
+    void (*notify)(void *opaque, const struct tetris_game *game,
+                   unsigned events);
+    void (*input)(void *opaque, const struct tetris_game *game,
+                  action_t action);
+    void *opaque;
+};
+
+/* Complete state of one game. It holds no pointers into itself, so a game
+ * can be copied to explore alternatives, and any number of games can run
+ * side by side in one process.
+ */
+struct tetris_game {
+    row_t board[BOARD_ROWS];
+    /* per-cell color plane for the renderer, 0 for an empty cell */
+    unsigned char color[BOARD_ROWS][GAME_BOARD_WIDTH];
+    /* skyline: number of rows from the floor up to the highest filled cell */
+    uint8_t column_height[GAME_BOARD_WIDTH];
+    int top_row; /* the nearest empty row (counting from bottom) */
+    uint64_t hash; /* Zobrist key of the board, kept up to date on lock */
+
+    struct block current;
+    bool has_block; /* false between a lock and the next spawn */
+
+    /* ring buffer of the upcoming pieces, see tetris_preview() */
+    struct piece preview[TETRIS_PREVIEW_MAX];
+    uint8_t preview_head, preview_length;
+
+    struct game_score score;
+    int timeout; /* gravity period in ms */
+    uint32_t ticks; /* calls to tetris_tick() so far, the clock of replays */
+    bool game_over;
+
+    /* absolute rows removed by the last lock, for animations */
+    int cleared_rows[4];
+    int cleared_count;
+
+    struct tetris_rng rng;
+    piece_policy_t policy;
+    uint8_t bag[TOTAL_BLOCKS], bag_left;
+    const struct piece *sequence;
+    int sequence_length, sequence_pos;
+
+    const struct tetris_observer *observer;
+};
+
+void tetris_init(struct tetris_game *game, const struct tetris_config *config);
+unsigned tetris_step(struct tetris_game *game, action_t action);
+unsigned tetris_tick(struct tetris_game *game);
+
+/* whether the next tick locks the current block, unless it is moved first */
+bool tetris_block_resting(const struct tetris_game *game);
+
+/* Recompute the skyline, the top row and the key of the board from its
+ * cells, after the board was loaded from elsewhere.
+ */
+void tetris_sync_board(struct tetris_game *game);
+
+/* Whether the state of 'game', loaded from elsewhere, is one the engine
+ * could have reached: a level, a timeout and a score which agree with the
+ * rows cleared, a current block which fits the board, and none once the game
+ * is over.
+ */
+bool tetris_state_valid(const struct tetris_game *game);
+
+/* the i-th upcoming piece, 0 being the next one to enter the board */
+static inline struct piece tetris_preview(const struct tetris_game *game, int i)
+{
+    return game->preview[(game->preview_head + i) & (TETRIS_PREVIEW_MAX - 1)];
+}
+
+/* Read a piece sequence for PIECES_SEQUENCE from a file: one letter per block
+ * (O I T Z S L J), each optionally followed by its orientation 0-3; anything
+ * after '#' on a line is a comment. Returns the number of pieces read into
+ * a newly allocated array, or -1 on failure.
+ */
+int tetris_load_sequence(const char *path, struct piece **sequence);
+
+/* key of the position: the board, the current block and the next one */
+static inline uint64_t tetris_hash(const struct tetris_game *game)
+{
+    struct piece next = tetris_preview(game, 0);
+    uint64_t hash = game->hash ^ zobrist_pieces[1][next.type][next.orientation];
+    if (game->has_block)
+        hash ^= zobrist_pieces[0][game->current.type][game->current.orientation];
+    return hash;
+}
+
+/* how the interactive game is played */
+struct play_options {
+    struct tetris_config config;
+    bool autoplay; /* let the bot play, the keyboard only pauses or quits */
+    int beam_depth, beam_width; /* of the bot's search, see ai_beam_move() */
+    const char *record; /* file to save the replay of the game in, or NULL */
+    bool event_loop; /* play on one thread, see event_loop() in play.c */
+    int lock_delay; /* ms a resting block waits before locking, see gravity.h */
+    bool no_animations; /* skip cleared rows and level banners */
+    const char *spectate; /* Unix socket to broadcast the game on, or NULL */
+    const char *metrics;  /* file to keep the metrics in, see metrics.h */
+    bool hud;             /* show the metrics on screen */
+};
+
+/* the keys the game thread took from the input thread */
+struct input_stats {
+    unsigned long long keys;
+    unsigned long long wait_ns, max_wait_ns; /* from reading to applying */
+};
 
 int snooze(int ms);
-bool start_new_game(void);
+bool start_new_game(const struct play_options *options);
+void get_input_stats(struct input_stats *stats);
 input_t get_user_input(void);
+/* get_user_input() waiting at most 'timeout' ms, 0 to only take a pending key */
+input_t wait_user_input(int timeout);
 
 bool init_ui(void);
 void deinit_ui(void);
@@ -72,8 +337,37 @@ void init_game_screen(void);
 
 bool show_quit_dialog(void);
 void draw_next_block(block_t type, degree_t orientation);
-void draw_game_board(struct block *current);
-void draw_score_board(struct game_score *score);
-void draw_level_info(int level);
+void draw_game_board(const struct tetris_game *game);
+void draw_score_board(const struct game_score *score);
+
+/* Show a banner with 'level' over the board from the next frame on, or take
+ * it down with 0.
+ */
+void show_level_banner(int level);
+
+/* One frame of the animation of cleared rows: blank the first 'steps' of the
+ * CLEARED_ROWS_STEPS steps wiping the rows out, from both ends inwards or
+ * from the center outwards.
+ */
+#define CLEARED_ROWS_STEPS (GAME_BOARD_WIDTH + 1)
+void draw_cleared_rows(const int *rows, int count, int steps, bool from_ends);
+
+/* Show lines of text under the side panels, for the debug HUD, from the next
+ * frame on, or take them down with NULL.
+ */
+#define HUD_LINES 3
+#define HUD_WIDTH 32
+void draw_debug_hud(const char text[HUD_LINES][HUD_WIDTH + 1]);
+
+/* what draw_game_board() cost so far */
+struct ui_stats {
+    unsigned long long frames, full_frames; /* drawn, and redrawn whole */
+    unsigned long long cells;               /* drawn or erased */
+    unsigned long long bytes;        /* written to the terminal by frames */
+    unsigned long long cpu_ns;       /* CPU time spent drawing frames */
+    unsigned long long output_bytes; /* written to the terminal in all */
+};
+
+void get_ui_stats(struct ui_stats *stats);
 
 #endif /* __TETRIS_H__ */
@@ -0,0 +1,420 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-tune: tune the weights of the bot's evaluator through self-play.
+ * Each generation samples candidate weights around a mean, plays the same
+ * set of seeds with every candidate on all cores, scoring them by the game's
+ * own score, and moves the mean and the spread towards the best ones (the
+ * cross-entropy method). Games run in rounds, and after each round the
+ * candidates far behind the leaders stop playing. The state is saved after
+ * every generation, so a run can be stopped and resumed at any time.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getopt, clock_gettime */
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ai.h"
+#include "pool.h"
+#include "tetris.h"
+
+#define CHECKPOINT_MAGIC "tetris-tune 1"
+#define MIN_SIGMA 0.001 /* keep exploring once the spread collapses */
+
+/* the weights being tuned, as offsets into struct ai_weights */
+static const struct {
+    const char *name;
+    size_t offset;
+} params[] = {
+    {"height", offsetof(struct ai_weights, height)},
+    {"lines", offsetof(struct ai_weights, lines)},
+    {"holes", offsetof(struct ai_weights, holes)},
+    {"bumpiness", offsetof(struct ai_weights, bumpiness)},
+    {"wells", offsetof(struct ai_weights, wells)},
+    {"transitions", offsetof(struct ai_weights, transitions)},
+};
+
+#define NPARAMS ARRAY_SIZE(params)
+
+static double *weight(struct ai_weights *w, int i)
+{
+    return (double *) ((char *) w + params[i].offset);
+}
+
+/* what is carried from one generation to the next */
+struct state {
+    uint64_t seed; /* of the games, the first generation's first one */
+    int generation;
+    struct tetris_rng rng;
+    double mean[NPARAMS], sigma[NPARAMS];
+    double best_fitness;
+    double best[NPARAMS];
+};
+
+struct candidate {
+    struct ai_weights weights;
+    long long score; /* summed over the games played so far */
+    int games;
+    bool active;
+};
+
+struct tuner {
+    struct candidate *candidates;
+    int *active;  /* candidates still playing this round */
+    int *results; /* score of each game of the round */
+    int games;    /* per round */
+    uint64_t first_seed;
+    int max_pieces, lookahead;
+    struct tetris_config config;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* standard normal deviate (Box-Muller) */
+static double gaussian(struct tetris_rng *rng)
+{
+    double u = (tetris_rng_next(rng) + 1.0) / 4294967297.0;
+    double v = tetris_rng_next(rng) / 4294967296.0;
+    return sqrt(-2 * log(u)) * cos(2 * 3.14159265358979323846 * v);
+}
+
+static void play_game(void *arg, int job, int worker)
+{
+    struct tuner *t = arg;
+    const struct candidate *c = &t->candidates[t->active[job / t->games]];
+    struct ai_options ai = {.weights = &c->weights, .lookahead = t->lookahead};
+    struct tetris_config config = t->config;
+    struct tetris_game game;
+    int pieces = 0;
+
+    (void) worker;
+
+    /* every candidate plays the same seeds */
+    config.seed = t->first_seed + job % t->games;
+    tetris_init(&game, &config);
+    while (!t->max_pieces || pieces < t->max_pieces) {
+        unsigned events = tetris_tick(&game);
+        if (events & TETRIS_EVENT_GAME_OVER)
+            break;
+        if (events & TETRIS_EVENT_NEW_BLOCK) {
+            struct ai_move move;
+            pieces++;
+            if (ai_best_move(&game, &ai, &move))
+                ai_apply_move(&game, &move);
+        }
+    }
+    t->results[job] = game.score.score;
+}
+
+static bool save_state(const char *path, const struct state *s)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return false;
+    fprintf(fp, "%s\nseed %llu\ngeneration %d\nrng %u %u %u %u\n",
+            CHECKPOINT_MAGIC, (unsigned long long) s->seed, s->generation,
+            s->rng.s[0], s->rng.s[1], s->rng.s[2], s->rng.s[3]);
+    fprintf(fp, "best %.17g\n", s->best_fitness);
+    for (int i = 0; i < NPARAMS; i++)
+        fprintf(fp, "%s %.17g %.17g %.17g\n", params[i].name, s->mean[i],
+                s->sigma[i], s->best[i]);
+    if (fclose(fp))
+        return false;
+
+    /* replace the previous checkpoint only once the new one is complete */
+    return !rename(tmp, path);
+}
+
+/* Read the checkpoint at 'path' into 's', which is left as it was unless the
+ * whole file is read. On failure, errno is ENOENT if there is no checkpoint,
+ * and EINVAL if it is not one.
+ */
+static bool load_state(const char *path, struct state *s)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return false;
+
+    struct state loaded = {0};
+    char magic[32], name[32];
+    unsigned long long seed;
+    bool ok = fgets(magic, sizeof(magic), fp) &&
+              !strncmp(magic, CHECKPOINT_MAGIC, strlen(CHECKPOINT_MAGIC)) &&
+              fscanf(fp, " seed %llu", &seed) == 1 &&
+              fscanf(fp, " generation %d", &loaded.generation) == 1 &&
+              fscanf(fp, " rng %u %u %u %u", &loaded.rng.s[0],
+                     &loaded.rng.s[1], &loaded.rng.s[2],
+                     &loaded.rng.s[3]) == 4 &&
+              fscanf(fp, " best %lf", &loaded.best_fitness) == 1;
+    for (int i = 0; ok && i < NPARAMS; i++)
+        ok = fscanf(fp, " %31s %lf %lf %lf", name, &loaded.mean[i],
+                    &loaded.sigma[i], &loaded.best[i]) == 4 &&
+             !strcmp(name, params[i].name);
+    fclose(fp);
+    if (!ok || loaded.generation < 0) {
+        errno = EINVAL;
+        return false;
+    }
+    loaded.seed = seed;
+    *s = loaded;
+    return true;
+}
+
+/* whether candidate a ranks above b: having played more rounds, those cut
+ * early being only compared with each other, then by fitness
+ */
+static bool ahead(const struct candidate *candidates,
+                  const double *fitness,
+                  int a,
+                  int b)
+{
+    if (candidates[a].games != candidates[b].games)
+        return candidates[a].games > candidates[b].games;
+    return fitness[a] > fitness[b];
+}
+
+/* candidate numbers by rank, best first, ties in candidate order */
+static void rank(int *order,
+                 int n,
+                 const struct candidate *candidates,
+                 const double *fitness)
+{
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        for (; j > 0 && ahead(candidates, fitness, i, order[j - 1]); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-g generations] [-n candidates] [-e elites]\n"
+            "          [-m games] [-R rounds] [-p max-pieces] [-l depth]\n"
+            "          [-j threads] [-s seed] [-b] [-c checkpoint]\n"
+            "  -g  generations to run (default 20)\n"
+            "  -n  candidates per generation (default 32)\n"
+            "  -e  best candidates the next generation is drawn from\n"
+            "      (default 8)\n"
+            "  -m  games per candidate, a multiple of -R (default 64)\n"
+            "  -R  rounds the games are played in; after each round the\n"
+            "      candidates scoring under half of the last elite stop\n"
+            "      (default 4)\n"
+            "  -p  stop a game after this many pieces (default 1000)\n"
+            "  -l  blocks the bot looks ahead, 0 to %d (default 0)\n"
+            "  -j  worker threads, 0 for one per CPU (default 0)\n"
+            "  -s  seed of the tuner and of the games, unless resuming\n"
+            "      (default 1)\n"
+            "  -b  deal the blocks from a shuffled bag of all seven\n"
+            "  -c  save the state to this file after every generation, and\n"
+            "      resume from it if it exists\n",
+            prog, AI_MAX_LOOKAHEAD);
+}
+
+int main(int argc, char *argv[])
+{
+    int generations = 20, ncandidates = 32, nelites = 8, games = 64;
+    int rounds = 4, nthreads = 0, opt;
+    uint64_t seed = 1;
+    const char *checkpoint = NULL;
+    struct tuner t = {.max_pieces = 1000};
+
+    while ((opt = getopt(argc, argv, "g:n:e:m:R:p:l:j:s:bc:h")) != -1) {
+        switch (opt) {
+        case 'g':
+            generations = atoi(optarg);
+            break;
+        case 'n':
+            ncandidates = atoi(optarg);
+            break;
+        case 'e':
+            nelites = atoi(optarg);
+            break;
+        case 'm':
+            games = atoi(optarg);
+            break;
+        case 'R':
+            rounds = atoi(optarg);
+            break;
+        case 'p':
+            t.max_pieces = atoi(optarg);
+            break;
+        case 'l':
+            t.lookahead = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            t.config.policy = PIECES_BAG;
+            break;
+        case 'c':
+            checkpoint = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (ncandidates < 2 || nelites < 1 || nelites > ncandidates ||
+        rounds < 1 || games < rounds || games % rounds || t.lookahead < 0 ||
+        t.lookahead > AI_MAX_LOOKAHEAD) {
+        usage(argv[0]);
+        return -1;
+    }
+    t.games = games / rounds;
+    t.config.preview = t.lookahead;
+
+    /* start from the shipped weights, or from where the last run stopped */
+    struct state s = {.seed = seed, .best_fitness = -1};
+    if (checkpoint && load_state(checkpoint, &s)) {
+        printf("resuming %s at generation %d\n", checkpoint, s.generation);
+    } else if (checkpoint && errno != ENOENT) {
+        /* rather than start over and overwrite it */
+        fprintf(stderr, "Fail to resume from %s: %s\n", checkpoint,
+                strerror(errno));
+        return -1;
+    } else {
+        struct ai_weights w = ai_default_weights;
+        tetris_rng_seed(&s.rng, seed);
+        for (int i = 0; i < NPARAMS; i++) {
+            s.mean[i] = *weight(&w, i);
+            s.sigma[i] = fabs(s.mean[i]) > 0.1 ? fabs(s.mean[i]) / 2 : 0.1;
+        }
+    }
+
+    struct pool *pool = pool_create(nthreads);
+    if (!pool) {
+        fprintf(stderr, "Fail to start worker threads\n");
+        return -1;
+    }
+
+    t.candidates = calloc(ncandidates, sizeof(*t.candidates));
+    t.active = calloc(ncandidates, sizeof(*t.active));
+    t.results = calloc((size_t) ncandidates * t.games, sizeof(*t.results));
+    double *fitness = calloc(ncandidates, sizeof(*fitness));
+    int *order = calloc(ncandidates, sizeof(*order));
+    if (!t.candidates || !t.active || !t.results || !fitness || !order) {
+        fprintf(stderr, "Fail to allocate %d candidates\n", ncandidates);
+        return -1;
+    }
+
+    for (int end = s.generation + generations; s.generation < end;) {
+        double start = now();
+        long long played = 0;
+
+        for (int c = 0; c < ncandidates; c++) {
+            struct candidate *cand = &t.candidates[c];
+            *cand = (struct candidate){.weights = ai_default_weights,
+                                       .active = true};
+            for (int i = 0; i < NPARAMS; i++)
+                *weight(&cand->weights, i) =
+                    s.mean[i] + s.sigma[i] * gaussian(&s.rng);
+        }
+
+        for (int round = 0; round < rounds; round++) {
+            int nactive = 0;
+            for (int c = 0; c < ncandidates; c++)
+                if (t.candidates[c].active)
+                    t.active[nactive++] = c;
+
+            t.first_seed = s.seed + (uint64_t) s.generation * games +
+                           (uint64_t) round * t.games;
+            pool_run(pool, nactive * t.games, play_game, &t);
+            played += (long long) nactive * t.games;
+
+            for (int i = 0; i < nactive * t.games; i++) {
+                struct candidate *cand = &t.candidates[t.active[i / t.games]];
+                cand->score += t.results[i];
+                cand->games++;
+            }
+            for (int c = 0; c < ncandidates; c++)
+                fitness[c] = (double) t.candidates[c].score /
+                             (t.candidates[c].games ? t.candidates[c].games : 1);
+            rank(order, ncandidates, t.candidates, fitness);
+
+            /* Candidates far behind the last elite cannot catch up. Those
+             * still playing rank first, so it is one of them, unless too
+             * few are left to cut any.
+             */
+            if (nactive <= nelites || round == rounds - 1)
+                continue;
+            double cut = fitness[order[nelites - 1]] / 2;
+            for (int c = 0; c < ncandidates; c++)
+                if (t.candidates[c].active && fitness[c] < cut)
+                    t.candidates[c].active = false;
+        }
+
+        /* move the distribution onto the elites */
+        for (int i = 0; i < NPARAMS; i++) {
+            double mean = 0, var = 0;
+            for (int e = 0; e < nelites; e++)
+                mean += *weight(&t.candidates[order[e]].weights, i);
+            mean /= nelites;
+            for (int e = 0; e < nelites; e++) {
+                double d = *weight(&t.candidates[order[e]].weights, i) - mean;
+                var += d * d;
+            }
+            s.mean[i] = mean;
+            s.sigma[i] = sqrt(var / nelites) + MIN_SIGMA;
+        }
+
+        /* the leader is never cut, and ranks above those that were, so it
+         * played every game
+         */
+        struct candidate *top = &t.candidates[order[0]];
+        if (fitness[order[0]] > s.best_fitness) {
+            s.best_fitness = fitness[order[0]];
+            for (int i = 0; i < NPARAMS; i++)
+                s.best[i] = *weight(&top->weights, i);
+        }
+        s.generation++;
+
+        double elapsed = now() - start;
+        double elite = 0;
+        for (int e = 0; e < nelites; e++)
+            elite += fitness[order[e]];
+        printf("gen %4d: best %.1f, elite mean %.1f, %lld games in %.2f s "
+               "(%.0f games/sec)\n",
+               s.generation, fitness[order[0]], elite / nelites, played,
+               elapsed, played / elapsed);
+        fflush(stdout);
+
+        if (checkpoint && !save_state(checkpoint, &s))
+            fprintf(stderr, "Fail to save %s\n", checkpoint);
+    }
+
+    printf("best weights (mean score %.1f):\n", s.best_fitness);
+    for (int i = 0; i < NPARAMS; i++)
+        printf("    .%s = %g,\n", params[i].name, s.best[i]);
+
+    pool_destroy(pool);
+    free(order);
+    free(fitness);
+    free(t.results);
+    free(t.active);
+    free(t.candidates);
+    return 0;
+}
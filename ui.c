@@ -4,8 +4,17 @@
  * found in the LICENSE file.
  */
 
+#define _XOPEN_SOURCE 700 /* pread, clock_gettime */
+
+#include <fcntl.h>
 #include <ncurses.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "tetris.h"
 
@@ -15,9 +24,59 @@
         waddch((window), ACS_CKBOARD);                            \
     } while (0)
 
+#define PRINT_EMPTY(window, pos_y, pos_x) \
+    mvwaddstr((window), (pos_y), ((pos_x) << 1), "  ")
+
 #define GAME_INPUT_TIMEOUT 1000 /* getch() timeout */
 
+static bool active; /* between init_ui() and deinit_ui() */
 static WINDOW *win_main, *win_game, *win_quit, *win_next, *win_score;
+static WINDOW *win_hud;
+
+/* The game board as last drawn, so that a frame only redraws the cells
+ * that changed. Anything else drawing over the board makes it stale, and
+ * the next frame redraws the board whole.
+ */
+static bool shown[GAME_BOARD_HEIGHT][GAME_BOARD_WIDTH];
+static bool redraw_all = true;
+
+/* the level banner over rows 7 to 9 of the board, 0 for none */
+#define BANNER_ROW 7
+static int banner_level;
+
+static struct ui_stats stats;
+static unsigned long long written_at_init;
+
+/* the counter in /proc of the thread drawing the board, kept open; -2 until
+ * opened, -1 without /proc
+ */
+static int io_fd = -2;
+static pthread_t io_thread;
+
+/* Bytes written so far by the process, or by the calling thread, as the
+ * kernel counts them in /proc. curses writes straight to the file
+ * descriptor of the terminal, so this is how its output is measured.
+ * Returns 0 where /proc is not available.
+ */
+static unsigned long long bytes_written(int fd)
+{
+    char buf[512];
+    ssize_t n = fd < 0 ? -1 : pread(fd, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    const char *wchar = strstr(buf, "wchar: ");
+    return wchar ? strtoull(wchar + 7, NULL, 10) : 0;
+}
+
+static unsigned long long process_bytes_written(void)
+{
+    int fd = open("/proc/self/io", O_RDONLY);
+    unsigned long long bytes = bytes_written(fd);
+    if (fd >= 0)
+        close(fd);
+    return bytes;
+}
 
 int snooze(int ms)
 {
@@ -41,7 +100,9 @@ static bool validate_screensize(int x, int y)
 bool init_ui(void)
 {
     int current_x, current_y;
+    written_at_init = process_bytes_written();
     initscr();
+    active = true;
     getmaxyx(stdscr, current_y, current_x);
 
     /* check if the current window size is big enough */
@@ -64,8 +125,10 @@ bool init_ui(void)
     win_quit = newwin(7, 24, start_y + 7, start_x + 14);
     win_next = newwin(4, 8, start_y + 5, start_x + 48);
     win_score = newwin(7, 8, start_y + 14, start_x + 63);
+    win_hud = newwin(HUD_LINES, HUD_WIDTH, start_y + 21, start_x + 46);
 
-    if (!win_main || !win_game || !win_quit || !win_next || !win_score) {
+    if (!win_main || !win_game || !win_quit || !win_next || !win_score ||
+        !win_hud) {
         fprintf(stderr, "Fail to initialize windows\n");
         return false;
     }
@@ -78,6 +141,10 @@ bool init_ui(void)
 
 void deinit_ui(void)
 {
+    if (!active)
+        return;
+    if (win_hud)
+        delwin(win_hud);
     if (win_score)
         delwin(win_score);
     if (win_next)
@@ -91,6 +158,17 @@ void deinit_ui(void)
     erase();
     refresh();
     endwin();
+    stats.output_bytes = process_bytes_written() - written_at_init;
+    if (io_fd >= 0)
+        close(io_fd);
+    io_fd = -2;
+    active = false;
+    win_main = win_game = win_quit = win_next = win_score = win_hud = NULL;
+}
+
+void get_ui_stats(struct ui_stats *out)
+{
+    *out = stats;
 }
 
 void init_game_screen(void)
@@ -129,8 +207,14 @@ void init_game_screen(void)
 }
 
 input_t get_user_input(void)
+{
+    return wait_user_input(GAME_INPUT_TIMEOUT);
+}
+
+input_t wait_user_input(int timeout)
 {
     input_t result;
+    wtimeout(win_game, timeout);
     switch (wgetch(win_game)) {
     case ERR: /* timeout */
         result = INPUT_TIMEOUT;
@@ -156,6 +240,10 @@ input_t get_user_input(void)
     case 'q':
         result = INPUT_PAUSE_QUIT;
         break;
+    case KEY_RESIZE:
+        __atomic_store_n(&redraw_all, true, __ATOMIC_RELAXED);
+        result = INPUT_INVALID;
+        break;
     default:
         result = INPUT_INVALID;
         break;
@@ -242,6 +330,7 @@ bool show_quit_dialog(void)
     }
 
     werase(win_quit);
+    __atomic_store_n(&redraw_all, true, __ATOMIC_RELAXED);
     return (choice == RESUME);
 #undef MESSAGE_RESUME
 #undef MESSAGE_QUIT
@@ -256,74 +345,113 @@ void draw_next_block(block_t type, degree_t orientation)
     wrefresh(win_next);
 }
 
-void draw_game_board(struct block *block)
+static unsigned long long cpu_time_ns(void)
 {
-    werase(win_game);
-    for (int i = 1; i < GAME_BOARD_HEIGHT + 1; i++) {
-        for (int j = 1; j < GAME_BOARD_WIDTH + 1; j++) {
-            if (board[i][j])
-                PRINT_BLOCK(win_game, i - 1, j - 1);
-        }
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void draw_game_board(const struct tetris_game *game)
+{
+    /* one thread draws at a time, but not always the same one */
+    if (io_fd == -2 || !pthread_equal(io_thread, pthread_self())) {
+        if (io_fd >= 0)
+            close(io_fd);
+        io_fd = open("/proc/thread-self/io", O_RDONLY);
+        io_thread = pthread_self();
     }
 
-    if (block) {
+    unsigned long long written = bytes_written(io_fd);
+    unsigned long long start = cpu_time_ns();
+    bool frame[GAME_BOARD_HEIGHT][GAME_BOARD_WIDTH];
+
+    for (int i = 1; i < GAME_BOARD_HEIGHT + 1; i++) {
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++)
+            frame[i - 1][j] = game->color[i][j];
+    }
+    if (game->has_block) {
+        const struct block *block = &game->current;
         for (int i = 0; i < ARRAY_SIZE(block->position->pos); i++)
-            PRINT_BLOCK(win_game, block->origin.y + block->position->pos[i].y,
-                        block->origin.x + block->position->pos[i].x);
+            frame[block->origin.y + block->position->pos[i].y]
+                 [block->origin.x + block->position->pos[i].x] = true;
+    }
+
+    bool full = __atomic_exchange_n(&redraw_all, false, __ATOMIC_RELAXED);
+    if (full) {
+        werase(win_game);
+        stats.full_frames++;
+    }
+    for (int i = 0; i < GAME_BOARD_HEIGHT; i++) {
+        /* the rows under the banner are redrawn once it is down */
+        if (banner_level && i >= BANNER_ROW && i < BANNER_ROW + 3)
+            continue;
+        for (int j = 0; j < GAME_BOARD_WIDTH; j++) {
+            if (full ? !frame[i][j] : frame[i][j] == shown[i][j])
+                continue;
+            if (frame[i][j])
+                PRINT_BLOCK(win_game, i, j);
+            else
+                PRINT_EMPTY(win_game, i, j);
+            shown[i][j] = frame[i][j];
+            stats.cells++;
+        }
+    }
+    if (full)
+        memcpy(shown, frame, sizeof(shown));
+    if (full && banner_level) {
+        const char *message =
+            "                        "
+            "     L E V E L   %02d     "
+            "                        ";
+        wattron(win_game, A_REVERSE | A_BOLD);
+        mvwprintw(win_game, BANNER_ROW, 0, message, banner_level);
+        wattroff(win_game, A_REVERSE | A_BOLD);
     }
     wrefresh(win_game);
+
+    stats.cpu_ns += cpu_time_ns() - start;
+    stats.bytes += bytes_written(io_fd) - written;
+    stats.frames++;
 }
 
-void draw_score_board(struct game_score *score)
+void draw_score_board(const struct game_score *score)
 {
     mvwprintw(win_score, 0, 0, "%-8d\n%-8d%-8d%-8d", score->level,
               score->rows_cleared, score->total_rows, score->score);
     wrefresh(win_score);
 }
 
-void draw_level_info(int level)
+void draw_debug_hud(const char text[HUD_LINES][HUD_WIDTH + 1])
 {
-    const char *message =
-        "                        "
-        "     L E V E L   %02d     "
-        "                        ";
-    wattron(win_game, A_REVERSE | A_BOLD);
-    mvwprintw(win_game, 7, 0, message, level);
-    wattroff(win_game, A_REVERSE | A_BOLD);
-
-    wrefresh(win_game);
-    wtimeout(win_game, 1500); /* timeout of 1.5 secs for the getch() below */
-    flushinp();
-    wgetch(win_game);
+    werase(win_hud);
+    for (int i = 0; text && i < HUD_LINES; i++)
+        mvwaddnstr(win_hud, i, 0, text[i], HUD_WIDTH);
+    wrefresh(win_hud);
+}
 
-    /* restore the timeout for gameplay */
-    wtimeout(win_game, GAME_INPUT_TIMEOUT);
+void show_level_banner(int level)
+{
+    banner_level = level;
+    __atomic_store_n(&redraw_all, true, __ATOMIC_RELAXED);
 }
 
-void draw_cleared_rows_animation(int *rows, int count)
+void draw_cleared_rows(const int *rows, int count, int steps, bool from_ends)
 {
 #define width (GAME_BOARD_WIDTH << 1)
-    static int direction = 0; /* animation from center or ends */
-
-    snooze(300);
-    if (++direction & 1) {
-        for (int i = 0; i <= width / 2; i++) {
-            for (int j = 0; j < count; j++) {
-                mvwaddch(win_game, rows[j], i, ' ' | A_NORMAL);
-                mvwaddch(win_game, rows[j], (width - i - 1), ' ' | A_NORMAL);
-            }
-            wrefresh(win_game);
-            snooze(30);
-        }
-    } else {
-        for (int i = width / 2; i >= 0; i--) {
-            for (int j = 0; j < count; j++) {
-                mvwaddch(win_game, rows[j], i, ' ' | A_NORMAL);
-                mvwaddch(win_game, rows[j], (width - i - 1), ' ' | A_NORMAL);
-            }
-            wrefresh(win_game);
-            snooze(30);
+    for (int step = 0; step < steps && step <= width / 2; step++) {
+        int i = from_ends ? step : width / 2 - step;
+        for (int j = 0; j < count; j++) {
+            mvwaddch(win_game, rows[j], i, ' ' | A_NORMAL);
+            mvwaddch(win_game, rows[j], (width - i - 1), ' ' | A_NORMAL);
         }
     }
+    wrefresh(win_game);
 #undef width
+
+    /* the rows are blank on screen now */
+    if (steps >= CLEARED_ROWS_STEPS) {
+        for (int j = 0; j < count; j++)
+            memset(shown[rows[j]], 0, sizeof(shown[rows[j]]));
+    }
 }
@@ -0,0 +1,588 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-verify: check submitted replays by playing them through the engine,
+ * and pass a verdict on each: accepted with the score it really reached, or
+ * rejected with the reason. Replays arrive in a spool directory, as files
+ * ending in .replay, or on a Unix stream socket, each as a 4-byte little-
+ * endian length followed by the replay. Whatever has arrived is verified as
+ * one batch on the worker pool. A file is renamed once judged, to .accepted
+ * or .rejected, and a socket client gets one line per replay, in order.
+ *
+ * Nothing is rendered and nothing sleeps: gravity runs on a virtual clock,
+ * which each tick moves forward by the period the game would have waited,
+ * so games verify at the speed of the engine and the verdict gives their
+ * length in game time. Memory is bounded by the batch size times the size
+ * of the largest replay accepted.
+ */
+
+#define _POSIX_C_SOURCE 200809L /* getopt, clock_gettime, sigaction */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gravity.h"
+#include "pool.h"
+#include "replay.h"
+
+#define SPOOL_SUFFIX ".replay"
+#define SPOOL_INTERVAL 100 /* ms between scans of an idle spool */
+
+static const char *const policies[] = {
+    [PIECES_UNIFORM] = "uniform",
+    [PIECES_BAG] = "bag",
+    [PIECES_SEQUENCE] = "sequence",
+};
+
+struct verdict {
+    const char *reason; /* NULL once accepted */
+    bool opened;        /* the configuration below is known */
+    int policy, preview;
+    unsigned long long seed;
+    uint32_t ticks;     /* played, up to the rejection if any */
+    struct game_score score;
+    unsigned long long game_ms; /* on the virtual clock */
+};
+
+struct job {
+    char *path;    /* of a spooled replay, or NULL */
+    uint8_t *data; /* of a replay read from a socket */
+    size_t size;
+    int conn; /* the socket client, -1 for the spool */
+    struct verdict verdict;
+};
+
+/* a socket client and the replay it is sending */
+struct conn {
+    int fd; /* -1 for a free slot */
+    uint8_t header[4];
+    size_t got;  /* bytes of the header, then of the replay */
+    size_t skip; /* bytes of an oversized replay left to discard */
+    uint8_t *data;
+    size_t size;
+    bool eof;
+};
+
+struct verifier {
+    const char *spool;
+    size_t max_size;
+    uint32_t max_ticks;
+    unsigned policies; /* 1 << policy for each one accepted */
+    int preview;       /* accepted, -1 for any */
+    int listener; /* -1 without a socket */
+    struct conn *conns;
+    int max_conns;
+    struct pollfd *fds; /* the listener, then the clients being read */
+    int *polled;        /* the client of each of fds[1...] */
+
+    struct job *jobs;
+    int njobs, max_jobs;
+
+    unsigned long long accepted, rejected, ticks;
+};
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Play the replay through from its header, one tick at a time, so that the
+ * clock can add the gravity period in force before each tick. Nothing is
+ * taken from the file but the configuration and the actions: each keyframe
+ * is checked against the game as it is reached, and the ticks counted are
+ * those played, whatever the trailer claims.
+ */
+static void play(const struct verifier *verifier,
+                 struct replay *replay,
+                 struct verdict *v)
+{
+    const struct tetris_config *config = &replay_info(replay)->config;
+    struct tetris_game game;
+    replay_status_t status = REPLAY_OK;
+    uint64_t game_ns = 0;
+
+    /* the dealing of the pieces is the submitter's choice, so it is checked */
+    v->opened = true;
+    v->policy = config->policy;
+    v->preview = config->preview;
+    v->seed = config->seed;
+    if (!(verifier->policies & 1U << config->policy)) {
+        v->reason = "policy not allowed";
+        return;
+    }
+    if (verifier->preview >= 0 && config->preview != verifier->preview) {
+        v->reason = "preview not allowed";
+        return;
+    }
+
+    replay_start(replay, &game);
+    while (status == REPLAY_OK && !replay_ended(replay)) {
+        if (game.ticks >= verifier->max_ticks) {
+            v->reason = "too many ticks";
+            break;
+        }
+        uint32_t ticks = game.ticks;
+        uint64_t period = gravity_period(&game); /* as the game waits */
+        status = replay_advance(replay, &game, ticks + 1);
+        if (game.ticks > ticks)
+            game_ns += period;
+    }
+
+    v->ticks = game.ticks;
+    v->score = game.score;
+    v->game_ms = game_ns / 1000000;
+    if (status != REPLAY_OK)
+        v->reason = replay_error(replay);
+}
+
+static void verify_job(void *arg, int i, int worker)
+{
+    struct verifier *verifier = arg;
+    struct job *job = &verifier->jobs[i];
+    struct replay *replay;
+    (void) worker;
+
+    if (job->verdict.reason) /* judged on arrival */
+        return;
+
+    if (job->path) {
+        struct stat st;
+        if (stat(job->path, &st)) {
+            job->verdict.reason = "unreadable";
+            return;
+        }
+        if ((size_t) st.st_size > verifier->max_size) {
+            job->verdict.reason = "too large";
+            return;
+        }
+        replay = replay_open(job->path);
+    } else {
+        replay = replay_open_memory(job->data, job->size);
+    }
+    if (!replay) {
+        job->verdict.reason = "not a replay";
+        return;
+    }
+    play(verifier, replay, &job->verdict);
+    replay_close(replay);
+}
+
+static struct job *add_job(struct verifier *v, int conn)
+{
+    struct job *job = &v->jobs[v->njobs++];
+    *job = (struct job){.conn = conn};
+    return job;
+}
+
+/* queue the replays waiting in the spool, as many as the batch holds */
+static int scan_spool(struct verifier *v)
+{
+    DIR *dir = opendir(v->spool);
+    if (!dir)
+        return -1;
+
+    size_t suffix = strlen(SPOOL_SUFFIX);
+    struct dirent *entry;
+    while (v->njobs < v->max_jobs && (entry = readdir(dir))) {
+        size_t length = strlen(entry->d_name);
+        if (length <= suffix ||
+            strcmp(entry->d_name + length - suffix, SPOOL_SUFFIX))
+            continue;
+
+        char *path = malloc(strlen(v->spool) + length + 2);
+        if (!path)
+            break;
+        sprintf(path, "%s/%s", v->spool, entry->d_name);
+        add_job(v, -1)->path = path;
+    }
+    closedir(dir);
+    return 0;
+}
+
+static void close_conn(struct conn *c)
+{
+    close(c->fd);
+    free(c->data);
+    *c = (struct conn){.fd = -1};
+}
+
+static void accept_conns(struct verifier *v)
+{
+    for (;;) {
+        int fd = accept(v->listener, NULL, NULL);
+        if (fd < 0)
+            return;
+
+        int i = 0;
+        while (i < v->max_conns && v->conns[i].fd >= 0)
+            i++;
+        if (i == v->max_conns) { /* full: turn the client away */
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        v->conns[i] = (struct conn){.fd = fd};
+    }
+}
+
+/* Read what a client sent, queueing every complete replay. A replay over
+ * the size limit is discarded as it arrives and queued already rejected, so
+ * that its verdict still comes in order.
+ */
+static void read_conn(struct verifier *v, int i)
+{
+    struct conn *c = &v->conns[i];
+    uint8_t discard[4096];
+
+    while (v->njobs < v->max_jobs && !c->eof) {
+        uint8_t *buf;
+        size_t want;
+        if (c->skip) {
+            buf = discard;
+            want = c->skip < sizeof(discard) ? c->skip : sizeof(discard);
+        } else if (c->got < sizeof(c->header)) {
+            buf = c->header + c->got;
+            want = sizeof(c->header) - c->got;
+        } else {
+            buf = c->data + (c->got - sizeof(c->header));
+            want = c->size - (c->got - sizeof(c->header));
+        }
+
+        ssize_t n = read(c->fd, buf, want);
+        if (n <= 0) {
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                c->eof = true;
+            return;
+        }
+        if (c->skip) {
+            c->skip -= n;
+            continue;
+        }
+        c->got += n;
+
+        if (c->got == sizeof(c->header)) { /* the length is in */
+            c->size = c->header[0] | (size_t) c->header[1] << 8 |
+                      (size_t) c->header[2] << 16 |
+                      (size_t) c->header[3] << 24;
+            const char *reason = NULL;
+            if (c->size > v->max_size)
+                reason = "too large";
+            else if (c->size && !(c->data = malloc(c->size)))
+                reason = "out of memory";
+            if (reason) {
+                add_job(v, i)->verdict.reason = reason;
+                c->skip = c->size;
+                c->got = 0;
+                continue;
+            }
+        }
+        if (c->got == sizeof(c->header) + c->size) {
+            struct job *job = add_job(v, i);
+            job->data = c->data;
+            job->size = c->size;
+            c->data = NULL;
+            c->got = 0;
+        }
+    }
+}
+
+/* wait up to 'timeout' ms for clients, then queue what they sent */
+static void poll_conns(struct verifier *v, int timeout)
+{
+    struct pollfd *fds = v->fds;
+    int n = 0;
+
+    fds[n++] = (struct pollfd){.fd = v->listener, .events = POLLIN};
+    for (int i = 0; i < v->max_conns; i++) {
+        if (v->conns[i].fd >= 0 && !v->conns[i].eof) {
+            v->polled[n] = i;
+            fds[n++] = (struct pollfd){.fd = v->conns[i].fd, .events = POLLIN};
+        }
+    }
+    if (poll(fds, n, timeout) <= 0)
+        return;
+
+    if (fds[0].revents)
+        accept_conns(v);
+    for (int k = 1; k < n && v->njobs < v->max_jobs; k++)
+        if (fds[k].revents)
+            read_conn(v, v->polled[k]);
+}
+
+static void format_verdict(const struct verdict *v, char *line, size_t size)
+{
+    int n;
+    if (v->reason)
+        n = snprintf(line, size, "reject\t%s at tick %u", v->reason, v->ticks);
+    else
+        n = snprintf(line, size, "accept\t%d\t%d\t%d\t%u\t%llu",
+                     v->score.score, v->score.total_rows, v->score.level,
+                     v->ticks, v->game_ms);
+    if (n < 0 || (size_t) n >= size)
+        return;
+
+    /* how the pieces were dealt, unknown if the replay did not open */
+    if (v->opened)
+        snprintf(line + n, size - n, "\t%s\t%llu\t%d", policies[v->policy],
+                 v->seed, v->preview);
+    else
+        snprintf(line + n, size - n, "\t-\t-\t-");
+}
+
+/* log every verdict, then answer the clients and rename the spooled files */
+static void deliver(struct verifier *v)
+{
+    for (int i = 0; i < v->njobs; i++) {
+        struct job *job = &v->jobs[i];
+        char line[256];
+
+        format_verdict(&job->verdict, line, sizeof(line));
+        if (job->verdict.reason)
+            v->rejected++;
+        else
+            v->accepted++;
+        v->ticks += job->verdict.ticks;
+
+        if (job->path) {
+            printf("%s\t%s\n", job->path, line);
+            char judged[4096];
+            int length = (int) (strlen(job->path) - strlen(SPOOL_SUFFIX));
+            snprintf(judged, sizeof(judged), "%.*s%s", length, job->path,
+                     job->verdict.reason ? ".rejected" : ".accepted");
+            if (rename(job->path, judged)) {
+                /* it would be judged again and again */
+                perror(job->path);
+                stopping = 1;
+            }
+        } else {
+            struct conn *c = &v->conns[job->conn];
+            printf("@%d\t%s\n", job->conn, line);
+            strcat(line, "\n");
+            size_t length = strlen(line);
+            if (c->fd >= 0 &&
+                send(c->fd, line, length, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+                    (ssize_t) length)
+                close_conn(c); /* a client that does not read is dropped */
+        }
+        free(job->path);
+        free(job->data);
+    }
+    fflush(stdout);
+    v->njobs = 0;
+}
+
+static int listen_on(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 64)) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+/* the policy named 'name', or -1 */
+static int find_policy(const char *name)
+{
+    for (int i = 0; i < ARRAY_SIZE(policies); i++)
+        if (!strcmp(name, policies[i]))
+            return i;
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-d spool-dir [-1]] [-u socket] [-j threads]\n"
+            "          [-b batch] [-m max-bytes] [-t max-ticks] [-c clients]\n"
+            "          [-P policy]... [-p preview]\n"
+            "  -d  verify the files ending in " SPOOL_SUFFIX
+            " in a directory; put\n"
+            "      them there by renaming, once completely written\n"
+            "  -1  stop once the spool is empty\n"
+            "  -u  accept replays on a Unix socket, each sent as a 4-byte\n"
+            "      little-endian length and the replay\n"
+            "  -j  worker threads, 0 for one per CPU (default 0)\n"
+            "  -b  replays verified at once (default 256)\n"
+            "  -m  reject replays larger than this (default 1048576)\n"
+            "  -t  reject games longer than this many ticks\n"
+            "      (default 16777216)\n"
+            "  -c  clients connected at once (default 64)\n"
+            "  -P  accept games dealt by this policy, uniform, bag or\n"
+            "      sequence, once per policy (default uniform and bag)\n"
+            "  -p  accept only games showing this many next blocks\n"
+            "      (default any)\n"
+            "Verdicts, one line per replay, ending with how the pieces were\n"
+            "dealt, or - - - if unknown:\n"
+            "  accept <score> <lines> <level> <ticks> <game-ms> <policy>\n"
+            "         <seed> <preview>\n"
+            "  reject <reason> at tick <tick> <policy> <seed> <preview>\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct verifier v = {.max_size = 1 << 20,
+                         .max_ticks = 1 << 24,
+                         .listener = -1,
+                         .max_conns = 64,
+                         .max_jobs = 256,
+                         .policies = 1U << PIECES_UNIFORM | 1U << PIECES_BAG,
+                         .preview = -1};
+    const char *socket_path = NULL;
+    bool once = false;
+    bool policy_given = false;
+    int nthreads = 0, policy, opt;
+
+    while ((opt = getopt(argc, argv, "d:1u:j:b:m:t:c:P:p:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            v.spool = optarg;
+            break;
+        case '1':
+            once = true;
+            break;
+        case 'u':
+            socket_path = optarg;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'b':
+            v.max_jobs = atoi(optarg);
+            break;
+        case 'm':
+            v.max_size = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            v.max_ticks = (uint32_t) strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            v.max_conns = atoi(optarg);
+            break;
+        case 'P':
+            policy = find_policy(optarg);
+            if (policy < 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            if (!policy_given)
+                v.policies = 0;
+            policy_given = true;
+            v.policies |= 1U << policy;
+            break;
+        case 'p':
+            v.preview = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : -1;
+        }
+    }
+    if ((!v.spool && !socket_path) || (once && (!v.spool || socket_path)) ||
+        v.max_jobs <= 0 || v.max_conns <= 0 || v.preview < -1 ||
+        v.preview > TETRIS_PREVIEW_MAX) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    struct sigaction sa = {.sa_handler = stop};
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    struct pool *pool = pool_create(nthreads);
+    v.jobs = calloc(v.max_jobs, sizeof(*v.jobs));
+    v.conns = calloc(v.max_conns, sizeof(*v.conns));
+    v.fds = calloc(v.max_conns + 1, sizeof(*v.fds));
+    v.polled = calloc(v.max_conns + 1, sizeof(*v.polled));
+    if (!pool || !v.jobs || !v.conns || !v.fds || !v.polled) {
+        fprintf(stderr, "Fail to start worker threads\n");
+        return -1;
+    }
+    for (int i = 0; i < v.max_conns; i++)
+        v.conns[i].fd = -1;
+    if (socket_path && (v.listener = listen_on(socket_path)) < 0) {
+        fprintf(stderr, "Fail to listen on %s\n", socket_path);
+        return -1;
+    }
+
+    double start = now();
+    while (!stopping) {
+        if (v.spool && scan_spool(&v)) {
+            fprintf(stderr, "Fail to read the spool %s\n", v.spool);
+            break;
+        }
+        if (v.listener >= 0)
+            poll_conns(&v, v.njobs ? 0 : v.spool ? SPOOL_INTERVAL : -1);
+
+        if (v.njobs) {
+            pool_run(pool, v.njobs, verify_job, &v);
+            deliver(&v);
+        } else if (once) {
+            break;
+        } else if (v.listener < 0) {
+            struct timespec idle = {0, SPOOL_INTERVAL * 1000000L};
+            nanosleep(&idle, NULL);
+        }
+
+        /* a client that hung up had all its replays answered above */
+        for (int i = 0; i < v.max_conns; i++)
+            if (v.conns[i].fd >= 0 && v.conns[i].eof)
+                close_conn(&v.conns[i]);
+    }
+    double elapsed = now() - start;
+
+    unsigned long long total = v.accepted + v.rejected;
+    fprintf(stderr,
+            "verified %llu replays, %llu accepted, %llu rejected: "
+            "%.0f replays/sec, %.0f ticks/sec on %d threads\n",
+            total, v.accepted, v.rejected, total / elapsed, v.ticks / elapsed,
+            pool_size(pool));
+
+    for (int i = 0; i < v.max_conns; i++)
+        if (v.conns[i].fd >= 0)
+            close_conn(&v.conns[i]);
+    if (v.listener >= 0) {
+        close(v.listener);
+        unlink(socket_path);
+    }
+    pool_destroy(pool);
+    free(v.polled);
+    free(v.fds);
+    free(v.conns);
+    free(v.jobs);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/* Copyright (c) 2020 National Cheng Kung University, Taiwan.
+ * All rights reserved.
+ * Use of this source code is governed by a MIT license that can be
+ * found in the LICENSE file.
+ */
+
+/* tetris-watch: spectate a game played with 'tetris -S socket'. The game
+ * sends its view as keyframes and deltas, see broadcast.h; this applies
+ * them to a copy of the view and draws it with the front end of the game,
+ * once per batch of messages read.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "broadcast.h"
+#include "tetris.h"
+
+static int connect_to(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* Draw what changed of the view, which a keyframe started. */
+static void draw_view(const struct view *view, const struct view *shown)
+{
+    static struct tetris_game game;
+
+    if (!shown || view->next.type != shown->next.type ||
+        view->next.orientation != shown->next.orientation)
+        draw_next_block(view->next.type, view->next.orientation);
+    if (!shown || memcmp(&view->score, &shown->score, sizeof(view->score)))
+        draw_score_board(&view->score);
+    view_to_game(view, &game);
+    draw_game_board(&game);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s socket\n", argv[0]);
+        return -1;
+    }
+    int fd = connect_to(argv[1]);
+    if (fd < 0) {
+        fprintf(stderr, "Fail to connect to %s\n", argv[1]);
+        return -1;
+    }
+
+    if (atexit(deinit_ui)) {
+        fprintf(stderr, "Fail to register exit handlers\n");
+        return -1;
+    }
+    if (!init_ui()) {
+        fprintf(stderr, "Fail to initialize UI\n");
+        return -1;
+    }
+    init_game_screen();
+
+    struct view view = {0}, shown;
+    bool started = false, drawn = false; /* by a keyframe, and on screen */
+    const char *error = NULL;
+    uint8_t buf[4096];
+    size_t len = 0;
+
+    while (!error && !view.game_over) {
+        struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN},
+                                {.fd = fd, .events = POLLIN}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            error = "poll failed";
+            break;
+        }
+
+        if (fds[0].revents) {
+            input_t input;
+            while ((input = wait_user_input(0)) != INPUT_TIMEOUT)
+                if (input == INPUT_PAUSE_QUIT)
+                    break;
+            if (input == INPUT_PAUSE_QUIT)
+                break;
+        }
+        if (!fds[1].revents)
+            continue;
+
+        ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            error = "the game left";
+            break;
+        }
+        len += n;
+
+        size_t done = 0;
+        for (int used; done < len; done += used) {
+            /* the game starts everyone on a keyframe */
+            used = !started && buf[done] != 'K'
+                       ? -1
+                       : view_decode(&view, buf + done, len - done);
+            if (used < 0)
+                error = "malformed message";
+            if (used <= 0)
+                break;
+            started = true;
+        }
+        memmove(buf, buf + done, len - done);
+        len -= done;
+
+        if (started && !error) {
+            draw_view(&view, drawn ? &shown : NULL);
+            shown = view;
+            drawn = true;
+        }
+    }
+
+    deinit_ui();
+    close(fd);
+    if (started)
+        printf("%s: score %d, %d rows, level %d\n",
+               view.game_over ? "Game over" : "Left", view.score.score,
+               view.score.total_rows, view.score.level);
+    if (error && !view.game_over) {
+        fprintf(stderr, "%s\n", error);
+        return -1;
+    }
+    return 0;
+}